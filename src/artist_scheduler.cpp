@@ -0,0 +1,161 @@
+
+#include "artist_scheduler.h"
+#include "player_constants.h"
+#include "common/logging.h"
+#include "common/maths.h"
+#include "common/my_string.h"
+#include <climits>
+#include <functional>
+#include <queue>
+#include <set>
+#include <tr1/unordered_map>
+
+using namespace std;
+
+// Songs by a single artist, used while scheduling:
+struct scheduled_artist {
+  string strname;   // Normalised artist name
+  vector<int> songs; // Indexes into the original playlist, in playlist order
+
+  set<int> remaining; // Songs (indexes into [songs]) not yet scheduled
+  set<int> available; // Remaining songs which won't have played recently by now
+  // Songs which played recently, keyed by the slot at which they become available:
+  priority_queue<pair<long, int>, vector<pair<long, int> >, greater<pair<long, int> > > waiting;
+};
+
+artist_scheduler::artist_scheduler() {
+  intproblems = 0;
+}
+
+void artist_scheduler::schedule(vector<string> & file_list, mp3_tags & mp3tags, const music_history & musichistory) {
+  // Alternate the MP3s in file_list by artist, and try to ensure that songs in the
+  // new playlist won't be skipped because they were played recently (this can cause
+  // songs by the same artist to play sooner than expected)
+  intproblems = 0;
+
+  // How long until a song is allowed to repeat? Songs further back than the in-memory
+  // music history are forgotten, so they don't count either.
+  long lngrepeat_window = MIN((long)(file_list.size() * intprevent_song_repeat_factor) / 100,
+                              (long)music_history::max_history_length);
+
+  // Group the songs by artist. Artist ids are given out in the order we encounter them.
+  // Names are only normalised once per distinct mp3 artist, via the tag cache's artist ids.
+  vector<scheduled_artist> artists;
+  tr1::unordered_map<string, int> artist_ids;
+  vector<int> tag_artist_ids; // mp3_tags artist id -> our artist id, or -1 if not seen yet
+  for (unsigned int i = 0; i < file_list.size(); ++i) {
+    // If the song is an MP3 then get the artist. Otherwise assume no artist.
+    unsigned int inttag_artist = 0;
+    bool blnmp3 = right(lcase(file_list[i]), 4) == ".mp3";
+    if (blnmp3) {
+      inttag_artist = mp3tags.get_mp3_artist_id(file_list[i]);
+      if (inttag_artist >= tag_artist_ids.size()) tag_artist_ids.resize(inttag_artist + 1, -1);
+      if (tag_artist_ids[inttag_artist] != -1) {
+        artists[tag_artist_ids[inttag_artist]].songs.push_back(i);
+        continue;
+      }
+    }
+    string strartist = blnmp3 ? lcase(trim(mp3tags.get_artist_name(inttag_artist))) : "";
+
+    tr1::unordered_map<string, int>::const_iterator it = artist_ids.find(strartist);
+    int intartist = -1;
+    if (it == artist_ids.end()) {
+      intartist = artists.size();
+      artist_ids[strartist] = intartist;
+      artists.push_back(scheduled_artist());
+      artists.back().strname = strartist;
+    }
+    else intartist = it->second;
+    if (blnmp3) tag_artist_ids[inttag_artist] = intartist;
+    artists[intartist].songs.push_back(i);
+  }
+
+  // Check the music history: how many songs ago did each song and artist last play?
+  tr1::unordered_map<string, long> song_age;
+  vector<long> artist_age(artists.size(), -1);
+  {
+    vector<music_history::history_item> history = musichistory.get_history_items(); // Most recent first
+    for (unsigned int age = 0; age < history.size(); ++age) {
+      // (insert() doesn't replace existing entries, so we keep the most recent play)
+      song_age.insert(make_pair(history[age].strfile, (long)age));
+      if (history[age].blnartist_known) {
+        tr1::unordered_map<string, int>::const_iterator it = artist_ids.find(lcase(trim(history[age].strartist)));
+        if (it != artist_ids.end() && artist_age[it->second] == -1) {
+          artist_age[it->second] = age;
+        }
+      }
+    }
+  }
+
+  // Work out when each song becomes available:
+  for (vector<scheduled_artist>::iterator artist = artists.begin(); artist != artists.end(); ++artist) {
+    for (unsigned int j = 0; j < artist->songs.size(); ++j) {
+      artist->remaining.insert(j);
+      tr1::unordered_map<string, long>::const_iterator it = song_age.find(file_list[artist->songs[j]]);
+      if (it == song_age.end() || it->second >= lngrepeat_window) {
+        artist->available.insert(j);
+      }
+      else {
+        // Played recently. It becomes available once enough other songs have played:
+        artist->waiting.push(make_pair(lngrepeat_window - it->second, j));
+      }
+    }
+  }
+
+  // Queue the artists. Artists take turns, so the next artist is the one whose last
+  // turn was longest ago. Artists that haven't played before go first (in the order
+  // we found them), then artists from the music history (most recently played last).
+  typedef pair<long, int> artist_turn; // When the artist last played, artist id
+  priority_queue<artist_turn, vector<artist_turn>, greater<artist_turn> > turns;
+  for (unsigned int intartist = 0; intartist < artists.size(); ++intartist) {
+    long lnglast_played = artist_age[intartist] == -1 ? LONG_MIN : -1 - artist_age[intartist];
+    turns.push(make_pair(lnglast_played, intartist));
+  }
+
+  // Now produce an artist-alternating output:
+  vector<string> new_list;
+  new_list.reserve(file_list.size());
+  while (!turns.empty()) {
+    long lngslot = new_list.size();
+    scheduled_artist & artist = artists[turns.top().second];
+    int intartist = turns.top().second;
+    turns.pop();
+
+    // Songs which have been waiting long enough become available now:
+    while (!artist.waiting.empty() && artist.waiting.top().first <= lngslot) {
+      int j = artist.waiting.top().second;
+      artist.waiting.pop();
+      if (artist.remaining.count(j) > 0) artist.available.insert(j);
+    }
+
+    // Find a song by the artist which hasn't played recently:
+    int j = -1;
+    if (!artist.available.empty()) {
+      j = *artist.available.begin();
+    }
+    else {
+      intproblems++;
+      log_debug("Problem alternating playlist artists: Can't find a song by \"" +
+        artist.strname + "\" that won't have played recently by slot " +
+        itostr(lngslot + 1) + " in the new playlist");
+      // But we push a song by the artist into the playlist anyway, so that the
+      // artist alternation doesn't get undermined.
+      j = *artist.remaining.begin();
+    }
+
+    // Add the song to the playlist:
+    new_list.push_back(file_list[artist.songs[j]]);
+    artist.remaining.erase(j);
+    artist.available.erase(j);
+
+    // The artist takes another turn later, if they have songs left:
+    if (!artist.remaining.empty()) {
+      turns.push(make_pair(lngslot, intartist));
+    }
+  }
+
+  file_list.swap(new_list);
+
+  // Log a warning if we had problems alternating artists:
+  if (intproblems > 0) log_warning("Had " + itostr(intproblems) + " problems while alternating playlist artists. See debug log for more info.");
+}
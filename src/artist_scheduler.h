@@ -0,0 +1,38 @@
+
+#ifndef ARTIST_SCHEDULER_H
+#define ARTIST_SCHEDULER_H
+
+#include "music_history.h"
+#include "common/mp3_tags.h"
+
+#include <string>
+#include <vector>
+
+/// Re-orders music playlists so that songs by the same artist are spread out
+/// as far as possible, and so that songs don't play again too soon after
+/// they were last played (according to the music history).
+///
+/// Artists take turns (round-robin) in the order they first appear in the
+/// playlist, except that artists from the music history go to the back of
+/// the queue (most recently played last). Each turn plays the artist's first
+/// remaining song that won't have played recently by that point.
+///
+/// Artists are kept in a priority queue keyed by when they last played, and
+/// each artist's songs in a queue keyed by when they become available again,
+/// so scheduling takes O(n log n) time.
+class artist_scheduler {
+public:
+  artist_scheduler(); ///< Constructor
+
+  /// Re-order file_list, alternating the artists
+  void schedule(std::vector<std::string> & file_list, mp3_tags & mp3tags, const music_history & musichistory);
+
+  /// Number of songs from the last schedule() call which had to be placed even
+  /// though they will have played recently
+  int get_num_problems() const { return intproblems; }
+
+private:
+  int intproblems; ///< Problems encountered by the last schedule() call
+};
+
+#endif
@@ -0,0 +1,305 @@
+/// @file
+/// Benchmark for artist_scheduler. Compares the speed and output quality of the
+/// scheduler with the artist alternation function it replaced.
+///
+/// Usage: artist_scheduler_benchmark [number of songs] [number of artists]
+
+#include "../artist_scheduler.h"
+#include "../music_history.h"
+#include "../player_constants.h"
+#include "../common/exception.h"
+#include "../common/file.h"
+#include "../common/my_string.h"
+#include "../common/temp_dir.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <sys/time.h>
+#include <tr1/unordered_map>
+
+using namespace std;
+
+// mp3_tags with synthetic tags, so the benchmark doesn't need real mp3s:
+class fake_mp3_tags : public mp3_tags {
+public:
+  map<string, string> artists;
+  string_pool artist_names;
+  virtual string get_mp3_artist(const string & strFilePath) { return artists[strFilePath]; }
+  virtual unsigned int get_mp3_artist_id(const string & strFilePath) { return artist_names.intern(artists[strFilePath]); }
+  virtual string get_artist_name(const unsigned int intArtistId) { return artist_names.get(intArtistId); }
+  virtual string get_mp3_description(const string & strFilePath) { return artists[strFilePath] + " - " + get_short_filename(strFilePath); }
+};
+
+static void legacy_alternate_file_list_artists(vector<string> & file_list, mp3_tags & mp3tags, const music_history & musichistory) {
+  // The artist alternation used by segment::generate_playlist before artist_scheduler.
+  // - Alternate the MP3s in file_list by artist.
+  // - Also try to ensure that songs in the alternated playlist won't be skipped
+  //   because they were played recently (this can cause songs by the same
+  //   artist to play sooner than expected)
+
+  int intproblems = 0; // Count the number of problems encountered while alternating.
+
+  // Make a copy of the music history object for this function to abuse:
+  music_history history(musichistory);
+
+  typedef vector<string> artist_mp3s; // Listing songs by a single artist;
+  map <string, artist_mp3s> mp3s; // MP3s, sorted by artist
+
+  // Also keep a list of the artists, in the order we encountered them.
+  // This is because "map" objects always sort their data by key, but we want
+  // to access the data by the order we originally encountered the artists in
+  list <string> artists; // Using a list so we can delete & insert elements without invalidating iterators
+
+  // How long until a song is allowed to repeat?
+  int intmin_songs_before_song_repeat = (file_list.size() * intprevent_song_repeat_factor) / 100;
+
+  // Go through all the media, sort by artist:
+  vector<string>::const_iterator mp3_iter = file_list.begin();
+  while (mp3_iter != file_list.end()) {
+    // If the song is an MP3 then get the artist. Otherwise assume no artist.
+    string artist = "";
+    if (right(lcase(*mp3_iter), 4) == ".mp3") {
+      // An MP3. Get the artist:
+      artist = lcase(trim(mp3tags.get_mp3_artist(*mp3_iter)));
+    }
+
+    // Add the mp3 to the list of MP3s for this artist:
+    mp3s[artist].push_back(*mp3_iter);
+    // And add new artists to the list of artists (ie, in the order we found them):
+    if (find(artists.begin(), artists.end(), artist) == artists.end()) {
+      artists.push_back(artist);
+    }
+    mp3_iter++;
+  }
+
+  // Adjust the artist order according to recent history (eg, if an artist's song played just before calling
+  // this function, then ensure that songs by the same artist don't play until later)
+  {
+    // Get a list of artists from the music history (most recent artists first)
+    vector <string> recent_artists;
+    {
+//       typedef typeof(musichistory.get_history()) history_list_type;
+      typedef const std::list<std::string> history_list_type;
+      history_list_type history_list(musichistory.get_history()); // Most recent files are at the start of the list
+
+      // Proceed through recently-played music:
+      auto mp3_iter = history_list.begin(); // Start at the most recently-played file
+      int missing_count = 0; // Number of missing recently-played files
+      while (mp3_iter != history_list.end()) {
+        if (!file_exists(*mp3_iter)) {
+          missing_count++;
+          // Output the below to the cout, but not to the log file
+          // (it can be distracting for people checking the log file after they
+          // just moved music around)
+          intproblems++;
+          log_debug("Recently-played file not found, can't check the artist: " + *mp3_iter);
+        }
+        else {
+          string strartist = lcase(trim(mp3tags.get_mp3_artist(*mp3_iter)));
+          // Add the artist to the list of recent artists if it isn't already there:
+          if (find(recent_artists.begin(), recent_artists.end(), strartist) == recent_artists.end()) {
+            recent_artists.push_back(strartist);
+          }
+        }
+        mp3_iter++; // Check the next MP3 (ie, less-recently-played)
+      }
+      if (missing_count > 0) {
+        string strplural1 = (missing_count == 1 ? "" : "s");
+        string strplural2 = (missing_count == 1 ? "it's" : "their");
+        log_warning(itostr(missing_count) + " recently-played song" +
+          strplural1 + " could not be found so I couldn't check " + strplural2 +
+          " artist!");
+      }
+    }
+
+    // Now adjust our list of artists so that recently-played artists play later rather than sooner:
+    {
+      vector <string>::const_iterator recent_artist_iter = recent_artists.begin();
+      list <string>::iterator artists_back_iter = artists.end(); // Recent artists go to the back of the list of artists,
+                                                                 // but before artists that have already been moved to the back
+
+      // Proceed through our list of recent artists:
+      while (recent_artist_iter != recent_artists.end()) {
+        // Does our list of artists (for the new playlist) contain a artist for a recently-played MP3?
+        string recent_artist = *recent_artist_iter;
+        list <string>::iterator artist_iter = find(artists.begin(), artists.end(), recent_artist);
+        if (artist_iter != artists.end()) {
+          // Yes, found it. Move it to the back of the list of artists;
+          artists.insert(artists_back_iter, recent_artist);
+          artists.erase(artist_iter);
+          artists_back_iter--; // Less recent artists get pushed to the end, but before the one we just pushed.
+        }
+        recent_artist_iter++; // Now check the next recent artist
+      }
+    }
+  }
+
+  // Now produce an artist-alternating output:
+  file_list.clear();
+  list<string>::iterator artist_iter = artists.begin();
+  while (!artists.empty()) {
+    // Find a song by the artist which hasn't played recently:
+    vector<string>::iterator mp3_iter = mp3s[*artist_iter].begin(); // *** THIS BECOMES AN INVALID READ
+    while (mp3_iter != mp3s[*artist_iter].end()) {
+      if (history.song_played_recently(*mp3_iter, intmin_songs_before_song_repeat)) {
+        // Song played recently, try the next song:
+        mp3_iter++;
+      }
+      else {
+        // Song did not play recently, so use it:
+        break; // Stop searching mp3s for the artist
+      }
+    }
+
+    // Did we find a song by this artist?
+    if (mp3_iter == mp3s[*artist_iter].end()) {
+      intproblems++;
+      log_debug("Problem alternating playlist artists: Can't find a song by \"" +
+        *artist_iter + "\" that won't have played recently by slot " +
+        itostr(file_list.size() + 1) + " in the new playlist");
+      // But we push a song by the artist into the playlist anyway, so that the
+      // logic of this function doesn't get undermined (eg, what happens in
+      // weird cases when our logic thinks that all the remaining songs have been played
+      // recently?
+      mp3_iter = mp3s[*artist_iter].begin();
+    }
+
+    // Add the song to the playlist:
+    file_list.push_back(*mp3_iter);
+    history.song_played_no_db(*mp3_iter, mp3tags.get_mp3_description(*mp3_iter), mp3tags);
+    mp3s[*artist_iter].erase(mp3_iter);
+
+    // Delete the artist entry if empty
+    if (mp3s[*artist_iter].empty()) {
+      artist_iter = artists.erase(artist_iter); // *** THIS IS WHAT MAKES THE READ INVALID
+    }
+    else {
+      artist_iter++;
+    }
+
+    // Jump to the next artist's songs:
+
+    // Go back to the first artist if we've reached the last artist:
+    if (artist_iter == artists.end()) {
+      artist_iter = artists.begin();
+    }
+  }
+
+  // Log a warning if we had problems alternating artists:
+  if (intproblems > 0) log_warning("Had " + itostr(intproblems) + " problems while alternating playlist artists. See debug log for more info.");
+}
+
+
+// Milliseconds elapsed since tvstart:
+static double elapsed_ms(const timeval & tvstart) {
+  timeval tvnow;
+  gettimeofday(&tvnow, NULL);
+  return (tvnow.tv_sec - tvstart.tv_sec) * 1000.0 + (tvnow.tv_usec - tvstart.tv_usec) / 1000.0;
+}
+
+// Output quality of an artist-alternated playlist:
+struct playlist_quality {
+  long lngadjacent_same_artist;  // Songs directly following a song by the same artist
+  long lngmin_artist_gap;        // Smallest number of songs between two songs by the same artist
+  long lngrecent_songs;          // Songs which will have played recently when they are reached
+};
+
+static playlist_quality measure_quality(const vector<string> & file_list, fake_mp3_tags & tags, const music_history & history) {
+  playlist_quality quality;
+  quality.lngadjacent_same_artist = 0;
+  quality.lngmin_artist_gap = -1;
+  quality.lngrecent_songs = 0;
+
+  long lngrepeat_window = MIN((long)(file_list.size() * intprevent_song_repeat_factor) / 100,
+                              (long)music_history::max_history_length);
+
+  // How many songs ago each song played before the playlist started:
+  tr1::unordered_map<string, long> song_age;
+  list<string> recent = history.get_history();
+  long lngage = 0;
+  for (list<string>::const_iterator it = recent.begin(); it != recent.end(); ++it, ++lngage) {
+    song_age.insert(make_pair(*it, lngage));
+  }
+
+  tr1::unordered_map<string, long> last_slot; // Last slot for each artist
+  for (unsigned int i = 0; i < file_list.size(); ++i) {
+    string strartist = lcase(trim(tags.get_mp3_artist(file_list[i])));
+    tr1::unordered_map<string, long>::const_iterator it = last_slot.find(strartist);
+    if (it != last_slot.end()) {
+      long lnggap = i - it->second - 1;
+      if (lnggap == 0) quality.lngadjacent_same_artist++;
+      if (quality.lngmin_artist_gap == -1 || lnggap < quality.lngmin_artist_gap) quality.lngmin_artist_gap = lnggap;
+    }
+    last_slot[strartist] = i;
+
+    tr1::unordered_map<string, long>::const_iterator age = song_age.find(file_list[i]);
+    if (age != song_age.end() && age->second + (long)i < lngrepeat_window) quality.lngrecent_songs++;
+  }
+  return quality;
+}
+
+static void report(const string & strname, const double dblms, const playlist_quality & quality) {
+  cout << strname << ": " << dblms << " ms, "
+       << quality.lngadjacent_same_artist << " adjacent same-artist songs, "
+       << "min artist gap " << quality.lngmin_artist_gap << ", "
+       << quality.lngrecent_songs << " recently-played songs" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    int intsongs   = argc > 1 ? strtoi(argv[1]) : 5000;
+    int intartists = argc > 2 ? strtoi(argv[2]) : intsongs / 10;
+    if (intsongs <= 0 || intartists <= 0) my_throw("Song and artist counts must be positive");
+
+    cout << "Artist scheduler benchmark: " << intsongs << " songs, " << intartists << " artists" << endl;
+
+    // Generate a synthetic library. Artist popularity is skewed (a few artists
+    // have many songs), like a real music profile. The music history needs the
+    // files to exist, so we create empty ones.
+    temp_dir dir("artist_scheduler_benchmark");
+    string strdir = ensure_last_char((string)dir, '/');
+    fake_mp3_tags tags;
+    vector<string> library;
+    srand(1);
+    for (int i = 0; i < intsongs; ++i) {
+      double dblr = (double)rand() / RAND_MAX;
+      int intartist = (int)(intartists * dblr * dblr);
+      string strfile = strdir + "song_" + itostr(i) + ".mp3";
+      ofstream touch(strfile.c_str());
+      tags.artists[strfile] = "Artist " + itostr(intartist);
+      library.push_back(strfile);
+    }
+    random_shuffle(library.begin(), library.end());
+
+    // Recent history: some of the library played before the playlist was generated.
+    music_history history;
+    for (unsigned int i = 0; i < library.size() && i < music_history::max_history_length / 2; ++i) {
+      history.song_played_no_db(library[(i * 7) % library.size()], "", tags);
+    }
+
+    // The original alternation function:
+    vector<string> legacy_list = library;
+    timeval tvstart;
+    gettimeofday(&tvstart, NULL);
+    legacy_alternate_file_list_artists(legacy_list, tags, history);
+    double dbllegacy_ms = elapsed_ms(tvstart);
+
+    // The scheduler:
+    vector<string> scheduled_list = library;
+    gettimeofday(&tvstart, NULL);
+    artist_scheduler scheduler;
+    scheduler.schedule(scheduled_list, tags, history);
+    double dblscheduler_ms = elapsed_ms(tvstart);
+
+    report("alternate_file_list_artists", dbllegacy_ms, measure_quality(legacy_list, tags, history));
+    report("artist_scheduler           ", dblscheduler_ms, measure_quality(scheduled_list, tags, history));
+    cout << "Outputs are " << (legacy_list == scheduled_list ? "identical" : "different") << endl;
+
+    // (temp_dir removes the synthetic library when it goes out of scope)
+    return EXIT_SUCCESS;
+  } catch_exceptions;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,319 @@
+/// @file
+/// End-to-end benchmark for playlist generation. Builds synthetic music libraries (artist
+/// directories, nested M3U files and a format clock sub-category directory, with a prebuilt mp3
+/// tag cache) in a temporary directory, and times loading a music profile from them, fetching
+/// songs, and the music history, against a fake database. Reports times and peak memory.
+///
+/// Usage: playlist_benchmark [library size] [library size] ...
+
+#include "../player.h"
+#include "../player_constants.h"
+#include "../player_run_data.h"
+#include "../segment.h"
+#include "../common/exception.h"
+#include "../common/file.h"
+#include "../common/logging.h"
+#include "../common/mp3_tag_cache.h"
+#include "../common/my_string.h"
+#include "../common/psql.h"
+#include "../common/shuffle.h"
+#include "../common/temp_dir.h"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// A query result with rows supplied by the benchmark:
+class fake_pg_result : public pg_result {
+public:
+  typedef map<string, string> row; // Field name (lower case) -> value
+  vector<row> rows;
+
+  virtual string field(const string & strfield_name, const char * strdefault_val = NULL) const {
+    if (row_num >= size()) my_throw("No more records left!");
+    row::const_iterator it = rows[row_num].find(lcase(strfield_name));
+    if (it != rows[row_num].end()) return it->second;
+    if (strdefault_val == NULL) my_throw("Unknown field: " + strfield_name);
+    return strdefault_val;
+  }
+  virtual long size() const { return rows.size(); }
+};
+
+// A database which answers the queries run while loading a music profile. Everything
+// else (eg: tblliveinfo updates) gets an empty result.
+class fake_db : public pg_conn_exec {
+public:
+  string strprofile;              // Source of the scheduled music profile
+  string strfc_dir;               // Format clock sub-category directory (with a trailing slash)
+  vector<string> fc_media;        // Files listed under the sub-category
+  vector<string> disabled;        // Songs disabled through the wizard
+  long lngqueries;
+
+  fake_db() : lngqueries(0) {}
+
+  virtual ap_pg_result exec(const string & strquery) {
+    ++lngqueries;
+    fake_pg_result * rs = new fake_pg_result;
+    ap_pg_result result(rs);
+    fake_pg_result::row r;
+    if (strquery.find("FROM tlktimezone") != string::npos) {
+      r["lngtimezone"] = "1";
+      rs->rows.push_back(r);
+    }
+    else if (strquery.find("tblmusicprofile_date") != string::npos) {
+      r["lngprofile"] = "1";
+      r["strprofilename"] = "Benchmark";
+      r["strmusic"] = strprofile;
+      rs->rows.push_back(r);
+    }
+    else if (strquery.find("FROM tlkfc_sub_cat WHERE strdir = " + psql_str(strfc_dir)) != string::npos) {
+      r["lngfc_sub_cat"] = "1";
+      rs->rows.push_back(r);
+    }
+    else if (strquery.find("FROM tblfc_media") != string::npos && strquery.find("lngsub_cat = 1") != string::npos) {
+      for (vector<string>::const_iterator it = fc_media.begin(); it != fc_media.end(); ++it) {
+        r["strfile"] = *it;
+        rs->rows.push_back(r);
+      }
+    }
+    else if (strquery.find("COUNT(*) AS lngcount, MAX(dtmtime) AS dtmlatest FROM tblplayeroutput") != string::npos) {
+      // Summary of the disabled songs, for detecting changes:
+      r["lngcount"] = ltostr(disabled.size());
+      r["dtmlatest"] = "2020-01-01 00:00:00";
+      rs->rows.push_back(r);
+    }
+    else if (strquery.find("FROM tblplayeroutput") != string::npos) {
+      for (vector<string>::const_iterator it = disabled.begin(); it != disabled.end(); ++it) {
+        r["strmessage"] = *it + "||Disabled by the benchmark";
+        rs->rows.push_back(r);
+      }
+    }
+    return result;
+  }
+
+  virtual ap_pg_result exec(const string & strquery, [[maybe_unused]] const pg_params & params) {
+    ++lngqueries;
+    ap_pg_result result(new fake_pg_result);
+    if (strquery.find("FROM tblinstore_media") != string::npos) {
+      // Media info for songs (see programming_element::load_media_info):
+      fake_pg_result::row r;
+      r["intlength_ms"] = "210000";
+      r["blndynamically_compressed"] = "t";
+      static_cast<fake_pg_result *>(result.get())->rows.push_back(r);
+    }
+    return result;
+  }
+};
+
+// The player logs a lot while generating playlists. This collects and drops the messages
+// logged while it is in scope:
+class quiet_logging {
+public:
+  quiet_logging() { logging.begin_capture(m_log); }
+  ~quiet_logging() { logging.end_capture(); }
+  void clear() { m_log.clear(); }
+private:
+  vector<log_info> m_log;
+};
+
+// Milliseconds elapsed since tvstart:
+static double elapsed_ms(const timeval & tvstart) {
+  timeval tvnow;
+  gettimeofday(&tvnow, NULL);
+  return (tvnow.tv_sec - tvstart.tv_sec) * 1000.0 + (tvnow.tv_usec - tvstart.tv_usec) / 1000.0;
+}
+
+// Peak resident memory of the process so far, in MB:
+static double peak_rss_mb() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+static void report(const string & strname, const double dblms, const long lngops = 0) {
+  cout << "  " << strname << ": " << dblms << " ms";
+  if (lngops > 0) cout << " (" << (dblms * 1000.0 / lngops) << " us each)";
+  cout << ", peak memory " << peak_rss_mb() << " MB" << endl;
+}
+
+// Write an M3U file listing sources:
+static void write_m3u(const string & strfile, const vector<string> & sources) {
+  ofstream m3u(strfile.c_str());
+  m3u << "#EXTM3U" << endl;
+  for (vector<string>::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+    m3u << *it << endl;
+  }
+}
+
+static void run_benchmark(const int inttracks) {
+  cout << "Playlist benchmark: " << inttracks << " tracks" << endl;
+
+  // Generate a synthetic library:
+  // - Artist popularity is skewed (a few artists have many songs), like a real music profile.
+  // - Each artist has a directory. The music profile is an M3U listing half of them, plus a nested
+  //   M3U listing the rest, plus a format clock sub-category directory.
+  // - Tags come from a prebuilt tag cache. The files are empty, which matches the cached size.
+  temp_dir dir("playlist_benchmark");
+  string strdir = ensure_last_char((string)dir, '/');
+  int intartists = inttracks / 5 + 1;
+  fake_db db;
+  db.strfc_dir = strdir + "fc/";
+  mkdir(db.strfc_dir);
+
+  vector<tblmp3_info> tags;
+  vector<bool> artist_dir_made(intartists, false);
+  srand(1);
+  timeval tvstart;
+  gettimeofday(&tvstart, NULL);
+  for (int i = 0; i < inttracks; ++i) {
+    double dblr = (double)rand() / RAND_MAX;
+    int intartist = (int)(intartists * dblr * dblr);
+    tblmp3_info info;
+    info.strArtist = "Artist " + itostr(intartist);
+    info.strAlbum = "Album " + itostr(intartist) + "-" + itostr(i % 3);
+    info.strTrackName = "Song " + itostr(i);
+    info.lngFileSize = 0;
+    info.intLength = 210;
+    info.intLengthMs = 210000;
+    if (i % 20 == 0) {
+      // Format clock media, listed in the database:
+      string strfile = "fc_" + itostr(i) + ".mp3";
+      info.strMP3Path = db.strfc_dir + strfile;
+      db.fc_media.push_back(strfile);
+    }
+    else {
+      string strartist_dir = strdir + "artist_" + itostr(intartist) + "/";
+      if (!artist_dir_made[intartist]) {
+        mkdir(strartist_dir);
+        artist_dir_made[intartist] = true;
+      }
+      info.strMP3Path = strartist_dir + "song_" + itostr(i) + ".mp3";
+    }
+    ofstream touch(info.strMP3Path.c_str());
+    if (i % 100 == 1) db.disabled.push_back(info.strMP3Path);
+    tags.push_back(info);
+  }
+
+  vector<string> profile_sources, nested_sources;
+  for (int i = 0; i < intartists; ++i) {
+    if (!artist_dir_made[i]) continue;
+    (i % 2 == 0 ? profile_sources : nested_sources).push_back(strdir + "artist_" + itostr(i) + "/");
+  }
+  write_m3u(strdir + "nested.m3u", nested_sources);
+  profile_sources.push_back(strdir + "nested.m3u");
+  profile_sources.push_back(db.strfc_dir);
+  db.strprofile = strdir + "profile.m3u";
+  write_m3u(db.strprofile, profile_sources);
+
+  vector<const tblmp3_info *> entries;
+  for (vector<tblmp3_info>::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+    entries.push_back(&*it);
+  }
+  string strtag_cache = strdir + "mp3_tags.cache";
+  mp3_tag_cache_file::write(strtag_cache, entries);
+  report("Build library (" + itostr(intartists) + " artists)", elapsed_ms(tvstart));
+
+  mp3_tags mp3tags;
+  mp3tags.init(strtag_cache);
+
+  player_config config;
+  config.strdefault_music_source = db.strprofile;
+  config.dirs.strmp3 = strdir;
+
+  // Recent history: some of the library played before the playlist was generated.
+  music_history history;
+  for (unsigned int i = 0; i < tags.size() / 20 && i < music_history::max_history_length / 2; ++i) {
+    history.song_played_no_db(tags[(i * 7) % tags.size()].strMP3Path, "", mp3tags);
+  }
+
+  // Load the music profile. The first time the directories & M3Us are scanned, after that
+  // the playlist source cache is used:
+  player_run_data run_data;
+  segment::clear_source_cache();
+  double dblcold_ms, dblwarm_ms;
+  {
+    quiet_logging quiet;
+    gettimeofday(&tvstart, NULL);
+    run_data.current_segment->load_music_profile(db, config, mp3tags, history);
+    dblcold_ms = elapsed_ms(tvstart);
+  }
+  long lngplaylist = run_data.current_segment->playlist.size();
+  report("Generate playlist, cold (" + ltostr(lngplaylist) + " songs, " + ltostr(db.lngqueries) + " queries)", dblcold_ms);
+  {
+    quiet_logging quiet;
+    gettimeofday(&tvstart, NULL);
+    segment warm;
+    warm.load_music_profile(db, config, mp3tags, history);
+    dblwarm_ms = elapsed_ms(tvstart);
+  }
+  report("Generate playlist, cached sources", dblwarm_ms);
+
+  // Fetch songs the way the player does, skipping songs and artists which played recently. Only
+  // the start of the playlist: an artist is skipped if it played within the last (number of
+  // artists) songs, so once most of the artists have played, most songs get skipped.
+  int intfetch = MIN(lngplaylist / 10, 100L);
+  double dblfetch_ms;
+  {
+    quiet_logging quiet;
+    gettimeofday(&tvstart, NULL);
+    for (int i = 0; i < intfetch; ++i) {
+      programming_element next_item;
+      get_next_ok_music_item(next_item, 0, history, mp3tags, db, config, run_data);
+      history.song_played_no_db(next_item.strmedia, "", mp3tags);
+      run_data.current_segment->item_played();
+      quiet.clear();
+    }
+    dblfetch_ms = elapsed_ms(tvstart);
+  }
+  report("get_next_ok_music_item x " + itostr(intfetch), dblfetch_ms, intfetch);
+
+  // Music history operations:
+  int intops = 10000;
+  gettimeofday(&tvstart, NULL);
+  for (int i = 0; i < intops; ++i) {
+    history.song_played_no_db(tags[(i * 13) % tags.size()].strMP3Path, "", mp3tags);
+  }
+  report("music_history::song_played_no_db x " + itostr(intops), elapsed_ms(tvstart), intops);
+
+  int intrecent = 0;
+  gettimeofday(&tvstart, NULL);
+  for (int i = 0; i < intops; ++i) {
+    if (history.song_played_recently(tags[(i * 17) % tags.size()].strMP3Path, intprevent_song_repeat_factor)) ++intrecent;
+  }
+  report("music_history::song_played_recently x " + itostr(intops), elapsed_ms(tvstart), intops);
+
+  gettimeofday(&tvstart, NULL);
+  for (int i = 0; i < intops; ++i) {
+    if (history.artist_song_played_recently(tags[(i * 19) % tags.size()].strArtist, 20)) ++intrecent;
+  }
+  report("music_history::artist_song_played_recently x " + itostr(intops), elapsed_ms(tvstart), intops);
+  cout << "  (" << intrecent << " of the checks found recent plays)" << endl;
+
+  // (temp_dir removes the synthetic library when it goes out of scope)
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    vector<int> sizes;
+    for (int i = 1; i < argc; ++i) {
+      sizes.push_back(strtoi(argv[i]));
+      if (sizes.back() <= 0) my_throw("Library sizes must be positive");
+    }
+    if (sizes.empty()) sizes.push_back(10000);
+
+    // Shuffle the same way each run, so that runs can be compared:
+    set_shuffle_base_seed(1);
+
+    // Peak memory only goes up, so run the smaller libraries first:
+    sort(sizes.begin(), sizes.end());
+    for (vector<int>::const_iterator it = sizes.begin(); it != sizes.end(); ++it) {
+      run_benchmark(*it);
+    }
+    return EXIT_SUCCESS;
+  } catch_exceptions;
+  return EXIT_FAILURE;
+}
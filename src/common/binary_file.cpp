@@ -0,0 +1,51 @@
+
+#include "binary_file.h"
+#include <climits>
+#include <stdint.h>
+#include "exception.h"
+#include "my_string.h"
+
+// Strings longer than this are assumed to be file corruption:
+static const int64_t max_bin_string_length = 64*1024;
+
+void write_bin_long(ostream & out, const long lngvalue) {
+  int64_t value = lngvalue;
+  out.write((const char *)&value, sizeof(value));
+}
+
+void write_bin_bool(ostream & out, const bool blnvalue) {
+  char ch = blnvalue ? 1 : 0;
+  out.write(&ch, 1);
+}
+
+void write_bin_string(ostream & out, const string & strvalue) {
+  write_bin_long(out, strvalue.length());
+  out.write(strvalue.data(), strvalue.length());
+}
+
+long read_bin_long(istream & in) {
+  int64_t value = 0;
+  if (!in.read((char *)&value, sizeof(value))) my_throw("Unexpected end of binary file");
+  return value;
+}
+
+int read_bin_int(istream & in) {
+  long lngvalue = read_bin_long(in);
+  if (lngvalue < INT_MIN || lngvalue > INT_MAX) my_throw("Invalid int in binary file: " + ltostr(lngvalue));
+  return lngvalue;
+}
+
+bool read_bin_bool(istream & in) {
+  char ch = 0;
+  if (!in.read(&ch, 1)) my_throw("Unexpected end of binary file");
+  if (ch != 0 && ch != 1) my_throw("Invalid bool in binary file");
+  return ch == 1;
+}
+
+string read_bin_string(istream & in) {
+  long lnglength = read_bin_long(in);
+  if (lnglength < 0 || lnglength > max_bin_string_length) my_throw("Invalid string length in binary file: " + ltostr(lnglength));
+  string strvalue(lnglength, '\0');
+  if (lnglength > 0 && !in.read(&strvalue[0], lnglength)) my_throw("Unexpected end of binary file");
+  return strvalue;
+}
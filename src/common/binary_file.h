@@ -0,0 +1,25 @@
+/// @file
+/// Helpers for reading and writing simple binary files (eg: snapshots).
+/// Values are written in host byte order, so files are not meant to be
+/// moved between machines.
+
+#ifndef BINARY_FILE_H
+#define BINARY_FILE_H
+
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// Writing:
+void write_bin_long(ostream & out, const long lngvalue);     ///< Write a long (as 64 bits)
+void write_bin_bool(ostream & out, const bool blnvalue);     ///< Write a bool (as 1 byte)
+void write_bin_string(ostream & out, const string & strvalue); ///< Write a length-prefixed string
+
+// Reading. These throw an exception if the file is truncated or corrupt:
+long read_bin_long(istream & in);     ///< Read a long written by write_bin_long
+int read_bin_int(istream & in);       ///< Read an int written by write_bin_long
+bool read_bin_bool(istream & in);     ///< Read a bool written by write_bin_bool
+string read_bin_string(istream & in); ///< Read a string written by write_bin_string
+
+#endif
@@ -0,0 +1,59 @@
+/// @file
+/// A queue of events ordered by deadline. Kept in a min-heap, so the next event due is always at
+/// the front, and events can be added while earlier ones are being handled. Deadlines are usually
+/// on the monotonic clock (see timing.h).
+
+#ifndef DEADLINE_QUEUE_H
+#define DEADLINE_QUEUE_H
+
+#include "timing.h"
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+/// A queue of items ordered by deadline (earliest first). Items with the same deadline come out in
+/// the order they were added.
+template <class T>
+class deadline_queue {
+public:
+  deadline_queue() : m_lngsequence(0), m_lnglatest(0) {}
+
+  void push(const long lngdeadline, const T & item) {
+    entry new_entry = {lngdeadline, m_lngsequence++, item};
+    if (m_heap.empty() || lngdeadline > m_lnglatest) m_lnglatest = lngdeadline;
+    m_heap.push_back(new_entry);
+    push_heap(m_heap.begin(), m_heap.end(), later);
+  }
+
+  bool empty() const { return m_heap.empty(); }
+  typename vector<T>::size_type size() const { return m_heap.size(); }
+  long next_deadline() const { return m_heap.front().lngdeadline; } ///< Deadline of the next item. The queue must not be empty.
+  long latest_deadline() const { return m_lnglatest; }             ///< Latest deadline queued since the last clear(). The queue must not be empty.
+
+  /// Remove and return the next item. The queue must not be empty.
+  T pop() {
+    pop_heap(m_heap.begin(), m_heap.end(), later);
+    T item = m_heap.back().item;
+    m_heap.pop_back();
+    return item;
+  }
+
+  void clear() { m_heap.clear(); m_lngsequence = 0; m_lnglatest = 0; }
+
+private:
+  struct entry {
+    long lngdeadline;
+    unsigned long lngsequence; ///< Keeps items with the same deadline in order
+    T item;
+  };
+  static bool later(const entry & e1, const entry & e2) {
+    return e1.lngdeadline != e2.lngdeadline ? e1.lngdeadline > e2.lngdeadline : e1.lngsequence > e2.lngsequence;
+  }
+
+  vector<entry> m_heap;
+  unsigned long m_lngsequence;
+  long m_lnglatest;
+};
+
+#endif
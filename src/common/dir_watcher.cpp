@@ -0,0 +1,246 @@
+
+#include "dir_watcher.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "exception.h"
+#include "my_string.h"
+
+// Events we want to know about. Files are only reported once they've been completely written.
+static const uint32_t watch_mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// Is a path under one of the directories (which have trailing slashes)?
+static bool is_under(const set<string> & dirs, const string & strpath) {
+  for (set<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+    if (strpath.compare(0, it->length(), *it) == 0) return true;
+  }
+  return false;
+}
+
+// Remove the paths under strdir from a set
+static bool erase_under(set<string> & paths, const string & strdir) {
+  set<string>::iterator it = paths.lower_bound(strdir);
+  bool blnerased = false;
+  while (it != paths.end() && it->compare(0, strdir.length(), strdir) == 0) {
+    paths.erase(it++);
+    blnerased = true;
+  }
+  return blnerased;
+}
+
+dir_watcher::dir_watcher() : m_blntrees_changed(false) {
+  m_fd = CHECK_LIBC(inotify_init1(IN_NONBLOCK | IN_CLOEXEC), "inotify_init1");
+}
+
+dir_watcher::~dir_watcher() {
+  close(m_fd);
+}
+
+bool dir_watcher::add_tree(const string & strdir) {
+  string strroot = ensure_last_char(strdir, '/');
+  if (m_trees.count(strroot) != 0) return true; // Already watched
+  added_watches added;
+  struct stat st;
+  bool blnlink = lstat(strdir.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+  if (!add_dir(strroot, blnlink, added)) {
+    // Don't keep watching part of the tree. Nothing would trust those watches, and they count
+    // towards the inotify watch limit:
+    undo(added);
+    return false;
+  }
+  m_trees.insert(strroot);
+  m_blntrees_changed = true;
+  return true;
+}
+
+void dir_watcher::clear() {
+  for (map<int, string>::const_iterator it = m_dirs.begin(); it != m_dirs.end(); ++it) {
+    inotify_rm_watch(m_fd, it->first);
+  }
+  m_dirs.clear();
+  m_trees.clear();
+  m_aliases.clear();
+  m_links.clear();
+  m_blntrees_changed = true;
+}
+
+bool dir_watcher::is_watched(const string & strpath) const {
+  return is_under(m_trees, strpath) && !is_under(m_aliases, strpath);
+}
+
+vector<string> dir_watcher::watched_trees() const {
+  return vector<string>(m_trees.begin(), m_trees.end());
+}
+
+vector<string> dir_watcher::aliases() const {
+  return vector<string>(m_aliases.begin(), m_aliases.end());
+}
+
+bool dir_watcher::trees_changed() {
+  bool blnchanged = m_blntrees_changed;
+  m_blntrees_changed = false;
+  return blnchanged;
+}
+
+bool dir_watcher::add_dir(const string & strdir, const bool blnlink, added_watches & added) {
+  struct stat st;
+  if (stat(strdir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+  if (blnlink && m_links.insert(strdir).second) added.links.push_back(strdir);
+
+  // A directory reached through more than one path (symlinks) is only watched under the first
+  // one. This also stops us getting stuck in symlink loops:
+  if (!added.visited_dirs.insert(make_pair((unsigned long)st.st_dev, (unsigned long)st.st_ino)).second) {
+    add_alias(strdir, added);
+    return true;
+  }
+
+  // Watch the directory before listing it, so that nothing created meanwhile is missed:
+  int wd = inotify_add_watch(m_fd, strdir.c_str(), watch_mask);
+  if (wd < 0) return false; // Eg: ENOSPC, the watch limit was reached
+  map<int, string>::const_iterator dir_it = m_dirs.find(wd);
+  if (dir_it != m_dirs.end()) {
+    // inotify has one watch per directory, so it is already watched (eg: by another tree), along
+    // with its subdirectories. Under another path, this one is an alias:
+    if (dir_it->second != strdir) add_alias(strdir, added);
+    return true;
+  }
+  m_dirs[wd] = strdir;
+  added.wds.push_back(wd);
+
+  DIR * dir = opendir(strdir.c_str());
+  if (dir == NULL) return false;
+  vector<pair<string, bool> > subdirs; // Path, and is it a symlink?
+  struct dirent * entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string strname = entry->d_name;
+    if (strname == "." || strname == "..") continue;
+    string strpath = strdir + strname;
+    // Symlinks & filesystems without d_type need a stat to find out what the entry is:
+    bool blnis_dir = entry->d_type == DT_DIR;
+    bool blnis_link = entry->d_type == DT_LNK;
+    if (entry->d_type == DT_UNKNOWN) {
+      blnis_link = lstat(strpath.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+      blnis_dir = !blnis_link && S_ISDIR(st.st_mode);
+    }
+    if (blnis_link) {
+      blnis_dir = stat(strpath.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    if (blnis_dir) subdirs.push_back(make_pair(strpath + "/", blnis_link));
+  }
+  closedir(dir);
+
+  bool blnok = true;
+  for (vector<pair<string, bool> >::const_iterator it = subdirs.begin(); it != subdirs.end(); ++it) {
+    if (!add_dir(it->first, it->second, added)) blnok = false;
+  }
+  return blnok;
+}
+
+void dir_watcher::add_alias(const string & strdir, added_watches & added) {
+  if (m_aliases.insert(strdir).second) {
+    added.aliases.push_back(strdir);
+    m_blntrees_changed = true;
+  }
+}
+
+void dir_watcher::undo(const added_watches & added) {
+  for (vector<int>::const_iterator it = added.wds.begin(); it != added.wds.end(); ++it) {
+    inotify_rm_watch(m_fd, *it);
+    m_dirs.erase(*it);
+  }
+  for (vector<string>::const_iterator it = added.aliases.begin(); it != added.aliases.end(); ++it) m_aliases.erase(*it);
+  for (vector<string>::const_iterator it = added.links.begin(); it != added.links.end(); ++it) m_links.erase(*it);
+}
+
+void dir_watcher::remove_tree(const string & strdir) {
+  map<int, string>::iterator it = m_dirs.begin();
+  while (it != m_dirs.end()) {
+    if (it->second.compare(0, strdir.length(), strdir) == 0) {
+      inotify_rm_watch(m_fd, it->first);
+      m_dirs.erase(it++);
+    }
+    else {
+      ++it;
+    }
+  }
+  if (erase_under(m_aliases, strdir)) m_blntrees_changed = true;
+  erase_under(m_links, strdir);
+}
+
+bool dir_watcher::poll(vector<string> & changed_paths) {
+  changed_paths.clear();
+  bool blnok = true;
+
+  char buf[16 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    ssize_t len = read(m_fd, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break; // No more events
+      if (errno == EINTR) continue;
+      libc_throw("Could not read inotify events");
+    }
+
+    for (char * ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+      const struct inotify_event * event = (const struct inotify_event *)ptr;
+      if (event->mask & IN_Q_OVERFLOW) {
+        blnok = false;
+        continue;
+      }
+      map<int, string>::iterator dir_it = m_dirs.find(event->wd);
+      if (dir_it == m_dirs.end()) continue; // Eg: events for a directory we just stopped watching
+      string strdir = dir_it->second;
+
+      if (event->mask & IN_IGNORED) {
+        // The watch was removed (eg: the directory was deleted)
+        m_dirs.erase(dir_it);
+        continue;
+      }
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // A watched directory went away. If it was the root of a tree, then the tree isn't watched any more.
+        changed_paths.push_back(strdir);
+        if (m_trees.erase(strdir) != 0) {
+          m_blntrees_changed = true;
+          blnok = false;
+        }
+        continue;
+      }
+
+      string strname = event->len > 0 ? string(event->name) : "";
+      if (event->mask & IN_ISDIR) {
+        string strsubdir = strdir + strname + "/";
+        changed_paths.push_back(strsubdir);
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+          remove_tree(strsubdir);
+        }
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          // Watch the new directory too. Files may already have been created in it.
+          added_watches added;
+          if (!add_dir(strsubdir, false, added)) blnok = false;
+        }
+      }
+      else if (strname != "") {
+        string strpath = strdir + strname;
+        changed_paths.push_back(strpath);
+        // Symlinks to directories aren't reported as directories, but are followed like them:
+        if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) && m_links.count(strpath + "/") != 0) {
+          changed_paths.push_back(strpath + "/");
+          remove_tree(strpath + "/");
+        }
+        struct stat st;
+        if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && stat(strpath.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+          changed_paths.push_back(strpath + "/");
+          added_watches added;
+          if (!add_dir(strpath + "/", true, added)) blnok = false;
+        }
+      }
+    }
+  }
+
+  // A file is often reported more than once (eg: created, then written):
+  sort(changed_paths.begin(), changed_paths.end());
+  changed_paths.erase(unique(changed_paths.begin(), changed_paths.end()), changed_paths.end());
+  return blnok;
+}
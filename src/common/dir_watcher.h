@@ -0,0 +1,71 @@
+/// @file
+/// Watches directory trees for changes, using inotify.
+/// This lets callers find out which files changed, instead of stat-ing every file they
+/// have cached details about.
+/// - New subdirectories are watched automatically.
+/// - If the kernel's event queue overflows (or a tree could not be fully watched), then
+///   the caller can't know what changed, and must treat everything as changed.
+/// - A directory is only watched under one path. Other paths to it (symlinks) are aliases:
+///   changes made through them are reported under the watched path, so paths under aliases
+///   aren't counted as watched.
+
+#ifndef DIR_WATCHER_H
+#define DIR_WATCHER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class dir_watcher {
+public:
+  dir_watcher();
+  ~dir_watcher();
+
+  /// Watch a directory and all its subdirectories. Returns false (and watches nothing new) if the
+  /// tree could not be fully watched (eg: the directory is missing, or the inotify watch limit was
+  /// reached).
+  bool add_tree(const string & strdir);
+  void clear(); ///< Stop watching everything
+
+  /// Is a path inside one of the fully-watched trees (and not under an alias)?
+  bool is_watched(const string & strpath) const;
+  vector<string> watched_trees() const; ///< The fully-watched trees (with trailing slashes)
+  vector<string> aliases() const; ///< Aliases inside the watched trees (with trailing slashes)
+
+  /// Did the watched trees or aliases change since the last call? poll() can change them.
+  bool trees_changed();
+
+  /// Fetch the paths that changed since the last call. Directories which changed (created, moved
+  /// or removed) are listed with a trailing slash. Returns false if events were lost, in which case
+  /// anything under the watched trees may have changed.
+  bool poll(vector<string> & changed_paths);
+
+private:
+  int m_fd;                        ///< inotify file descriptor (non-blocking)
+  map<int, string> m_dirs;         ///< Watched directories (with trailing slashes), by watch descriptor
+  set<string> m_trees;             ///< Roots of fully-watched trees
+  set<string> m_aliases;           ///< Other paths to watched directories (with trailing slashes)
+  set<string> m_links;             ///< Symlinks to directories which were followed (with trailing slashes)
+  bool m_blntrees_changed;
+
+  /// What add_dir() added, so that it can be undone
+  struct added_watches {
+    set<pair<unsigned long, unsigned long> > visited_dirs; ///< Directories seen so far, by (device, inode)
+    vector<int> wds;
+    vector<string> aliases;
+    vector<string> links;
+  };
+  bool add_dir(const string & strdir, const bool blnlink, added_watches & added); ///< Recursively watch a directory. blnlink: strdir is a symlink.
+  void add_alias(const string & strdir, added_watches & added);
+  void undo(const added_watches & added); ///< Remove the watches & aliases added by add_dir()
+  void remove_tree(const string & strdir); ///< Forget the watches & aliases for a directory and its subdirectories
+
+  // Not copyable (owns the inotify descriptor):
+  dir_watcher(const dir_watcher &);
+  dir_watcher & operator=(const dir_watcher &);
+};
+
+#endif
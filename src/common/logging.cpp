@@ -15,6 +15,9 @@
 // The global object used for logging.
 clogging logging;
 
+// Messages logged by the current thread are collected here while it is capturing (see begin_capture):
+static thread_local vector<log_info> * captured_logs = NULL;
+
 // clogging constructor
 clogging::clogging() {
   blndebug = false;
@@ -34,6 +37,35 @@ void clogging::log(const log_type LT, const string & strdesc, const string & str
   // Setup the structure with logging info:
   log_info L = {LT, strdesc, get_short_filename(strfile), strfunc, intline};
 
+  // Is this thread capturing its messages?
+  if (captured_logs != NULL) {
+    captured_logs->push_back(L);
+    return;
+  }
+  dispatch(L);
+}
+
+void clogging::begin_capture(vector<log_info> & captured) {
+  captured_logs = &captured;
+}
+
+void clogging::end_capture() {
+  captured_logs = NULL;
+}
+
+void clogging::replay(const vector<log_info> & captured) {
+  for (vector<log_info>::const_iterator it = captured.begin(); it != captured.end(); ++it) {
+    // A thread which is capturing its own messages keeps these with them:
+    if (captured_logs != NULL) {
+      captured_logs->push_back(*it);
+    }
+    else {
+      dispatch(*it);
+    }
+  }
+}
+
+void clogging::dispatch(const log_info & L) {
   // Don't allow this function to be called recursively:
   static bool blnrunning = false;
 
@@ -3,11 +3,15 @@
 /// Call log_line, log_message and log_error in your code. You can define
 /// a custom callback function which performs application-specific logging
 /// (eg: database).
+/// - The loggers are not thread-safe. Code which logs can still run on a background thread if
+///   the thread captures its messages (see clogging::begin_capture()), for the main thread to
+///   replay later.
 
 #ifndef LOGGING_H
 #define LOGGING_H
 
 #include <string>
+#include <vector>
 #include <ext/slist>
 
 // Use these macros for logging:
@@ -59,7 +63,14 @@ public:
   /// Don't call this yourself, reather use log_message, log_warning, etc.
   void log(const log_type LT, const string & strdesc, const string & strfile, const string & strfunc, const int & intline);
 
+  /// Collect messages logged by the calling thread in captured, instead of passing them to the
+  /// loggers, until end_capture() is called.
+  void begin_capture(vector<log_info> & captured);
+  void end_capture(); ///< Stop capturing the calling thread's messages
+  void replay(const vector<log_info> & captured); ///< Pass captured messages to the loggers (call from the main thread, or a capturing thread, which captures them too). They get the current time.
+
 private:
+  void dispatch(const log_info & L); ///< Pass a message to the loggers
   typedef void (callback_func)(const log_info&);
 
   typedef slist <callback_func *> callback_slist;
@@ -0,0 +1,450 @@
+
+#include "mp3_reader.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "exception.h"
+#include "my_string.h"
+
+// Limits which protect us against corrupt files:
+static const long max_id3v2_buffered_size = 1024*1024; // Tags using whole-tag unsynchronisation are buffered up to this size
+static const long max_id3v2_text_frame_size = 64*1024; // Text frames larger than this are ignored
+static const long max_mpeg_sync_search = 256*1024;     // How far past the tags we look for the first MPEG frame
+
+// Closes a file descriptor when it goes out of scope
+class fd_closer {
+public:
+  fd_closer(const int fd) : m_fd(fd) {}
+  ~fd_closer() { close(m_fd); }
+private:
+  int m_fd;
+};
+
+// Read up to lnglen bytes from lngoffset. Returns the number of bytes read, which is less than
+// lnglen when the end of the file is reached.
+static long read_at(const int fd, const long lngoffset, unsigned char * buf, const long lnglen) {
+  long lngread = 0;
+  while (lngread < lnglen) {
+    ssize_t ret = pread(fd, buf + lngread, lnglen - lngread, lngoffset + lngread);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      libc_throw("Could not read from mp3 file");
+    }
+    if (ret == 0) break;
+    lngread += ret;
+  }
+  return lngread;
+}
+
+static unsigned long be32(const unsigned char * p) {
+  return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+static unsigned long syncsafe32(const unsigned char * p) {
+  return ((unsigned long)(p[0] & 0x7f) << 21) | ((unsigned long)(p[1] & 0x7f) << 14) | ((unsigned long)(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+// Undo ID3v2 unsynchronisation (0xFF 0x00 -> 0xFF)
+static void remove_unsync(vector<unsigned char> & data) {
+  vector<unsigned char>::size_type out = 0;
+  for (vector<unsigned char>::size_type i = 0; i < data.size(); ++i) {
+    data[out++] = data[i];
+    if (data[i] == 0xff && i + 1 < data.size() && data[i+1] == 0x00) ++i;
+  }
+  data.resize(out);
+}
+
+// ************************************************
+// Text decoding
+// ************************************************
+
+static void append_utf8(string & str, const unsigned long cp) {
+  if (cp < 0x80) {
+    str += (char)cp;
+  }
+  else if (cp < 0x800) {
+    str += (char)(0xc0 | (cp >> 6));
+    str += (char)(0x80 | (cp & 0x3f));
+  }
+  else if (cp < 0x10000) {
+    str += (char)(0xe0 | (cp >> 12));
+    str += (char)(0x80 | ((cp >> 6) & 0x3f));
+    str += (char)(0x80 | (cp & 0x3f));
+  }
+  else {
+    str += (char)(0xf0 | (cp >> 18));
+    str += (char)(0x80 | ((cp >> 12) & 0x3f));
+    str += (char)(0x80 | ((cp >> 6) & 0x3f));
+    str += (char)(0x80 | (cp & 0x3f));
+  }
+}
+
+// ISO-8859-1, up to the first NUL
+static string latin1_to_utf8(const unsigned char * p, const long lnglen) {
+  string strret;
+  for (long i = 0; i < lnglen && p[i] != 0; ++i) append_utf8(strret, p[i]);
+  return strret;
+}
+
+// UTF-16 (with an optional BOM), up to the first NUL
+static string utf16_to_utf8(const unsigned char * p, long lnglen, bool blnbig_endian) {
+  if (lnglen >= 2 && p[0] == 0xff && p[1] == 0xfe) { blnbig_endian = false; p += 2; lnglen -= 2; }
+  else if (lnglen >= 2 && p[0] == 0xfe && p[1] == 0xff) { blnbig_endian = true; p += 2; lnglen -= 2; }
+
+  string strret;
+  for (long i = 0; i + 1 < lnglen; i += 2) {
+    unsigned long unit = blnbig_endian ? (p[i] << 8) | p[i+1] : (p[i+1] << 8) | p[i];
+    if (unit == 0) break;
+    if (unit >= 0xd800 && unit < 0xdc00 && i + 3 < lnglen) {
+      // Surrogate pair
+      unsigned long low = blnbig_endian ? (p[i+2] << 8) | p[i+3] : (p[i+3] << 8) | p[i+2];
+      if (low >= 0xdc00 && low < 0xe000) {
+        append_utf8(strret, 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00));
+        i += 2;
+        continue;
+      }
+    }
+    if (unit >= 0xd800 && unit < 0xe000) unit = 0xfffd; // Unpaired surrogate
+    append_utf8(strret, unit);
+  }
+  return strret;
+}
+
+// Replace control characters & trim tag text. Tags can hold NUL padding or separators (ID3v1 fields,
+// ID3v2.4 multiple values) and stray newlines, which would otherwise make the same artist compare
+// unequal, and break up the one-line descriptions written to the logs and the database.
+static string clean_tag_text(const string & strtext) {
+  string strret = strtext;
+  for (string::size_type i = 0; i < strret.length(); ++i) {
+    if ((unsigned char)strret[i] < 0x20) strret[i] = ' ';
+  }
+  return trim(strret);
+}
+
+// Decode the contents of an ID3v2 text frame (encoding byte followed by the text)
+static string decode_id3v2_text(const vector<unsigned char> & data) {
+  if (data.size() < 2) return "";
+  const unsigned char * p = &data[1];
+  long lnglen = data.size() - 1;
+  string strret;
+  switch (data[0]) {
+    case 0: strret = latin1_to_utf8(p, lnglen); break;
+    case 1: strret = utf16_to_utf8(p, lnglen, false); break;
+    case 2: strret = utf16_to_utf8(p, lnglen, true); break;
+    case 3: strret = string((const char *)p, strnlen((const char *)p, lnglen)); break;
+    default: return ""; // Unknown encoding
+  }
+  return clean_tag_text(strret);
+}
+
+// ************************************************
+// ID3 tags
+// ************************************************
+
+// Provides access to the ID3v2 tag body, either directly from the file or from a buffered
+// copy (when the whole tag needs to have unsynchronisation removed first).
+class id3v2_body {
+public:
+  id3v2_body(const int fd, const long lngsize) : m_fd(fd), m_lngsize(lngsize), m_blnbuffered(false) {}
+
+  void buffer_and_remove_unsync() {
+    m_buffer.resize(m_lngsize < max_id3v2_buffered_size ? m_lngsize : max_id3v2_buffered_size);
+    m_buffer.resize(read_at(m_fd, 10, &m_buffer[0], m_buffer.size()));
+    remove_unsync(m_buffer);
+    m_lngsize = m_buffer.size();
+    m_blnbuffered = true;
+  }
+
+  long size() const { return m_lngsize; }
+
+  // Read bytes from the tag body. Returns false if the requested range is not inside the body.
+  bool read(const long lngpos, unsigned char * buf, const long lnglen) const {
+    if (lngpos < 0 || lnglen < 0 || lngpos + lnglen > m_lngsize) return false;
+    if (m_blnbuffered) {
+      memcpy(buf, &m_buffer[lngpos], lnglen);
+      return true;
+    }
+    return read_at(m_fd, 10 + lngpos, buf, lnglen) == lnglen;
+  }
+
+private:
+  int m_fd;
+  long m_lngsize;
+  bool m_blnbuffered;
+  vector<unsigned char> m_buffer;
+};
+
+// Parse the ID3v2 tag at the start of the file, if there is one. Returns the size of the tag
+// (ie, where the audio data starts), or 0 if the file has no ID3v2 tag.
+static long read_id3v2(const int fd, mp3_file_info & info) {
+  unsigned char header[10];
+  if (read_at(fd, 0, header, 10) < 10 || memcmp(header, "ID3", 3) != 0) return 0;
+  if (header[3] == 0xff || header[4] == 0xff || ((header[6] | header[7] | header[8] | header[9]) & 0x80)) return 0;
+
+  const int intversion = header[3];
+  const unsigned char flags = header[5];
+  const long lngtag_size = syncsafe32(header + 6);
+  const long lngtag_end = 10 + lngtag_size + ((intversion >= 4 && (flags & 0x10)) ? 10 : 0);
+
+  // Skip over tags we don't know how to read (v2.2 compression was never defined):
+  if (intversion < 2 || intversion > 4) return lngtag_end;
+  if (intversion == 2 && (flags & 0x40)) return lngtag_end;
+
+  // In v2.4 unsynchronisation is flagged per frame, earlier versions apply it to the whole tag:
+  id3v2_body body(fd, lngtag_size);
+  if (intversion < 4 && (flags & 0x80)) body.buffer_and_remove_unsync();
+
+  long lngpos = 0;
+  unsigned char buf[10];
+
+  // Skip the extended header:
+  if (intversion >= 3 && (flags & 0x40)) {
+    if (!body.read(0, buf, 4)) return lngtag_end;
+    lngpos = (intversion == 3) ? 4 + (long)be32(buf) : (long)syncsafe32(buf);
+  }
+
+  // Now walk through the frames, reading only the headers and the text frames we want
+  const int intheader_len = (intversion == 2) ? 6 : 10;
+  while (info.strartist.empty() || info.stralbum.empty() || info.strtitle.empty()) {
+    if (!body.read(lngpos, buf, intheader_len)) break;
+    if (buf[0] == 0) break; // Reached the padding
+
+    string strid;
+    long lngframe_size;
+    unsigned char frame_flags = 0;
+    if (intversion == 2) {
+      strid = string((const char *)buf, 3);
+      lngframe_size = (buf[3] << 16) | (buf[4] << 8) | buf[5];
+    }
+    else {
+      strid = string((const char *)buf, 4);
+      // Some taggers write v2.4 frame sizes without the syncsafe encoding
+      bool blnsyncsafe = intversion == 4 && !((buf[4] | buf[5] | buf[6] | buf[7]) & 0x80);
+      lngframe_size = blnsyncsafe ? (long)syncsafe32(buf + 4) : (long)be32(buf + 4);
+      frame_flags = buf[9];
+    }
+    if (lngframe_size <= 0) break;
+    const long lngdata_pos = lngpos + intheader_len;
+    lngpos = lngdata_pos + lngframe_size;
+
+    string * strfield = NULL;
+    if (strid == "TPE1" || strid == "TP1") strfield = &info.strartist;
+    else if (strid == "TALB" || strid == "TAL") strfield = &info.stralbum;
+    else if (strid == "TIT2" || strid == "TT2") strfield = &info.strtitle;
+    if (strfield == NULL || !strfield->empty() || lngframe_size > max_id3v2_text_frame_size) continue;
+
+    vector<unsigned char> data(lngframe_size);
+    if (!body.read(lngdata_pos, &data[0], lngframe_size)) break;
+
+    // Handle frame format flags:
+    vector<unsigned char>::size_type skip = 0;
+    if (intversion == 3) {
+      if (frame_flags & 0xc0) continue; // Compressed or encrypted
+      if (frame_flags & 0x20) skip += 1; // Grouping id
+    }
+    else if (intversion == 4) {
+      if (frame_flags & 0x0c) continue; // Compressed or encrypted
+      if (frame_flags & 0x40) skip += 1; // Grouping id
+      if (frame_flags & 0x01) skip += 4; // Data length indicator
+    }
+    if (skip >= data.size()) continue;
+    data.erase(data.begin(), data.begin() + skip);
+    if (intversion == 4 && (frame_flags & 0x02)) remove_unsync(data);
+
+    *strfield = decode_id3v2_text(data);
+  }
+  return lngtag_end;
+}
+
+// Read any ID3v1 tag at the end of the file, filling in fields not found in the ID3v2 tag.
+// Returns true if there was an ID3v1 tag.
+static bool read_id3v1(const int fd, mp3_file_info & info) {
+  if (info.lngfile_size < 128) return false;
+  unsigned char tag[128];
+  if (read_at(fd, info.lngfile_size - 128, tag, 128) < 128 || memcmp(tag, "TAG", 3) != 0) return false;
+  if (info.strtitle.empty())  info.strtitle  = clean_tag_text(latin1_to_utf8(tag + 3, 30));
+  if (info.strartist.empty()) info.strartist = clean_tag_text(latin1_to_utf8(tag + 33, 30));
+  if (info.stralbum.empty())  info.stralbum  = clean_tag_text(latin1_to_utf8(tag + 63, 30));
+  return true;
+}
+
+// ************************************************
+// MPEG audio frames
+// ************************************************
+
+// Details from an MPEG audio frame header
+struct mpeg_frame {
+  bool blnmpeg1;         // MPEG 1 (otherwise MPEG 2 or 2.5)
+  int intlayer;          // 1, 2 or 3
+  long lngbitrate;       // Bits per second
+  long lngsample_rate;   // Hz
+  int intsamples;        // Samples per frame
+  long lngframe_length;  // Bytes, including the header
+  bool blnmono;          // Single channel
+};
+
+// Parse a 4-byte MPEG audio frame header. Returns false if it isn't a valid header.
+static bool parse_mpeg_header(const unsigned char * p, mpeg_frame & frame) {
+  static const int bitrates[5][16] = {
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0}, // MPEG 1, layer 1
+    {0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384, 0}, // MPEG 1, layer 2
+    {0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 0}, // MPEG 1, layer 3
+    {0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256, 0}, // MPEG 2/2.5, layer 1
+    {0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160, 0}, // MPEG 2/2.5, layers 2 & 3
+  };
+  static const long sample_rates[3] = {44100, 48000, 32000};
+
+  if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) return false;
+  const int intversion_id = (p[1] >> 3) & 3; // 0 = MPEG 2.5, 1 = reserved, 2 = MPEG 2, 3 = MPEG 1
+  const int intlayer_id = (p[1] >> 1) & 3;   // 0 = reserved, 1 = layer 3, 2 = layer 2, 3 = layer 1
+  const int intbitrate_index = p[2] >> 4;
+  const int intsample_rate_index = (p[2] >> 2) & 3;
+  if (intversion_id == 1 || intlayer_id == 0 || intbitrate_index == 0 || intbitrate_index == 15 || intsample_rate_index == 3) return false;
+
+  frame.blnmpeg1 = intversion_id == 3;
+  frame.intlayer = 4 - intlayer_id;
+  const int inttable = frame.blnmpeg1 ? frame.intlayer - 1 : (frame.intlayer == 1 ? 3 : 4);
+  frame.lngbitrate = bitrates[inttable][intbitrate_index] * 1000L;
+  frame.lngsample_rate = sample_rates[intsample_rate_index] >> (intversion_id == 3 ? 0 : (intversion_id == 2 ? 1 : 2));
+  const int intpadding = (p[2] >> 1) & 1;
+  frame.blnmono = (p[3] >> 6) == 3;
+
+  if (frame.intlayer == 1) {
+    frame.intsamples = 384;
+    frame.lngframe_length = (12 * frame.lngbitrate / frame.lngsample_rate + intpadding) * 4;
+  }
+  else {
+    frame.intsamples = (frame.intlayer == 3 && !frame.blnmpeg1) ? 576 : 1152;
+    frame.lngframe_length = (frame.intsamples / 8) * frame.lngbitrate / frame.lngsample_rate + intpadding;
+  }
+  return true;
+}
+
+// Frames following each other must agree on these details:
+static bool same_stream(const mpeg_frame & a, const mpeg_frame & b) {
+  return a.blnmpeg1 == b.blnmpeg1 && a.intlayer == b.intlayer && a.lngsample_rate == b.lngsample_rate;
+}
+
+// Find the first MPEG audio frame between lngstart and lngend. Returns its offset, or -1 if none was found.
+static long find_first_frame(const int fd, const long lngstart, const long lngend, mpeg_frame & frame) {
+  const long lngscan_end = lngend < lngstart + max_mpeg_sync_search ? lngend : lngstart + max_mpeg_sync_search;
+  unsigned char buf[4096];
+  for (long lngchunk = lngstart; lngchunk + 4 <= lngscan_end; lngchunk += sizeof(buf) - 3) {
+    long lngwant = lngscan_end - lngchunk < (long)sizeof(buf) ? lngscan_end - lngchunk : (long)sizeof(buf);
+    long lngread = read_at(fd, lngchunk, buf, lngwant);
+    for (long i = 0; i + 4 <= lngread; ++i) {
+      if (buf[i] != 0xff || !parse_mpeg_header(buf + i, frame)) continue;
+      // Guard against false syncs by checking that the next frame header follows:
+      const long lngoffset = lngchunk + i;
+      const long lngnext = lngoffset + frame.lngframe_length;
+      if (lngnext + 4 > lngend) return lngoffset; // Last frame in the file
+      unsigned char next[4];
+      mpeg_frame next_frame;
+      if (read_at(fd, lngnext, next, 4) == 4 && parse_mpeg_header(next, next_frame) && same_stream(frame, next_frame)) return lngoffset;
+    }
+    if (lngread < lngwant) break;
+  }
+  return -1;
+}
+
+// Details from a Xing/Info or VBRI header
+struct vbr_header {
+  long lngframes;   // Number of audio frames in the stream, or -1 if not known
+  long lngdelay;    // Encoder delay in samples (from a LAME tag), or 0
+  long lngpadding;  // Encoder padding in samples (from a LAME tag), or 0
+};
+
+// Look for a Xing/Info or VBRI header inside the first frame.
+static void read_vbr_header(const int fd, const long lngoffset, const mpeg_frame & frame, vbr_header & header) {
+  header.lngframes = -1;
+  header.lngdelay = 0;
+  header.lngpadding = 0;
+  unsigned char buf[192];
+  const long lngread = read_at(fd, lngoffset, buf, sizeof(buf));
+
+  // Xing/Info header follows the side information:
+  const long lngxing = 4 + (frame.blnmpeg1 ? (frame.blnmono ? 17 : 32) : (frame.blnmono ? 9 : 17));
+  if (lngxing + 8 <= lngread && (memcmp(buf + lngxing, "Xing", 4) == 0 || memcmp(buf + lngxing, "Info", 4) == 0)) {
+    // Optional fields, present if their flag is set: frames, bytes, table of contents, quality
+    const unsigned long flags = be32(buf + lngxing + 4);
+    long lngpos = lngxing + 8;
+    if (flags & 0x01) {
+      if (lngpos + 4 <= lngread) header.lngframes = be32(buf + lngpos);
+      lngpos += 4;
+    }
+    if (flags & 0x02) lngpos += 4;
+    if (flags & 0x04) lngpos += 100;
+    if (flags & 0x08) lngpos += 4;
+
+    // A LAME tag may follow: encoder version (9 bytes), then the delay & padding (12 bits each)
+    // at byte 21. Other encoders based on LAME's tag (eg: ffmpeg) fill in the same fields.
+    if (lngpos + 24 <= lngread &&
+        (memcmp(buf + lngpos, "LAME", 4) == 0 || memcmp(buf + lngpos, "Lavf", 4) == 0 || memcmp(buf + lngpos, "Lavc", 4) == 0)) {
+      const unsigned char * p = buf + lngpos + 21;
+      header.lngdelay = (p[0] << 4) | (p[1] >> 4);
+      header.lngpadding = ((p[1] & 0x0f) << 8) | p[2];
+    }
+    return;
+  }
+
+  // VBRI header is always 32 bytes after the frame header:
+  const long lngvbri = 4 + 32;
+  if (lngvbri + 18 <= lngread && memcmp(buf + lngvbri, "VBRI", 4) == 0) {
+    header.lngframes = be32(buf + lngvbri + 14);
+  }
+}
+
+void read_mp3_file_info(const string & strfile, mp3_file_info & info) {
+  info.lngfile_size = 0;
+  info.strartist = "";
+  info.stralbum = "";
+  info.strtitle = "";
+  info.intlength = -1;
+  info.intlength_ms = -1;
+  info.intencoder_delay = 0;
+  info.intencoder_padding = 0;
+
+  int fd = open(strfile.c_str(), O_RDONLY);
+  if (fd < 0) libc_throw("Could not open " + strfile);
+  fd_closer closer(fd);
+
+  struct stat st;
+  CHECK_LIBC(fstat(fd, &st), "Could not stat " + strfile);
+  info.lngfile_size = st.st_size;
+
+  // Tags:
+  long lngaudio_start = read_id3v2(fd, info);
+  long lngaudio_end = info.lngfile_size;
+  if (read_id3v1(fd, info)) lngaudio_end -= 128;
+
+  // Length, from the Xing/VBRI frame count, or otherwise from the bitrate of the first frame (CBR):
+  mpeg_frame frame;
+  long lngfirst_frame = find_first_frame(fd, lngaudio_start, lngaudio_end, frame);
+  if (lngfirst_frame < 0) {
+    // Some files have a bogus ID3v2 size, so try again from the start of the file
+    if (lngaudio_start == 0) return;
+    lngfirst_frame = find_first_frame(fd, 0, lngaudio_end, frame);
+    if (lngfirst_frame < 0) return;
+  }
+
+  long long lnglength_ms;
+  vbr_header header;
+  read_vbr_header(fd, lngfirst_frame, frame, header);
+  if (header.lngframes > 0) {
+    // Exact length. The header frame itself isn't counted, and the encoder delay & padding aren't
+    // part of the song:
+    long long lngsamples = (long long)header.lngframes * frame.intsamples - header.lngdelay - header.lngpadding;
+    if (lngsamples < 0) lngsamples = 0;
+    lnglength_ms = (lngsamples * 1000 + frame.lngsample_rate / 2) / frame.lngsample_rate;
+    info.intencoder_delay = header.lngdelay;
+    info.intencoder_padding = header.lngpadding;
+  }
+  else {
+    // No frame count, so assume CBR:
+    lnglength_ms = ((long long)(lngaudio_end - lngfirst_frame) * 8000 + frame.lngbitrate / 2) / frame.lngbitrate;
+  }
+  info.intlength_ms = (int)lnglength_ms;
+  info.intlength = (int)((lnglength_ms + 500) / 1000);
+}
@@ -0,0 +1,32 @@
+/// @file
+/// Native reader for mp3 tags and stream details.
+/// Parses ID3v2.2/2.3/2.4 text frames (with an ID3v1 fallback) and the first MPEG audio frame
+/// (plus any Xing/Info or VBRI header) to find the song length. Only the bytes which are needed
+/// are read from the file (via pread), so large embedded pictures etc are never loaded.
+/// - Lengths are exact for files with a frame count (Xing/Info/VBRI), and leave out the encoder
+///   delay & padding recorded in a LAME tag (ie, the length a gapless decoder plays).
+///   Other files are assumed to be CBR, and their length is estimated from the bitrate.
+
+#ifndef MP3_READER_H
+#define MP3_READER_H
+
+#include <string>
+
+using namespace std;
+
+/// Details read from an mp3 file. Text fields are returned as UTF-8.
+struct mp3_file_info {
+  long lngfile_size;  ///< Size of the file in bytes
+  string strartist;   ///< Song artist ("" if not tagged)
+  string stralbum;    ///< Song album ("" if not tagged)
+  string strtitle;    ///< Song track name ("" if not tagged)
+  int intlength;      ///< Song length in seconds, -1 if no MPEG audio frames were found
+  int intlength_ms;   ///< Song length in milliseconds, -1 if no MPEG audio frames were found
+  int intencoder_delay;   ///< Samples of silence added at the start by the encoder (from a LAME tag), or 0
+  int intencoder_padding; ///< Samples of silence added at the end by the encoder (from a LAME tag), or 0
+};
+
+/// Read tag and length details from an mp3 file. Throws an exception if the file can't be read.
+void read_mp3_file_info(const string & strfile, mp3_file_info & info);
+
+#endif
@@ -0,0 +1,313 @@
+
+#include "mp3_tag_cache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "binary_file.h"
+#include "exception.h"
+#include "file.h"
+#include "my_string.h"
+#include "string_pool.h"
+
+// Cache file layout: header, entries, artist table, album table, hash table, string table.
+// Bump the version whenever the layout changes; old files are then discarded and rebuilt.
+static const char cache_magic[8] = {'R', 'R', 'M', 'P', '3', 'T', 'C', '\0'};
+static const uint32_t cache_version = 3;
+
+struct cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;          // Number of entries
+  uint32_t artist_count;   // Number of artists in the artist table
+  uint32_t album_count;    // Number of albums in the album table
+  uint32_t hash_slots;     // Size of the hash table (a power of 2, larger than count)
+  uint32_t reserved;
+  uint64_t strings_offset; // Where the string table starts
+  uint64_t strings_size;   // Size of the string table
+};
+
+// Written at the start of the journal:
+static const string strjournal_magic = "RR_MP3_TAG_JOURNAL_2";
+
+mp3_tag_cache_file::mp3_tag_cache_file() : m_data(NULL), m_size(0) {
+  close();
+}
+
+mp3_tag_cache_file::~mp3_tag_cache_file() {
+  close();
+}
+
+void mp3_tag_cache_file::open(const string & strfile) {
+  close();
+
+  int fd = ::open(strfile.c_str(), O_RDONLY);
+  if (fd < 0) libc_throw("Could not open " + strfile);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    ::close(fd);
+    libc_throw("Could not stat " + strfile);
+  }
+  if ((unsigned long)st.st_size < sizeof(cache_header)) {
+    ::close(fd);
+    my_throw("Truncated mp3 tag cache file: " + strfile);
+  }
+  void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // The mapping stays valid
+  if (data == MAP_FAILED) libc_throw("Could not map " + strfile);
+  m_data = (const char *)data;
+  m_size = st.st_size;
+
+  // Check the header & section sizes. Entries are checked as they are read.
+  const cache_header * header = (const cache_header *)m_data;
+  uint64_t sections_end = sizeof(cache_header) + (uint64_t)header->count * sizeof(mp3_cache_entry) +
+                          ((uint64_t)header->artist_count + header->album_count) * 2 * sizeof(uint32_t) +
+                          (uint64_t)header->hash_slots * sizeof(uint32_t);
+  string strerror;
+  if (memcmp(header->magic, cache_magic, sizeof(cache_magic)) != 0) strerror = "Not an mp3 tag cache file";
+  else if (header->version != cache_version) strerror = "Unsupported mp3 tag cache version " + itostr(header->version);
+  else if (sections_end > header->strings_offset ||
+           header->strings_offset + header->strings_size != m_size ||
+           header->hash_slots <= header->count ||
+           (header->hash_slots & (header->hash_slots - 1)) != 0) strerror = "Corrupt mp3 tag cache file";
+  if (!strerror.empty()) {
+    close();
+    my_throw(strerror + ": " + strfile);
+  }
+
+  m_lngcount = header->count;
+  m_lngartists = header->artist_count;
+  m_lngalbums = header->album_count;
+  m_lngslots = header->hash_slots;
+  m_entries = (const mp3_cache_entry *)(m_data + sizeof(cache_header));
+  m_artists = (const uint32_t *)(m_entries + m_lngcount);
+  m_albums = m_artists + 2 * m_lngartists;
+  m_slots = m_albums + 2 * m_lngalbums;
+}
+
+void mp3_tag_cache_file::swap(mp3_tag_cache_file & other) {
+  std::swap(m_data, other.m_data);
+  std::swap(m_size, other.m_size);
+  std::swap(m_entries, other.m_entries);
+  std::swap(m_artists, other.m_artists);
+  std::swap(m_albums, other.m_albums);
+  std::swap(m_slots, other.m_slots);
+  std::swap(m_lngcount, other.m_lngcount);
+  std::swap(m_lngartists, other.m_lngartists);
+  std::swap(m_lngalbums, other.m_lngalbums);
+  std::swap(m_lngslots, other.m_lngslots);
+}
+
+void mp3_tag_cache_file::close() {
+  if (m_data != NULL) munmap((void *)m_data, m_size);
+  m_data = NULL;
+  m_size = 0;
+  m_entries = NULL;
+  m_artists = m_albums = m_slots = NULL;
+  m_lngcount = m_lngartists = m_lngalbums = m_lngslots = 0;
+}
+
+long mp3_tag_cache_file::size() const {
+  return m_lngcount;
+}
+
+string mp3_tag_cache_file::get_string(const uint32_t offset, const uint32_t length) const {
+  const cache_header * header = (const cache_header *)m_data;
+  if ((uint64_t)offset + length > header->strings_size) my_throw("Corrupt mp3 tag cache file (invalid string offset)");
+  return string(m_data + header->strings_offset + offset, length);
+}
+
+long mp3_tag_cache_file::find(const string & strpath) const {
+  if (m_lngcount == 0) return -1;
+  // Linear probing. The table always has empty slots, which end the search.
+  const uint64_t hash = fnv1a_hash(strpath);
+  const cache_header * header = (const cache_header *)m_data;
+  unsigned long lngmask = m_lngslots - 1;
+  unsigned long lngslot = hash & lngmask;
+  for (long lngprobe = 0; lngprobe < m_lngslots; ++lngprobe) {
+    uint32_t slot = m_slots[lngslot];
+    if (slot == 0) return -1;
+    if (slot > m_lngcount) my_throw("Corrupt mp3 tag cache file (invalid hash table)");
+    const mp3_cache_entry & e = m_entries[slot - 1];
+    if (e.path_hash == hash && e.path_length == strpath.length() &&
+        (uint64_t)e.path_offset + e.path_length <= header->strings_size &&
+        memcmp(m_data + header->strings_offset + e.path_offset, strpath.data(), e.path_length) == 0) {
+      return slot - 1;
+    }
+    lngslot = (lngslot + 1) & lngmask;
+  }
+  return -1;
+}
+
+const mp3_cache_entry & mp3_tag_cache_file::entry(const long lngindex) const {
+  if (lngindex < 0 || lngindex >= m_lngcount) LOGIC_ERROR;
+  const mp3_cache_entry & e = m_entries[lngindex];
+  if (e.artist >= m_lngartists || e.album >= m_lngalbums) my_throw("Corrupt mp3 tag cache file (invalid artist or album)");
+  return e;
+}
+
+void mp3_tag_cache_file::get(const long lngindex, tblmp3_info & info) const {
+  const mp3_cache_entry & e = entry(lngindex);
+  info.strMP3Path   = get_string(e.path_offset, e.path_length);
+  info.lngFileSize  = e.file_size;
+  info.strArtist    = get_artist(e.artist);
+  info.strAlbum     = get_album(e.album);
+  info.strTrackName = get_string(e.title_offset, e.title_length);
+  info.intLength    = e.length;
+  info.intLengthMs  = e.length_ms;
+}
+
+long mp3_tag_cache_file::artist_count() const {
+  return m_lngartists;
+}
+
+string mp3_tag_cache_file::get_artist(const long lngindex) const {
+  if (lngindex < 0 || lngindex >= m_lngartists) LOGIC_ERROR;
+  return get_string(m_artists[2 * lngindex], m_artists[2 * lngindex + 1]);
+}
+
+long mp3_tag_cache_file::album_count() const {
+  return m_lngalbums;
+}
+
+string mp3_tag_cache_file::get_album(const long lngindex) const {
+  if (lngindex < 0 || lngindex >= m_lngalbums) LOGIC_ERROR;
+  return get_string(m_albums[2 * lngindex], m_albums[2 * lngindex + 1]);
+}
+
+// Add a string to the string table being built for a new cache file
+static void add_cache_string(string & strstrings, const string & str, uint32_t & offset, uint32_t & length) {
+  offset = strstrings.length();
+  length = str.length();
+  strstrings += str;
+}
+
+// Used to write entries in path order, so the files are the same for the same contents:
+static bool path_less_than(const tblmp3_info * a, const tblmp3_info * b) {
+  return a->strMP3Path < b->strMP3Path;
+}
+
+void mp3_tag_cache_file::write(const string & strfile, const vector<const tblmp3_info *> & unsorted_entries) {
+  vector<const tblmp3_info *> entries(unsorted_entries);
+  sort(entries.begin(), entries.end(), path_less_than);
+
+  // Build the entries & string table. Artists and albums repeat a lot, so they are
+  // stored once each, in their own tables.
+  string strstrings;
+  string_pool artists, albums;
+  vector<mp3_cache_entry> cache_entries(entries.size());
+  for (vector<const tblmp3_info *>::size_type i = 0; i < entries.size(); ++i) {
+    const tblmp3_info & info = *entries[i];
+    if (i > 0 && entries[i-1]->strMP3Path == info.strMP3Path) LOGIC_ERROR; // Paths must be unique
+    mp3_cache_entry & e = cache_entries[i];
+    memset(&e, 0, sizeof(e));
+    e.path_hash = fnv1a_hash(info.strMP3Path);
+    add_cache_string(strstrings, info.strMP3Path, e.path_offset, e.path_length);
+    add_cache_string(strstrings, info.strTrackName, e.title_offset, e.title_length);
+    e.artist = artists.intern(info.strArtist);
+    e.album = albums.intern(info.strAlbum);
+    e.file_size = info.lngFileSize;
+    e.length = info.intLength;
+    e.length_ms = info.intLengthMs;
+  }
+
+  vector<uint32_t> artist_table(2 * artists.size());
+  for (unsigned int i = 0; i < artists.size(); ++i) {
+    add_cache_string(strstrings, artists.get(i), artist_table[2 * i], artist_table[2 * i + 1]);
+  }
+  vector<uint32_t> album_table(2 * albums.size());
+  for (unsigned int i = 0; i < albums.size(); ++i) {
+    add_cache_string(strstrings, albums.get(i), album_table[2 * i], album_table[2 * i + 1]);
+  }
+
+  // Hash table over the paths (linear probing):
+  vector<uint32_t> slots(hash_table_size(cache_entries.size()), 0);
+  unsigned long lngmask = slots.size() - 1;
+  for (vector<mp3_cache_entry>::size_type i = 0; i < cache_entries.size(); ++i) {
+    unsigned long lngslot = cache_entries[i].path_hash & lngmask;
+    while (slots[lngslot] != 0) lngslot = (lngslot + 1) & lngmask;
+    slots[lngslot] = i + 1;
+  }
+
+  cache_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, cache_magic, sizeof(cache_magic));
+  header.version = cache_version;
+  header.count = cache_entries.size();
+  header.artist_count = artists.size();
+  header.album_count = albums.size();
+  header.hash_slots = slots.size();
+  header.strings_offset = sizeof(cache_header) + cache_entries.size() * sizeof(mp3_cache_entry) +
+                          (artist_table.size() + album_table.size() + slots.size()) * sizeof(uint32_t);
+  header.strings_size = strstrings.length();
+
+  // Write to a temporary file first, so that a crash while writing doesn't
+  // leave a half-written cache behind.
+  string strtmp_file = strfile + ".tmp";
+  {
+    ofstream out(strtmp_file.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out) my_throw("Could not open " + strtmp_file + " for writing.");
+    out.write((const char *)&header, sizeof(header));
+    if (!cache_entries.empty()) out.write((const char *)&cache_entries[0], cache_entries.size() * sizeof(mp3_cache_entry));
+    if (!artist_table.empty()) out.write((const char *)&artist_table[0], artist_table.size() * sizeof(uint32_t));
+    if (!album_table.empty()) out.write((const char *)&album_table[0], album_table.size() * sizeof(uint32_t));
+    out.write((const char *)&slots[0], slots.size() * sizeof(uint32_t));
+    out.write(strstrings.data(), strstrings.length());
+    out.close();
+    if (!out) my_throw("Error while writing " + strtmp_file);
+  }
+  CHECK_LIBC(rename(strtmp_file.c_str(), strfile.c_str()), "Rename " + strtmp_file + " to " + strfile);
+}
+
+// ************************************************
+// Journal
+// ************************************************
+
+void append_mp3_tag_journal(const string & strfile, const vector<tblmp3_info> & entries) {
+  bool blnnew = !file_exists(strfile) || file_size(strfile) == 0;
+  ofstream out(strfile.c_str(), ios::out | ios::binary | ios::app);
+  if (!out) my_throw("Could not open " + strfile + " for writing.");
+  if (blnnew) write_bin_string(out, strjournal_magic);
+  for (vector<tblmp3_info>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+    write_bin_string(out, it->strMP3Path);
+    write_bin_long(out, it->lngFileSize);
+    write_bin_string(out, it->strArtist);
+    write_bin_string(out, it->strAlbum);
+    write_bin_string(out, it->strTrackName);
+    write_bin_long(out, it->intLength);
+    write_bin_long(out, it->intLengthMs);
+  }
+  out.close();
+  if (!out) my_throw("Error while writing " + strfile);
+}
+
+bool read_mp3_tag_journal(const string & strfile, vector<tblmp3_info> & entries) {
+  if (!file_exists(strfile)) return true;
+  ifstream in(strfile.c_str(), ios::in | ios::binary);
+  if (!in) my_throw("Could not open " + strfile);
+
+  try {
+    if (read_bin_string(in) != strjournal_magic) return false;
+    // Read records until the end of the file. Later records replace earlier ones.
+    while (in.peek() != EOF) {
+      tblmp3_info info;
+      info.strMP3Path   = read_bin_string(in);
+      info.lngFileSize  = read_bin_long(in);
+      info.strArtist    = read_bin_string(in);
+      info.strAlbum     = read_bin_string(in);
+      info.strTrackName = read_bin_string(in);
+      info.intLength    = read_bin_int(in);
+      info.intLengthMs  = read_bin_int(in);
+      entries.push_back(info);
+    }
+  } catch (const my_exception & e) {
+    // eg: the last record is incomplete because the player crashed while writing it
+    log_warning("Damaged mp3 tag journal " + strfile + ": " + e.get_error());
+    return false;
+  }
+  return true;
+}
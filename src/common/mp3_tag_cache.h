@@ -0,0 +1,89 @@
+/// @file
+/// On-disk storage for the mp3 tag cache.
+/// - The cache file is a versioned binary file (header, entries, artist & album tables, an
+///   open-addressing hash table over the paths, then a string table), which is memory-mapped
+///   read-only so that loading it costs almost nothing, and lookups are O(1).
+/// - New and changed entries are appended to a journal file, and folded back into the
+///   cache file from time to time ("compaction").
+/// Files are written in host byte order, so they are not meant to be moved between machines.
+
+#ifndef MP3_TAG_CACHE_H
+#define MP3_TAG_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// mp3 tag details, as written to the cache file and journal
+struct tblmp3_info {
+  string strMP3Path; ///< The path of the mp3 we are caching MP3 tag details for. Also the unique key.
+
+  // The MP3 details we are interested in
+  long lngFileSize; ///< Size in bytes
+  string strArtist; ///< Song artist
+  string strAlbum;  ///< Song album
+  string strTrackName; ///< Song track name
+  int intLength; ///< Song length in seconds
+  int intLengthMs; ///< Song length in milliseconds (see mp3_reader.h)
+};
+
+/// An entry in the cache file. Strings are (offset, length) pairs in the string table.
+struct mp3_cache_entry {
+  uint64_t path_hash;  ///< fnv1a_hash() of the path
+  uint32_t path_offset, path_length;
+  uint32_t title_offset, title_length;
+  uint32_t artist;     ///< Index into the artist table
+  uint32_t album;      ///< Index into the album table
+  int64_t file_size;
+  int32_t length;      ///< Seconds
+  int32_t length_ms;   ///< Milliseconds
+};
+
+/// A read-only, memory-mapped mp3 tag cache file
+class mp3_tag_cache_file {
+public:
+  mp3_tag_cache_file();
+  ~mp3_tag_cache_file();
+
+  void open(const string & strfile); ///< Map a cache file. Throws an exception if the file is invalid.
+  void close(); ///< Unmap the current file (if any)
+  void swap(mp3_tag_cache_file & other); ///< Exchange mappings with another object
+
+  long size() const; ///< Number of entries in the file
+  long find(const string & strpath) const; ///< Hash lookup of an entry by path. Returns the entry's index, or -1.
+  const mp3_cache_entry & entry(const long lngindex) const; ///< Fetch an entry by index
+  void get(const long lngindex, tblmp3_info & info) const; ///< Fetch an entry by index, with its strings
+  string get_string(const uint32_t offset, const uint32_t length) const; ///< Fetch a string from the string table
+
+  long artist_count() const; ///< Number of distinct artists
+  string get_artist(const long lngindex) const; ///< Artist name from the artist table
+  long album_count() const; ///< Number of distinct albums
+  string get_album(const long lngindex) const; ///< Album name from the album table
+
+  /// Write a new cache file (via a temporary file, so readers never see a partial file).
+  /// Paths must be unique.
+  static void write(const string & strfile, const vector<const tblmp3_info *> & entries);
+
+private:
+  const char * m_data; ///< Start of the mapping
+  unsigned long m_size; ///< Size of the mapping
+
+  // Sections of the file:
+  const mp3_cache_entry * m_entries;
+  const uint32_t * m_artists; ///< (offset, length) pairs
+  const uint32_t * m_albums;  ///< (offset, length) pairs
+  const uint32_t * m_slots;   ///< Hash table: entry index + 1, or 0 for an empty slot
+  long m_lngcount, m_lngartists, m_lngalbums, m_lngslots;
+
+  // Not copyable (owns the mapping):
+  mp3_tag_cache_file(const mp3_tag_cache_file &);
+  mp3_tag_cache_file & operator=(const mp3_tag_cache_file &);
+};
+
+// The journal is a list of entries appended since the cache file was last written:
+void append_mp3_tag_journal(const string & strfile, const vector<tblmp3_info> & entries); ///< Append entries to the journal
+bool read_mp3_tag_journal(const string & strfile, vector<tblmp3_info> & entries); ///< Read journal entries (oldest first). Returns false if the journal is damaged (the complete records are still returned)
+
+#endif
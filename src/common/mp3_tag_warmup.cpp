@@ -0,0 +1,118 @@
+
+#include "mp3_tag_warmup.h"
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "file.h"
+#include "my_string.h"
+
+mp3_tag_warmup::mp3_tag_warmup(mp3_tags & mp3tags) : m_mp3tags(mp3tags), m_blnstop(false), m_blnrunning(false), m_blnfinished(false), m_lngnext_file(0), m_lngfailed(0) {
+}
+
+mp3_tag_warmup::~mp3_tag_warmup() {
+  stop();
+}
+
+void mp3_tag_warmup::start(const vector<string> & dirs, const int intmax_threads) {
+  stop();
+  m_blnstop = false;
+  m_blnfinished = false;
+  m_blnrunning = true;
+
+  // Don't use more threads than the machine has cores for:
+  int intthreads = thread::hardware_concurrency();
+  if (intthreads <= 0 || intthreads > intmax_threads) intthreads = intmax_threads;
+  if (intthreads < 1) intthreads = 1;
+  m_thread = thread(&mp3_tag_warmup::scan, this, dirs, intthreads);
+}
+
+void mp3_tag_warmup::stop() {
+  m_blnstop = true;
+  if (m_thread.joinable()) m_thread.join();
+  m_blnrunning = false;
+}
+
+bool mp3_tag_warmup::running() const {
+  return m_blnrunning;
+}
+
+bool mp3_tag_warmup::check_finished(long & lngfiles, long & lngfailed) {
+  if (!m_blnfinished) return false;
+  // The scan thread is done with the members now:
+  if (m_thread.joinable()) m_thread.join();
+  m_blnfinished = false;
+  lngfiles = m_files.size();
+  lngfailed = m_lngfailed;
+  return true;
+}
+
+void mp3_tag_warmup::scan(const vector<string> dirs, const int intthreads) {
+  // List the files first, so the workers can share them out with a simple counter:
+  m_files.clear();
+  m_lngnext_file = 0;
+  m_lngfailed = 0;
+  set<pair<unsigned long, unsigned long> > visited_dirs;
+  for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end() && !m_blnstop; ++it) {
+    list_mp3s(ensure_last_char(*it, '/'), visited_dirs);
+  }
+
+  // Sort so that files are read in directory order, and drop duplicates (eg: symlinks):
+  sort(m_files.begin(), m_files.end());
+  m_files.erase(unique(m_files.begin(), m_files.end()), m_files.end());
+
+  // Now read the tags:
+  vector<thread> workers;
+  for (int i = 0; i < intthreads; ++i) {
+    workers.push_back(thread(&mp3_tag_warmup::worker, this));
+  }
+  for (vector<thread>::iterator it = workers.begin(); it != workers.end(); ++it) {
+    it->join();
+  }
+
+  m_blnrunning = false;
+  if (!m_blnstop) m_blnfinished = true;
+}
+
+void mp3_tag_warmup::worker() {
+  while (!m_blnstop) {
+    long lngfile = m_lngnext_file++;
+    if (lngfile >= (long)m_files.size()) break;
+    if (!m_mp3tags.prefetch(m_files[lngfile])) ++m_lngfailed;
+  }
+}
+
+void mp3_tag_warmup::list_mp3s(const string & strdir, set<pair<unsigned long, unsigned long> > & visited_dirs) {
+  // Uses readdir directly, because dir_list is not thread-safe.
+  struct stat st;
+  if (stat(strdir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return;
+  // Don't get stuck in symlink loops:
+  if (!visited_dirs.insert(make_pair((unsigned long)st.st_dev, (unsigned long)st.st_ino)).second) return;
+
+  DIR * dir = opendir(strdir.c_str());
+  if (dir == NULL) return;
+  vector<string> subdirs;
+  struct dirent * entry;
+  while (!m_blnstop && (entry = readdir(dir)) != NULL) {
+    string strname = entry->d_name;
+    if (strname == "." || strname == "..") continue;
+    string strpath = strdir + strname;
+
+    // Symlinks & filesystems without d_type need a stat to find out what the entry is:
+    int intd_type = entry->d_type;
+    if (intd_type == DT_UNKNOWN || intd_type == DT_LNK) {
+      intd_type = DT_UNKNOWN;
+      if (stat(strpath.c_str(), &st) == 0) {
+        if (S_ISDIR(st.st_mode)) intd_type = DT_DIR;
+        else if (S_ISREG(st.st_mode)) intd_type = DT_REG;
+      }
+    }
+
+    if (intd_type == DT_DIR) subdirs.push_back(strpath + "/");
+    else if (intd_type == DT_REG && lcase(get_file_ext(strname)) == "mp3") m_files.push_back(strpath);
+  }
+  closedir(dir);
+
+  for (vector<string>::const_iterator it = subdirs.begin(); it != subdirs.end() && !m_blnstop; ++it) {
+    list_mp3s(*it, visited_dirs);
+  }
+}
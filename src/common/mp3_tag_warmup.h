@@ -0,0 +1,53 @@
+/// @file
+/// Background warmup of the mp3 tag cache.
+/// Lists all the mp3s under a set of directories, and reads their tags into an mp3_tags
+/// object using a small pool of threads. This means that later playlist generation finds
+/// the tags already cached, instead of reading them one at a time during playback.
+/// - The threads don't log anything (logging is not thread-safe), call check_finished()
+///   from the main thread to find out how the scan went.
+
+#ifndef MP3_TAG_WARMUP_H
+#define MP3_TAG_WARMUP_H
+
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mp3_tags.h"
+
+using namespace std;
+
+class mp3_tag_warmup {
+public:
+  mp3_tag_warmup(mp3_tags & mp3tags);
+  ~mp3_tag_warmup(); ///< Stops any running scan
+
+  void start(const vector<string> & dirs, const int intmax_threads = 4); ///< Start scanning dirs (recursively). A running scan is restarted.
+  void stop(); ///< Stop scanning, and wait for the threads to exit
+  bool running() const; ///< Is a scan still busy?
+
+  /// Returns true (once) after a scan has finished, along with the number of mp3s found and
+  /// the number whose tags could not be read.
+  bool check_finished(long & lngfiles, long & lngfailed);
+
+private:
+  mp3_tags & m_mp3tags;
+  thread m_thread;              ///< Lists the files, then runs the worker threads
+  atomic<bool> m_blnstop;       ///< Set to ask the threads to stop early
+  atomic<bool> m_blnrunning;    ///< Set while a scan is busy
+  atomic<bool> m_blnfinished;   ///< Set when a scan completes, until check_finished() is called
+  vector<string> m_files;       ///< mp3s to read (not changed while the workers run)
+  atomic<long> m_lngnext_file;  ///< Index of the next file for a worker to read
+  atomic<long> m_lngfailed;     ///< Number of files whose tags could not be read
+
+  void scan(const vector<string> dirs, const int intthreads); ///< Main function of m_thread
+  void worker(); ///< Main function of the worker threads
+  void list_mp3s(const string & strdir, set<pair<unsigned long, unsigned long> > & visited_dirs); ///< Recursively add mp3s to m_files. Directories are identified by (device, inode).
+
+  // Not copyable:
+  mp3_tag_warmup(const mp3_tag_warmup &);
+  mp3_tag_warmup & operator=(const mp3_tag_warmup &);
+};
+
+#endif
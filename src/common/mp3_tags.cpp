@@ -6,80 +6,148 @@
 #include "file.h"
 #include "exception.h"
 #include "my_string.h"
-#include "system.h"
+#include "mp3_reader.h"
+#include <mutex>
+#include <set>
+#include <sys/stat.h>
+
+// Compact the cache once the journal has at least this many records (and is a quarter the size of the cache):
+static const long min_journal_records_to_compact = 500;
 
 mp3_tags::mp3_tags(){
   // Initialize internal vars to empty.
-  strTagBufferFile = "";
-  blnTagDetailsChanged = false;
+  strTagCacheFile = "";
+  strTagJournalFile = "";
+  lngJournalRecords = 0;
+  blnCompactNeeded = false;
+  intVerifyGeneration = 1;
+  lngChangeCount = 0;
+  blnCompacting = false;
+  clear_entries();
 }
 
 mp3_tags::~mp3_tags(){
+  wait_for_compact();
 }
 
-void mp3_tags::init(const string & strBuffFilePath) {  // Initialize the mp3_tags object, provide a buffer filename
-  // Initialise the mp3_tags object
-  // Check if mp3info is installed on the machine
-  if (!file_exists("/usr/bin/mp3info")) {
-    my_throw("The mp3info tool is not installed!");
+void mp3_tags::init(const string & strcache_file, const string & strlegacy_text_file) {
+  // Initialise the mp3_tags object. Mapping the cache file doesn't read it, so this
+  // is fast regardless of the library size. Entries are checked against the
+  // files on disk when they are fetched.
+  wait_for_compact();
+  lock_guard<mutex> lock(m_mutex);
+  strTagCacheFile = strcache_file;
+  strTagJournalFile = strcache_file + ".journal";
+  cache_file.close();
+  artists.clear();
+  albums.clear();
+  dedup_keys.clear();
+  clear_entries();
+  lngJournalRecords = 0;
+  blnCompactNeeded = false;
+
+  if (file_exists(strTagCacheFile)) {
+    try {
+      cache_file.open(strTagCacheFile);
+    } catch(const my_exception & e) {
+      // Eg: the layout version changed. The tags will be re-read from the mp3s as needed.
+      log_warning("Discarding the mp3 tag cache: " + e.get_error());
+      blnCompactNeeded = true;
+    }
   }
+  else if (strlegacy_text_file != "" && file_exists(strlegacy_text_file)) {
+    // Upgrade from the old text file:
+    log_message("Importing mp3 tags from " + strlegacy_text_file + "...");
+    import_text_cache(strlegacy_text_file);
+    blnCompactNeeded = true;
+  }
+  map_cache_file_names();
+  cache_file_verified.assign(cache_file.size(), 0);
+  reset_cache_file_keys();
+
+  // Entries added since the cache file was written:
+  vector<tblmp3_info> journal;
+  if (!read_mp3_tag_journal(strTagJournalFile, journal)) {
+    blnCompactNeeded = true;
+  }
+  for (vector<tblmp3_info>::const_iterator it = journal.begin(); it != journal.end(); ++it) {
+    cache_file_tag(it->strMP3Path, it->lngFileSize, it->strArtist, it->strAlbum, it->strTrackName, it->intLength, it->intLengthMs);
+  }
+  lngJournalRecords = journal.size();
+  unjournaled.clear(); // They're already in the journal
 
-  // Read any previously-buffered details into memory
-  strTagBufferFile = strBuffFilePath;
-
-  // Tags buffer file exists?
-  if (!file_exists(strTagBufferFile)) return;
+  // Rewrite the cache file if needed (in the background), so that we start with a clean journal
+  if (blnCompactNeeded) {
+    try {
+      start_compact();
+    } catch_exceptions;
+  }
+}
 
-  ifstream tag_list_file(strTagBufferFile.c_str());
+void mp3_tags::import_text_cache(const string & strFile) {
+  // Load tag details from the old text file format. The entries are checked against
+  // the files on disk when the cache is compacted.
+  ifstream tag_list_file(strFile.c_str());
   if (!tag_list_file) {
-    my_throw("Unable to open " + strTagBufferFile);
+    my_throw("Unable to open " + strFile);
   }
 
-  char ch_FileLine[2048] = "";
+  string strLine;
   int intlineno=0;
-  while (tag_list_file.getline(ch_FileLine, 2047)) {
+  while (getline(tag_list_file, strLine)) {
     ++intlineno;
-    string strLine = ch_FileLine;
 
     // Cut out any trailing CR
     strLine = remove_last_char(strLine, '\r');
 
     // Break the line into fields: mp3_path||mp3_size||mp3_artist||mp3_album||mp3_trackname||mp3_length
-    string strmp3_path, strmp3_size, strmp3_artist, strmp3_album, strmp3_trackname;
-    int intmp3_length;
-
-    // Parse the line read in.
     string_splitter split(strLine, "||");
     if (split.size() != 6) {
-      // Move the file to a backup location (ie, delete, but keep a copy around for reference.
-      mv(strTagBufferFile, strTagBufferFile + ".old");
-      my_throw("Invalid number of fields (" + itostr(split.size()) + ") found in " + strTagBufferFile + ", line " + itostr(intlineno) + ". File was moved to: " + strTagBufferFile + ".old");
+      log_warning("Invalid number of fields (" + itostr(split.size()) + ") found in " + strFile + ", line " + itostr(intlineno) + ". Skipping the rest of the file.");
+      break;
     }
-    strmp3_path      = trim(split);
-    strmp3_size      = trim(split);
-    strmp3_artist    = trim(split);
-    strmp3_album     = trim(split);
-    strmp3_trackname = trim(split);
-    intmp3_length    = -1;
+    string strmp3_path = trim(split);
+    long lngmp3_size = -1;
     try {
-      intmp3_length  = strtoi(trim(split));
+      lngmp3_size = strtol(trim(split));
     } catch_exceptions;
+    string strmp3_artist    = trim(split);
+    string strmp3_album     = trim(split);
+    string strmp3_trackname = trim(split);
+    int intmp3_length = -1;
+    try {
+      intmp3_length = strtoi(trim(split));
+    } catch_exceptions;
+    // The old format only has whole seconds (from mp3info):
+    cache_file_tag(strmp3_path, lngmp3_size, strmp3_artist, strmp3_album, strmp3_trackname, intmp3_length, intmp3_length < 0 ? -1 : intmp3_length * 1000);
+  }
+  tag_list_file.close();
+}
 
-    // Now that we have extracted the mp3 file details, check
-    //     1) that it is not already in the collection
-    //     2) That the file exists on the hard-drive, and
-    //     3) The listed filesize is correct.
-    if (!file_tag_cached(strmp3_path)) {
-      if (file_exists(strmp3_path)) {
-        long lngFileSize = strtol(strmp3_size);
-        if ((lngFileSize > 0) && (lngFileSize==file_size(strmp3_path))) {
-          // The listed file exists and is the same size as listed in the buffer file. Add it to the memory listing
-          cache_file_tag(strmp3_path, lngFileSize, strmp3_artist, strmp3_album, strmp3_trackname, intmp3_length);
-        }
-      }
+// Split a file name into the name without its extension, and the (lower-case) extension:
+static string file_name_no_ext(const string & strFilePath, string & strext) {
+  string strfile = get_short_filename(strFilePath);
+  string_splitter fname_split = string_splitter(strfile, ".");
+  strext = lcase(fname_split[fname_split.size() - 1]);
+  return substr(strfile, 0, strfile.length() - strext.length() - 1);
+}
+
+// Description of an mp3 from its tag details (Artist - Track title). Falls back to the file name:
+static string describe(const string & strfname_no_ext, const string & strArtist, const string & strAlbum, const string & strTrackName) {
+  string strret = strfname_no_ext;
+  if (strTrackName != "") {
+    // Track name is defined.
+    strret = strTrackName;
+    // Is the artist defined?
+    if (strArtist != "") {
+      strret = strArtist + " - " + strret;
+    }
+    // Otherwise, is the album defined?
+    else if (strAlbum != "") {
+      strret = strAlbum + " - " + strret;
     }
   }
-  tag_list_file.close();
+  return strret;
 }
 
 string mp3_tags::get_mp3_description(const string & strFilePath) {
@@ -88,21 +156,16 @@ string mp3_tags::get_mp3_description(const string & strFilePath) {
   // function should detect this and use the filename if the tag could not be retrieved.
 
   // Fetch filename minus extension, and the extension:
-  string strfname_no_ext = "";
   string strext = "";
-  {
-    string strfile = get_short_filename(strFilePath);
-    string_splitter fname_split = string_splitter(strfile, ".");
-    strext = lcase(fname_split[fname_split.size() - 1]);
-    strfname_no_ext = substr(strfile, 0, strfile.length() - strext.length() - 1);
-  }
+  string strfname_no_ext = file_name_no_ext(strFilePath, strext);
 
   // Default return value is the filename with no extension:
   string strret = strfname_no_ext;
 
   // Check if the fil e exists (but not for entries that
-  // represent cd audio:
-  if (!file_exists(strFilePath) &&
+  // represent cd audio). Files known to be unchanged since they were checked don't need a stat:
+  if (!is_unchanged(strFilePath) &&
+      !file_exists(strFilePath) &&
       strext != "cda" &&
       strext != "cdr" &&
       strFilePath != "LineIn" &&
@@ -112,33 +175,11 @@ string mp3_tags::get_mp3_description(const string & strFilePath) {
 
   // If this is an mp3 file, then attempt to fetch mp3 tag details:
   if (strext == "mp3") {
-    // Declare some variables, populated later in the function:
-    string strAlbum     = "";
-    string strArtist    = "";
-    string strTrackName = "";
-
     // Get a cached entry (either from memory or generate it)
-    tblmp3_info_map::const_iterator item;
-    item = get_mp3_info_item(strFilePath);
-
-    // Fetch details from the cached tag info:
-    strAlbum     = (*item).second.strAlbum;
-    strArtist    = (*item).second.strArtist;
-    strTrackName = (*item).second.strTrackName;
-
-    // Now generate and return the description:
-    if (strTrackName != "") {
-      // Track name is defined.
-      strret = strTrackName;
-      // Is the artist defined?
-      if (strArtist != "") {
-        strret = strArtist + " - " + strret;
-      }
-      // Otherwise, is the album defined?
-      else if (strAlbum != "") {
-        strret = strAlbum + " - " + strret;
-      }
-    }
+    mp3_tag_item item = get_mp3_info_item(strFilePath);
+
+    // Now generate the description from the cached tag info:
+    strret = describe(strfname_no_ext, get_artist_name(item.intArtistId), get_album_name(item.intAlbumId), item.strTrackName);
   }
 
   return strret;
@@ -148,66 +189,183 @@ int mp3_tags::get_mp3_length(const string & strFilePath) {
   // Fetch the length of an mp3.
 
   // Get a cached entry for the file (either from memory or generate it):
-  tblmp3_info_map::const_iterator item = get_mp3_info_item(strFilePath);
+  mp3_tag_item item = get_mp3_info_item(strFilePath);
 
   // Return the length:
-  return (*item).second.intLength;
+  return item.intLength;
+}
+
+int mp3_tags::get_mp3_length_ms(const string & strFilePath) {
+  // Fetch the length of an mp3 in milliseconds.
+  return get_mp3_info_item(strFilePath).intLengthMs;
 }
 
 string mp3_tags::get_mp3_artist(const string & strFilePath) {
   // Fetch an MP3's artist
-
-  // Get a cached entry for the file (either from memory or generate it):
-  tblmp3_info_map::const_iterator item = get_mp3_info_item(strFilePath);
-
-  // Return the length:
-  return (*item).second.strArtist;
+  return get_artist_name(get_mp3_artist_id(strFilePath));
 }
 
 string mp3_tags::get_mp3_album(const string & strFilePath) {
   // Fetch an MP3's album.
+  return get_album_name(get_mp3_album_id(strFilePath));
+}
 
-  // Get a cached entry for the file (either from memory or generate it):
-  tblmp3_info_map::const_iterator item = get_mp3_info_item(strFilePath);
+unsigned int mp3_tags::get_file_name_key(const string & strFilePath) {
+  // Key for the lower-case file name. Stored with the file's entry, if it has one.
+  lock_guard<mutex> lock(m_mutex);
+  uint32_t slot = entry_slots[find_entry(strFilePath, fnv1a_hash(strFilePath))];
+  if (slot != 0) return entries[slot - 1].file_name_key;
 
-  // Return the length:
-  return (*item).second.strAlbum;
+  long lngindex = cache_file.find(strFilePath);
+  if (lngindex < 0) return dedup_keys.intern(lcase(get_short_filename(strFilePath)));
+  if (cache_file_file_name_keys[lngindex] == 0) {
+    cache_file_file_name_keys[lngindex] = dedup_keys.intern(lcase(get_short_filename(strFilePath))) + 1;
+  }
+  return cache_file_file_name_keys[lngindex] - 1;
+}
+
+unsigned int mp3_tags::get_description_key(const string & strFilePath) {
+  // Key for the trimmed, lower-case description. For mp3s this is stored with the entry (which
+  // is checked against the file, the same as for get_mp3_description()).
+  if (lcase(get_file_ext(strFilePath)) != "mp3") {
+    string strdescr = trim(lcase(get_mp3_description(strFilePath)));
+    lock_guard<mutex> lock(m_mutex);
+    return dedup_keys.intern(strdescr);
+  }
+
+  mp3_tag_item item = get_mp3_info_item(strFilePath);
+  if (item.intDescriptionKey != 0) return item.intDescriptionKey - 1;
+
+  // A cache file entry which hasn't been described yet:
+  lock_guard<mutex> lock(m_mutex);
+  uint32_t key = description_key(strFilePath, artists.get(item.intArtistId), albums.get(item.intAlbumId), item.strTrackName);
+  long lngindex = cache_file.find(strFilePath);
+  if (lngindex >= 0 && entry_slots[find_entry(strFilePath, fnv1a_hash(strFilePath))] == 0) {
+    cache_file_description_keys[lngindex] = key + 1;
+  }
+  return key;
+}
+
+uint32_t mp3_tags::description_key(const string & strFile, const string & strArtist, const string & strAlbum, const string & strTrackName) {
+  string strext;
+  return dedup_keys.intern(trim(lcase(describe(file_name_no_ext(strFile, strext), strArtist, strAlbum, strTrackName))));
+}
+
+void mp3_tags::reset_cache_file_keys() {
+  cache_file_file_name_keys.assign(cache_file.size(), 0);
+  cache_file_description_keys.assign(cache_file.size(), 0);
+}
+
+unsigned int mp3_tags::get_mp3_artist_id(const string & strFilePath) {
+  // Fetch the id of an MP3's artist
+  return get_mp3_info_item(strFilePath).intArtistId;
+}
+
+string mp3_tags::get_artist_name(const unsigned int intArtistId) {
+  // Artist name for an id
+  lock_guard<mutex> lock(m_mutex);
+  return artists.get(intArtistId);
+}
+
+unsigned int mp3_tags::get_mp3_album_id(const string & strFilePath) {
+  // Fetch the id of an MP3's album
+  return get_mp3_info_item(strFilePath).intAlbumId;
+}
+
+string mp3_tags::get_album_name(const unsigned int intAlbumId) {
+  // Album name for an id
+  lock_guard<mutex> lock(m_mutex);
+  return albums.get(intAlbumId);
+}
+
+void mp3_tags::set_watched_dirs(const vector<string> & dirs, const vector<string> & aliases) {
+  // Files under these directories are trusted once they've been checked, until
+  // invalidate() is called for them.
+  lock_guard<mutex> lock(m_mutex);
+  watched_dirs.clear();
+  for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+    watched_dirs.push_back(ensure_last_char(*it, '/'));
+  }
+  alias_dirs.clear();
+  for (vector<string>::const_iterator it = aliases.begin(); it != aliases.end(); ++it) {
+    alias_dirs.push_back(ensure_last_char(*it, '/'));
+  }
+}
+
+void mp3_tags::invalidate(const string & strFilePath) {
+  // A file changed, so check it against the cache next time it is fetched. Changed directories
+  // could mean that any number of files were added, moved or removed, so check everything.
+  lock_guard<mutex> lock(m_mutex);
+  ++lngChangeCount;
+  if (strFilePath != "" && strFilePath[strFilePath.length() - 1] == '/') {
+    next_verify_generation();
+  }
+  else {
+    set_verified(strFilePath, 0);
+  }
+}
+
+void mp3_tags::invalidate_all() {
+  // Check all entries against their files again (eg: file change events were lost)
+  lock_guard<mutex> lock(m_mutex);
+  ++lngChangeCount;
+  next_verify_generation();
+}
+
+bool mp3_tags::prefetch(const string & strFilePath) {
+  // Load a file's tag details into the cache, if they aren't there yet. This is used by
+  // background threads, so problems are returned rather than logged.
+  try {
+    get_mp3_info_item(strFilePath);
+  } catch(...) {
+    return false;
+  }
+  return true;
 }
 
 void mp3_tags::save_changes() {
-  // Rewrite the buffer file if there are any new tag details that have been loaded.
-  if (blnTagDetailsChanged) {
-    ofstream buffer_file(strTagBufferFile.c_str());
-    if (buffer_file) {
-      // Buffer file has been opened for writing. Start writing
-      tblmp3_info_map::iterator item = mp3_info.begin();
-      while (item!=mp3_info.end()) {
-        // Check if the file exists and is the same size as listed in memory.
-        bool blnSave = false; // Do we save this entry?
-        if (file_exists((*item).second.strMP3Path)) {
-          blnSave = file_size((*item).second.strMP3Path) == (*item).second.lngFileSize;
-        }
-        if (blnSave) {
-          // Save the line to the file
-          buffer_file << (*item).second.strMP3Path << "||"
-                      << (*item).second.lngFileSize << "||"
-                      << (*item).second.strArtist << "||"
-                      << (*item).second.strAlbum << "||"
-                      << (*item).second.strTrackName << "||"
-                      << (*item).second.intLength << "||"
-                      << endl;
-        }
-        else {
-          // Do not save the line to the file. Also remove the line details from the collection
-          // - Internal collection is changing, but we have just skipped saving the
-          //   invalid MP3 entry to the file anyway.
-          mp3_info.erase(item);
-        }
-        ++item;
+  // Append any new tag details to the journal, rather than rewriting the whole cache. The lock
+  // isn't held while writing, so that readers (eg: playback) aren't held up by the disk.
+  lock_guard<mutex> save_lock(m_save_mutex);
+  vector<log_info> captured;
+  vector<uint32_t> indexes;
+  vector<tblmp3_info> journal;
+  string strjournal_file;
+  bool blnsave = false;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    captured.swap(compact_log);
+    // Not initialised? New entries also wait while a compaction is emptying the journal:
+    if (strTagCacheFile != "" && !blnCompacting) {
+      blnsave = true;
+      indexes.swap(unjournaled);
+      journal.resize(indexes.size());
+      for (vector<uint32_t>::size_type i = 0; i < indexes.size(); ++i) {
+        entry_to_info(entries[indexes[i]], journal[i]);
       }
-      blnTagDetailsChanged = false;
+      strjournal_file = strTagJournalFile;
+    }
+  }
+  // Log how the last compaction went:
+  logging.replay(captured);
+  if (!blnsave) return;
+
+  if (!journal.empty()) {
+    try {
+      append_mp3_tag_journal(strjournal_file, journal);
+    } catch(...) {
+      // Try again next time:
+      lock_guard<mutex> lock(m_mutex);
+      unjournaled.insert(unjournaled.begin(), indexes.begin(), indexes.end());
+      throw;
     }
-    else my_throw("Could not open " + strTagBufferFile + " for writing.");
+  }
+
+  // Fold the journal back into the cache file once it gets large compared to the cache:
+  lock_guard<mutex> lock(m_mutex);
+  lngJournalRecords += journal.size();
+  if (blnCompactNeeded || (lngJournalRecords >= min_journal_records_to_compact && lngJournalRecords * 4 >= cache_file.size())) {
+    start_compact();
   }
 }
 
@@ -215,104 +373,367 @@ void mp3_tags::save_changes() {
 // Internal caching functions....
 // ************************************************
 
-void mp3_tags::cache_file_tag(const string & strFile, const long lngFileSize, const string & strArtist, const string & strAlbum, const string & strTrackName, const int intTrackLength) {
-  // Store mp3 tag details in memory.
+// Is a file under one of the directories (which have trailing slashes)?
+static bool is_under_dirs(const vector<string> & dirs, const string & strFile) {
+  for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+    if (strFile.compare(0, it->length(), *it) == 0) return true;
+  }
+  return false;
+}
 
-  // Remember to re-write the tag file later:
-  blnTagDetailsChanged = true;
+// Is a file under one of the watched directories, and not under one of their aliases?
+static bool is_watched_path(const vector<string> & watched, const vector<string> & aliases, const string & strFile) {
+  return is_under_dirs(watched, strFile) && !is_under_dirs(aliases, strFile);
+}
 
-  // Now get a pointer to either a) A new tag record, or b) An existing tag record;
-  tblmp3_info * tag_info = &mp3_info[strFile];
+// Returns false if the file doesn't exist
+static bool get_file_size(const string & strFile, long & lngFileSize) {
+  struct stat st;
+  if (stat(strFile.c_str(), &st) != 0) return false;
+  lngFileSize = st.st_size;
+  return true;
+}
 
-  // Now update the fields
-  tag_info->strMP3Path = strFile;
-  tag_info->lngFileSize = lngFileSize;
-  tag_info->strArtist = strArtist;
-  tag_info->strAlbum = strAlbum;
-  tag_info->strTrackName = strTrackName;
-  tag_info->intLength = intTrackLength;
+void mp3_tags::map_cache_file_names() {
+  // Intern the cache file's artists & albums, so that its entries can be given ids
+  // without building strings. There are far fewer of these than songs.
+  cache_file_artist_ids.resize(cache_file.artist_count());
+  for (long i = 0; i < cache_file.artist_count(); ++i) {
+    cache_file_artist_ids[i] = artists.intern(cache_file.get_artist(i));
+  }
+  cache_file_album_ids.resize(cache_file.album_count());
+  for (long i = 0; i < cache_file.album_count(); ++i) {
+    cache_file_album_ids[i] = albums.intern(cache_file.get_album(i));
+  }
 }
 
-bool mp3_tags::file_tag_cached(const string & strFile) {
-  // Return true if a file is listed in the in-memory tag collection.
-  tblmp3_info_map::const_iterator item;
-  item = mp3_info.find(strFile);
-  return (item != mp3_info.end());
+void mp3_tags::start_compact() {
+  // Fold the journal back into the cache file, on a background thread (see compact()).
+  // A finished compaction's thread may not have been joined yet:
+  if (compact_thread.joinable()) compact_thread.join();
+  blnCompacting = true;
+  try {
+    compact_thread = thread(&mp3_tags::compact, this);
+  } catch(...) {
+    blnCompacting = false;
+    throw;
+  }
 }
 
-tblmp3_info_map::const_iterator mp3_tags::get_mp3_info_item(const string & strFilePath) {
-  // Fetch the cached item. If it doesn't exist then load it
+void mp3_tags::wait_for_compact() {
+  if (compact_thread.joinable()) compact_thread.join();
+}
 
-  // Freak out if the file is not an mp3, or if it doesn't exist:
-  if (lcase(get_file_ext(strFilePath)) != "mp3") {
-    my_throw("File is not an mp3, can't fetch info for it: " + strFilePath);
+void mp3_tags::compact() {
+  // Write the cache file entries and the in-memory entries (which replace cache file entries
+  // with the same path) to a new cache file. Entries for files which were removed or changed
+  // are dropped. Runs on compact_thread. The lock is only held to copy the in-memory entries,
+  // and to switch to the new file. Checking the files and writing the new cache file are done
+  // without it, so other threads (eg: playback) aren't held up.
+  vector<log_info> captured;
+  logging.begin_capture(captured);
+  try {
+    // Copy what we need, while holding the lock:
+    string strcache_file, strjournal_file;
+    vector<string> watched, aliases;
+    uint32_t generation;
+    unsigned long lngchange_count;
+    vector<uint32_t> file_verified;
+    vector<tblmp3_info> new_infos;
+    vector<bool> new_verified;
+    {
+      lock_guard<mutex> lock(m_mutex);
+      log_message("Compacting the mp3 tag cache (" + itostr(cache_file.size()) + " cached, " + itostr(entries.size()) + " new entries)...");
+      strcache_file = strTagCacheFile;
+      strjournal_file = strTagJournalFile;
+      watched = watched_dirs;
+      aliases = alias_dirs;
+      generation = intVerifyGeneration;
+      lngchange_count = lngChangeCount;
+      file_verified = cache_file_verified;
+      new_infos.resize(entries.size());
+      new_verified.resize(entries.size());
+      for (vector<mp3_tag_entry>::size_type i = 0; i < entries.size(); ++i) {
+        entry_to_info(entries[i], new_infos[i]);
+        new_verified[i] = entries[i].verified == generation;
+      }
+    }
+
+    // Entries which were verified since the last invalidation, and are under watched directories,
+    // don't need to be checked. Those stay verified in the new file.
+    set<string> new_paths;
+    for (vector<tblmp3_info>::const_iterator it = new_infos.begin(); it != new_infos.end(); ++it) new_paths.insert(it->strMP3Path);
+
+    vector<tblmp3_info> infos;
+    vector<bool> verified;
+    infos.reserve(cache_file.size() + new_infos.size());
+    verified.reserve(cache_file.size() + new_infos.size());
+    for (long i = 0; i < cache_file.size(); ++i) {
+      const mp3_cache_entry & e = cache_file.entry(i);
+      string strpath = cache_file.get_string(e.path_offset, e.path_length);
+      if (new_paths.count(strpath) > 0) continue; // Replaced by an in-memory entry
+      bool blnverified = file_verified[i] == generation && is_watched_path(watched, aliases, strpath);
+      long lngFileSize;
+      if (blnverified || (get_file_size(strpath, lngFileSize) && lngFileSize == e.file_size)) {
+        infos.push_back(tblmp3_info());
+        cache_file.get(i, infos.back());
+        verified.push_back(blnverified);
+      }
+    }
+    for (vector<tblmp3_info>::size_type i = 0; i < new_infos.size(); ++i) {
+      bool blnverified = new_verified[i] && is_watched_path(watched, aliases, new_infos[i].strMP3Path);
+      long lngFileSize;
+      if (blnverified || (get_file_size(new_infos[i].strMP3Path, lngFileSize) && lngFileSize == new_infos[i].lngFileSize)) {
+        infos.push_back(new_infos[i]);
+        verified.push_back(blnverified);
+      }
+    }
+    new_infos.clear();
+
+    vector<const tblmp3_info *> info_ptrs(infos.size());
+    for (vector<tblmp3_info>::size_type i = 0; i < infos.size(); ++i) info_ptrs[i] = &infos[i];
+    mp3_tag_cache_file::write(strcache_file, info_ptrs);
+    info_ptrs.clear();
+
+    // Map the new file, and work out which of its entries are verified:
+    mp3_tag_cache_file new_file;
+    new_file.open(strcache_file);
+    vector<uint32_t> new_file_verified(new_file.size(), 0);
+    for (vector<tblmp3_info>::size_type i = 0; i < infos.size(); ++i) {
+      if (verified[i]) new_file_verified[new_file.find(infos[i].strMP3Path)] = generation;
+    }
+    infos.clear();
+
+    // Switch to the new file. Artist & album ids don't change.
+    {
+      lock_guard<mutex> lock(m_mutex);
+      cache_file.swap(new_file);
+      map_cache_file_names();
+      // Checks from before an invalidation which happened meanwhile can't be trusted:
+      if (lngChangeCount == lngchange_count && intVerifyGeneration == generation) {
+        cache_file_verified.swap(new_file_verified);
+      }
+      else {
+        cache_file_verified.assign(cache_file.size(), 0);
+      }
+      reset_cache_file_keys();
+
+      // The in-memory entries were folded in, except for ones added or changed since they were
+      // copied. Those wait to be journaled:
+      vector<tblmp3_info> kept;
+      vector<uint32_t> kept_verified;
+      vector<bool> seen(entries.size(), false);
+      for (vector<uint32_t>::const_iterator it = unjournaled.begin(); it != unjournaled.end(); ++it) {
+        if (seen[*it]) continue;
+        seen[*it] = true;
+        kept.push_back(tblmp3_info());
+        entry_to_info(entries[*it], kept.back());
+        kept_verified.push_back(entries[*it].verified);
+      }
+      clear_entries();
+      for (vector<tblmp3_info>::size_type i = 0; i < kept.size(); ++i) {
+        cache_file_tag(kept[i].strMP3Path, kept[i].lngFileSize, kept[i].strArtist, kept[i].strAlbum, kept[i].strTrackName, kept[i].intLength, kept[i].intLengthMs);
+        set_verified(kept[i].strMP3Path, kept_verified[i]);
+      }
+      lngJournalRecords = 0;
+      blnCompactNeeded = false;
+    }
+
+    // Start a new journal. Nothing is appended to it until blnCompacting is cleared.
+    if (file_exists(strjournal_file)) rm(strjournal_file);
+    log_message("mp3 tag cache compacted.");
+  } catch_exceptions;
+  logging.end_capture();
+
+  lock_guard<mutex> lock(m_mutex);
+  compact_log.insert(compact_log.end(), captured.begin(), captured.end());
+  blnCompacting = false;
+}
+
+void mp3_tags::clear_entries() {
+  entries.clear();
+  entry_slots.assign(hash_table_size(0), 0);
+  strText.clear();
+  unjournaled.clear();
+}
+
+long mp3_tags::find_entry(const string & strFile, const uint64_t hash) const {
+  // Linear probing. The table is never more than half full, so there is always an empty slot.
+  unsigned long lngmask = entry_slots.size() - 1;
+  unsigned long lngslot = hash & lngmask;
+  while (entry_slots[lngslot] != 0) {
+    const mp3_tag_entry & entry = entries[entry_slots[lngslot] - 1];
+    if (entry.path_hash == hash && entry.path_length == strFile.length() &&
+        strText.compare(entry.path_offset, entry.path_length, strFile) == 0) break;
+    lngslot = (lngslot + 1) & lngmask;
   }
-  if (!file_exists(strFilePath)) {
-    my_throw("File not found: " + strFilePath);
+  return lngslot;
+}
+
+void mp3_tags::entry_to_info(const mp3_tag_entry & entry, tblmp3_info & info) const {
+  info.strMP3Path   = entry_text(entry.path_offset, entry.path_length);
+  info.lngFileSize  = entry.file_size;
+  info.strArtist    = artists.get(entry.artist_id);
+  info.strAlbum     = albums.get(entry.album_id);
+  info.strTrackName = entry_text(entry.title_offset, entry.title_length);
+  info.intLength    = entry.length;
+  info.intLengthMs  = entry.length_ms;
+}
+
+void mp3_tags::cache_file_tag(const string & strFile, const long lngFileSize, const string & strArtist, const string & strAlbum, const string & strTrackName, const int intTrackLength, const int intTrackLengthMs) {
+  // Store mp3 tag details in memory.
+  uint64_t hash = fnv1a_hash(strFile);
+  long lngslot = find_entry(strFile, hash);
+
+  // Get either a) A new tag record, or b) An existing tag record;
+  if (entry_slots[lngslot] == 0) {
+    mp3_tag_entry entry;
+    entry.path_hash = hash;
+    entry.path_offset = strText.length();
+    entry.path_length = strFile.length();
+    entry.verified = 0;
+    entry.file_name_key = dedup_keys.intern(lcase(get_short_filename(strFile)));
+    strText += strFile;
+    entries.push_back(entry);
+    entry_slots[lngslot] = entries.size();
+    // Keep the table at most half full:
+    if (entries.size() * 2 > entry_slots.size()) {
+      entry_slots.assign(entry_slots.size() * 2, 0);
+      unsigned long lngmask = entry_slots.size() - 1;
+      for (vector<mp3_tag_entry>::size_type i = 0; i < entries.size(); ++i) {
+        unsigned long lngnew_slot = entries[i].path_hash & lngmask;
+        while (entry_slots[lngnew_slot] != 0) lngnew_slot = (lngnew_slot + 1) & lngmask;
+        entry_slots[lngnew_slot] = i + 1;
+      }
+      lngslot = find_entry(strFile, hash);
+    }
   }
+  uint32_t index = entry_slots[lngslot] - 1;
+  mp3_tag_entry & entry = entries[index];
+
+  // Now update the fields (an old track name is left in strText until the next compaction)
+  entry.title_offset = strText.length();
+  entry.title_length = strTrackName.length();
+  strText += strTrackName;
+  entry.artist_id = artists.intern(strArtist);
+  entry.album_id = albums.intern(strAlbum);
+  entry.file_size = lngFileSize;
+  entry.length = intTrackLength;
+  entry.length_ms = intTrackLengthMs;
+  entry.description_key = description_key(strFile, strArtist, strAlbum, strTrackName);
+  entry.verified = 0; // Checked against the file the next time it is fetched
+
+  // Remember to add it to the journal later:
+  unjournaled.push_back(index);
+}
 
-  // Check if the MP3 info is already loaded into memory, return it if so:
-  tblmp3_info_map::const_iterator item;
-  item = mp3_info.find(strFilePath);
-  if (item != mp3_info.end()) return item;
+bool mp3_tags::find_cached(const string & strFile, mp3_tag_item & item) const {
+  // Look for a file's details. Entries in memory are newer than the cache file.
+  uint64_t hash = fnv1a_hash(strFile);
+  uint32_t slot = entry_slots[find_entry(strFile, hash)];
+  if (slot != 0) {
+    const mp3_tag_entry & entry = entries[slot - 1];
+    item.lngFileSize  = entry.file_size;
+    item.intArtistId  = entry.artist_id;
+    item.intAlbumId   = entry.album_id;
+    item.strTrackName = entry_text(entry.title_offset, entry.title_length);
+    item.intLength    = entry.length;
+    item.intLengthMs  = entry.length_ms;
+    item.blnVerified  = entry.verified == intVerifyGeneration;
+    item.intDescriptionKey = entry.description_key + 1;
+    return true;
+  }
+
+  long lngindex = cache_file.find(strFile);
+  if (lngindex < 0) return false;
+  const mp3_cache_entry & entry = cache_file.entry(lngindex);
+  item.lngFileSize  = entry.file_size;
+  item.intArtistId  = cache_file_artist_ids[entry.artist];
+  item.intAlbumId   = cache_file_album_ids[entry.album];
+  item.strTrackName = cache_file.get_string(entry.title_offset, entry.title_length);
+  item.intLength    = entry.length;
+  item.intLengthMs  = entry.length_ms;
+  item.blnVerified  = cache_file_verified[lngindex] == intVerifyGeneration;
+  item.intDescriptionKey = cache_file_description_keys[lngindex];
+  return true;
+}
 
-  // MP3 info is not in memory, attempt to load it via mp3info:
+void mp3_tags::set_verified(const string & strFile, const uint32_t generation) {
+  // Record when a file's entry was last checked against the file (0 for never)
+  uint64_t hash = fnv1a_hash(strFile);
+  uint32_t slot = entry_slots[find_entry(strFile, hash)];
+  if (slot != 0) {
+    entries[slot - 1].verified = generation;
+    return;
+  }
+  long lngindex = cache_file.find(strFile);
+  if (lngindex >= 0) cache_file_verified[lngindex] = generation;
+}
+
+void mp3_tags::next_verify_generation() {
+  // Invalidate all entries, by moving to a new generation. 0 means "never verified", so
+  // if the counter wraps around then reset all the entries.
+  if (++intVerifyGeneration == 0) {
+    intVerifyGeneration = 1;
+    cache_file_verified.assign(cache_file_verified.size(), 0);
+    for (vector<mp3_tag_entry>::iterator it = entries.begin(); it != entries.end(); ++it) it->verified = 0;
+  }
+}
 
-  // Check if mp3info is installed
-  if (!file_exists("/usr/bin/mp3info")) my_throw("mp3info not installed!");
+bool mp3_tags::is_unchanged(const string & strFilePath) {
+  lock_guard<mutex> lock(m_mutex);
+  if (!is_watched(strFilePath)) return false;
+  uint32_t slot = entry_slots[find_entry(strFilePath, fnv1a_hash(strFilePath))];
+  if (slot != 0) return entries[slot - 1].verified == intVerifyGeneration;
+  long lngindex = cache_file.find(strFilePath);
+  return lngindex >= 0 && cache_file_verified[lngindex] == intVerifyGeneration;
+}
 
-  // - Generate the command
-  string strCmd="/usr/bin/mp3info -p \"Artist:%a\\nAlbum:%l\\nTrack:%t\\nLength:%S\\n\" " + string_to_unix_filename(strFilePath) + "";
+bool mp3_tags::is_watched(const string & strFile) const {
+  return is_watched_path(watched_dirs, alias_dirs, strFile);
+}
 
-  // - Run the command
-  string stroutput;
-  system_capture_out(strCmd, stroutput);
+mp3_tags::mp3_tag_item mp3_tags::get_mp3_info_item(const string & strFilePath) {
+  // Fetch the cached item. If it doesn't exist (or the file changed since) then load it
 
-  // Process the output:
-  string_splitter mp3info_split(stroutput, "\n");
+  // Freak out if the file is not an mp3, or if it doesn't exist:
+  if (lcase(get_file_ext(strFilePath)) != "mp3") {
+    my_throw("File is not an mp3, can't fetch info for it: " + strFilePath);
+  }
 
-  // Should be 4 or 5 lines (4=no problem, 5=warning, no ID3 1.x tag).
-  if (mp3info_split.size() != 4 && mp3info_split.size() != 5) my_throw("Detected in the mp3info output! Invalid line count. Output follows:\n" + stroutput);
+  // Files under watched directories which haven't changed since they were last checked can be
+  // returned without touching the disk:
+  mp3_tag_item item;
+  unsigned long lngchange_count;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    if (find_cached(strFilePath, item) && item.blnVerified && is_watched(strFilePath)) return item;
+    lngchange_count = lngChangeCount;
+  }
 
-  // Variables to be extracted:
-  string strArtist, strAlbum, strTrackName;
-  int intLength = -1;
+  long lngFileSize;
+  if (!get_file_size(strFilePath, lngFileSize)) {
+    my_throw("File not found: " + strFilePath);
+  }
 
-  // Now parse the lines:
-  while (mp3info_split) {
-    string strline = mp3info_split;
-    // Ignore lines which end with "does not have an ID3 1.x tag"
-    string strerror_end = "does not have an ID3 1.x tag.";
-    if (right(strline, strerror_end.length()) != strerror_end) {
-      // Fetch the part before and after the colon:
-      string_splitter line_split(strline, ":");
-      string strfield = line_split;
-      string strvalue = substr(strline, strfield.length() + 1);
-      // Check which field we have:
-      if (strfield == "Artist") {
-        strArtist = strvalue;
-      }
-      else if (strfield == "Album") {
-        strAlbum = strvalue;
-      }
-      else if (strfield == "Track") {
-        strTrackName = strvalue;
-      }
-      else if (strfield == "Length") {
-        intLength = -1;
-        try {
-          intLength = strtoi(strvalue);
-        } catch_exceptions;
-      }
-      else log_warning("Found an unknown field in the mp3info output! " + strfield);
+  // Check if the MP3 info is already cached (and still matches the file), return it if so:
+  {
+    lock_guard<mutex> lock(m_mutex);
+    if (find_cached(strFilePath, item) && item.lngFileSize == lngFileSize) {
+      // Don't trust the check if the file may have changed meanwhile:
+      if (lngChangeCount == lngchange_count) set_verified(strFilePath, intVerifyGeneration);
+      return item;
     }
   }
 
-  // - Update the in-memory collection
-  cache_file_tag(strFilePath, file_size(strFilePath), strArtist, strAlbum, strTrackName, intLength);
+  // MP3 info is not cached, read it from the file. The lock isn't held meanwhile,
+  // so that other threads can read tags at the same time.
+  mp3_file_info info;
+  read_mp3_file_info(strFilePath, info);
 
-  // - Now fetch & return the cached item:
-  item = mp3_info.find(strFilePath);
-  if (item == mp3_info.end()) LOGIC_ERROR; // We just cached the item, we should never not find it!
+  // - Update the in-memory collection
+  lock_guard<mutex> lock(m_mutex);
+  cache_file_tag(strFilePath, info.lngfile_size, info.strartist, info.stralbum, info.strtitle, info.intlength, info.intlength_ms);
+  if (!find_cached(strFilePath, item)) LOGIC_ERROR; // We just cached the item, we should never not find it!
   return item;
 }
@@ -1,30 +1,33 @@
 /// @file
 /// Caching for mp3 tag details.
-/// This class is used to quickly retrieve tag details for mp3s. It pre-reads details from a text file
-/// and then uses this pre-read data when the program wants tag details. If tag details are wanted
-/// which are not listed in memory, they are loaded from the mp3 and then stored in memory.
-/// - Later the buffer textfile is re-written.
+/// This class is used to quickly retrieve tag details for mp3s. It maps a binary cache file (see
+/// mp3_tag_cache.h) and then uses this pre-read data when the program wants tag details. If tag details
+/// are wanted which are not listed, they are loaded from the mp3 and then stored in memory.
+/// - Later the new details are appended to the cache's journal, and from time to time folded
+///   back into the cache file ("compaction"). Compaction runs on its own thread, and only holds
+///   the lock briefly, to take a copy of the new entries and to switch to the new file.
+/// - The class is thread-safe, so tags can be read by background threads (see mp3_tag_warmup.h).
+/// - Artists and albums are interned: each distinct name has an integer id, which callers can
+///   use instead of comparing strings.
+/// - Keys for detecting duplicate songs (by file name, or by description) are computed once per
+///   entry, so playlist de-duplication only needs to compare ids.
+/// - Entries are normally checked against the file (with a stat) when they are fetched. Files
+///   under directories that are being watched for changes (see dir_watcher.h) are only checked
+///   once, after which they are trusted until invalidate() is called for them.
 
 #ifndef MP3_TAGS_H
 #define MP3_TAGS_H
 
 using namespace std;
 
+#include <mutex>
+#include <stdint.h>
 #include <string>
-#include <map>
-
-/// A private class for storing mp3 tag details in memory, for quick retrieval later.
-struct tblmp3_info {
-  string strMP3Path; ///< The path of the mp3 we are caching MP3 tag details for. Also the unique key.
-
-  // The MP3 details we are interested in
-  long lngFileSize; ///< Size in bytes
-  string strArtist; ///< Song artist
-  string strAlbum;  ///< Song album
-  string strTrackName; ///< Song track name
-  int intLength; ///< Song length in seconds
-};
-typedef map <const string, tblmp3_info> tblmp3_info_map;
+#include <thread>
+#include <vector>
+#include "logging.h"
+#include "mp3_tag_cache.h"
+#include "string_pool.h"
 
 // Now the main  mp3_tags class
 class mp3_tags {
@@ -32,24 +35,122 @@ public:
   mp3_tags();
   virtual ~mp3_tags();
 
-  void init(const string & strBuffFilePath);  ///< Initialize the mp3_tags object, provide a buffer filename
+  /// Initialize the mp3_tags object: map the binary cache file and replay its journal. If there is no
+  /// cache file yet, then tags are imported from strlegacy_text_file (the old text format) if given.
+  void init(const string & strcache_file, const string & strlegacy_text_file = "");
   virtual string get_mp3_description(const string & strFilePath);
-  int get_mp3_length(const string & strFilePath); ///< Fetch the length of an mp3
+  int get_mp3_length(const string & strFilePath); ///< Fetch the length of an mp3, in seconds
+  int get_mp3_length_ms(const string & strFilePath); ///< Fetch the length of an mp3, in milliseconds (see mp3_reader.h)
   virtual string get_mp3_artist(const string & strFilePath); ///< Fetch the artist for an MP3
   string get_mp3_album(const string & strFilePath); ///< Fetch the album for an MP3
-  void save_changes(); ///< Rewrite the buffer file if there are any new tag details that have been loaded.
+  bool prefetch(const string & strFilePath); ///< Load an mp3's details into the cache if needed. Returns false if they couldn't be read.
+  /// Is the file under a watched directory, and was its entry checked since the file last changed?
+  /// If so, then the file exists and its cached details are current, without needing a stat.
+  bool is_unchanged(const string & strFilePath);
+  /// Append new tag details to the journal, and start compacting the cache file (in the background)
+  /// when the journal gets large. Also logs how the last compaction went. Other threads can carry on
+  /// reading tags while the journal is written.
+  void save_changes();
+
+  // Interned artists & albums. Ids stay the same for the lifetime of the object.
+  virtual unsigned int get_mp3_artist_id(const string & strFilePath); ///< Fetch the id of an MP3's artist
+  virtual string get_artist_name(const unsigned int intArtistId); ///< Artist name for an id
+  unsigned int get_mp3_album_id(const string & strFilePath); ///< Fetch the id of an MP3's album
+  string get_album_name(const unsigned int intAlbumId); ///< Album name for an id
+
+  // Keys for finding duplicate songs. Files with the same key are duplicates. Keys are only
+  // meaningful for the lifetime of the object.
+  unsigned int get_file_name_key(const string & strFilePath); ///< Key for the lower-case file name (without the directory)
+  unsigned int get_description_key(const string & strFilePath); ///< Key for the trimmed, lower-case description (see get_mp3_description())
+
+  // Change tracking, for files under watched directories:
+  /// Files under these directories are only checked when they change. Files under alias_dirs (other
+  /// paths to watched directories, see dir_watcher::aliases()) are always checked.
+  void set_watched_dirs(const vector<string> & dirs, const vector<string> & alias_dirs);
+  void invalidate(const string & strFilePath); ///< A file changed. A directory (with a trailing slash) means anything may have changed.
+  void invalidate_all(); ///< Check all entries against their files again
 
 private:
-  string strTagBufferFile;   ///< Filename to save and load buffered mp3 tag details from
-  bool blnTagDetailsChanged; ///< Set to true if the tag buffer details change (new, removed, etc)
+  /// Compact in-memory record for an mp3 loaded since the cache file was written
+  struct mp3_tag_entry {
+    uint64_t path_hash;                  ///< fnv1a_hash() of the path
+    uint32_t path_offset, path_length;   ///< Path, in strText
+    uint32_t title_offset, title_length; ///< Track name, in strText
+    uint32_t artist_id, album_id;        ///< Ids in artists & albums
+    int64_t file_size;                   ///< Size in bytes
+    int32_t length;                      ///< Song length in seconds
+    int32_t length_ms;                   ///< Song length in milliseconds
+    uint32_t verified;                   ///< intVerifyGeneration when last checked against the file
+    uint32_t file_name_key;              ///< Id in dedup_keys
+    uint32_t description_key;            ///< Id in dedup_keys
+  };
+
+  /// Details returned by get_mp3_info_item()
+  struct mp3_tag_item {
+    long lngFileSize;
+    unsigned int intArtistId;
+    unsigned int intAlbumId;
+    string strTrackName;
+    int intLength;
+    int intLengthMs;
+    bool blnVerified; ///< Checked against the file since the last invalidation
+    uint32_t intDescriptionKey; ///< Id in dedup_keys + 1, or 0 if it hasn't been worked out yet
+  };
+
+  mutex m_save_mutex;       ///< Held by save_changes(), so that saves don't overlap. Entries keep their indexes meanwhile.
+  mutable mutex m_mutex;    ///< Protects the members below. Not held while reading tags from mp3s, or writing the journal & cache file.
+  string strTagCacheFile;   ///< Binary cache file to load mp3 tag details from
+  string strTagJournalFile; ///< Entries added since the cache file was written
+  mp3_tag_cache_file cache_file; ///< The mapped cache file
+  long lngJournalRecords;   ///< Number of records in the journal
+  bool blnCompactNeeded;    ///< Set when the cache file needs to be rewritten (eg: it or the journal are damaged)
+
+  // Background compaction. While it runs, nothing else replaces cache_file (so the thread can read
+  // it without the lock), and new entries aren't journaled (the journal is emptied when it finishes):
+  thread compact_thread;
+  bool blnCompacting;          ///< compact_thread is running
+  vector<log_info> compact_log; ///< Messages from compact_thread, for save_changes() to log
+
+  // Interned names, and the ids of the cache file's artist & album tables:
+  string_pool artists, albums;
+  vector<unsigned int> cache_file_artist_ids, cache_file_album_ids;
+
+  // Duplicate detection keys (normalised file names & descriptions). Keys for cache file entries
+  // are worked out when they are first needed, and stored as id + 1 (0 for not yet):
+  string_pool dedup_keys;
+  vector<uint32_t> cache_file_file_name_keys, cache_file_description_keys;
+
+  // Change tracking. An entry is trusted without a stat if its file is under a watched directory
+  // and it has been verified in the current generation:
+  vector<string> watched_dirs;      ///< Directories being watched for changes (with trailing slashes)
+  vector<string> alias_dirs;        ///< Paths under watched_dirs which aren't watched themselves (with trailing slashes)
+  uint32_t intVerifyGeneration;     ///< Bumped to invalidate all entries. Never 0.
+  unsigned long lngChangeCount;     ///< Number of invalidations so far. Lets a check which raced with an invalidation be discarded.
+  vector<uint32_t> cache_file_verified; ///< Verification generation of each cache file entry
 
-  // Internal caching functions
-  tblmp3_info_map mp3_info; ///< Used to store the file path (as the key) and the mp3 description in memory
+  // Details loaded since the cache file was written (from the journal or the mp3s). These override cache_file.
+  vector<mp3_tag_entry> entries; ///< The entries
+  vector<uint32_t> entry_slots;  ///< Open-addressing hash table over entries, by path: index + 1, or 0 for an empty slot
+  string strText;                ///< Paths & track names of entries
+  vector<uint32_t> unjournaled;  ///< Indexes of entries which have not been written to the journal yet
 
-  // - So we can quickly find the description we're looking for.
-  void cache_file_tag(const string & strFile, const long lngFileSize, const string & strArtist, const string & strAlbum, const string & strTrackName, const int intTrackLength);
-  bool file_tag_cached(const string & strFile);
-  tblmp3_info_map::const_iterator get_mp3_info_item(const string & strFilePath); /// Fetch the cached item. If it doesn't exist then load it
+  void import_text_cache(const string & strFile); ///< Load tag details from the old text file format
+  void map_cache_file_names(); ///< Intern the cache file's artists & albums
+  void start_compact(); ///< Start compact_thread. Called with the lock held.
+  void wait_for_compact(); ///< Wait for compact_thread to finish. Called without the lock.
+  void compact(); ///< Rewrite the cache file with the journal's entries folded in, and empty the journal. Main function of compact_thread.
+  void clear_entries(); ///< Forget the in-memory entries
+  long find_entry(const string & strFile, const uint64_t hash) const; ///< Find an in-memory entry. Returns its hash slot; empty if not found.
+  string entry_text(const uint32_t offset, const uint32_t length) const { return strText.substr(offset, length); }
+  void entry_to_info(const mp3_tag_entry & entry, tblmp3_info & info) const; ///< Fetch an in-memory entry with its strings
+  void cache_file_tag(const string & strFile, const long lngFileSize, const string & strArtist, const string & strAlbum, const string & strTrackName, const int intTrackLength, const int intTrackLengthMs);
+  bool find_cached(const string & strFile, mp3_tag_item & item) const; ///< Look for a file's details in memory or the cache file
+  void reset_cache_file_keys(); ///< Forget the keys of the cache file's entries (eg: it was replaced)
+  uint32_t description_key(const string & strFile, const string & strArtist, const string & strAlbum, const string & strTrackName); ///< Work out a description key
+  void set_verified(const string & strFile, const uint32_t generation); ///< Record when a file's entry was last checked
+  void next_verify_generation(); ///< Invalidate all entries
+  bool is_watched(const string & strFile) const; ///< Is the file under a watched directory (and not an alias)?
+  mp3_tag_item get_mp3_info_item(const string & strFilePath); ///< Fetch the cached item. If it doesn't exist (or the file changed) then load it
 };
 
 #endif
@@ -409,8 +409,8 @@ bool pg_result::field_is_null(const string & strfield) const {
 }
 
 void pg_result::operator ++(int) { // Move to the next record
-  check_presult();
-  if (this) { // Any records left?
+  // (size() checks presult, and lets subclasses such as fake results for benchmarks supply their own rows)
+  if (row_num < this->size()) { // Any records left?
     ++row_num;
   }
   else my_throw("No more records left!");
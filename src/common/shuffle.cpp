@@ -0,0 +1,77 @@
+
+#include "shuffle.h"
+#include "string_pool.h"
+#include <mutex>
+#include <sys/time.h>
+#include <unistd.h>
+
+pcg32::pcg32(const uint64_t seed) : m_state(0) {
+  // Seeding procedure from the PCG reference implementation (with its default stream):
+  next();
+  m_state += seed;
+  next();
+}
+
+uint32_t pcg32::next() {
+  uint64_t oldstate = m_state;
+  m_state = oldstate * 6364136223846793005ULL + 1442695040888963407ULL;
+  uint32_t xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
+  uint32_t rot = oldstate >> 59u;
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+uint32_t pcg32::next_below(const uint32_t bound) {
+  // Lemire's multiply-and-shift method, rejecting the few values which would make some
+  // results more likely than others:
+  uint64_t m = (uint64_t)next() * bound;
+  uint32_t low = (uint32_t)m;
+  if (low < bound) {
+    uint32_t threshold = (-bound) % bound;
+    while (low < threshold) {
+      m = (uint64_t)next() * bound;
+      low = (uint32_t)m;
+    }
+  }
+  return m >> 32;
+}
+
+// Seeds are splitmix64 outputs for the base seed plus a hash of the shuffle's key, so that every
+// seed can be reproduced from the base seed:
+static mutex seed_mutex;
+static bool blnbase_seed_set = false;
+static uint64_t base_seed = 0;
+
+static uint64_t splitmix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// Called with seed_mutex locked:
+static void ensure_base_seed() {
+  if (blnbase_seed_set) return;
+  // Different for each run of the program:
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  base_seed = splitmix64(((uint64_t)tv.tv_sec << 20) ^ (uint64_t)tv.tv_usec ^ ((uint64_t)getpid() << 40));
+  blnbase_seed_set = true;
+}
+
+uint64_t shuffle_seed(const string & strkey) {
+  lock_guard<mutex> lock(seed_mutex);
+  ensure_base_seed();
+  return splitmix64(base_seed + splitmix64(fnv1a_hash(strkey)));
+}
+
+void set_shuffle_base_seed(const uint64_t seed) {
+  lock_guard<mutex> lock(seed_mutex);
+  base_seed = seed;
+  blnbase_seed_set = true;
+}
+
+uint64_t get_shuffle_base_seed() {
+  lock_guard<mutex> lock(seed_mutex);
+  ensure_base_seed();
+  return base_seed;
+}
@@ -0,0 +1,48 @@
+/// @file
+/// Seedable shuffling, for playlists and music beds.
+/// - pcg32 is a small, fast random number generator (PCG-XSH-RR, see http://www.pcg-random.org/).
+///   Unlike rand(), it has no global state, so every shuffle can have its own seed.
+/// - Seeds come from shuffle_seed(), which derives them from a base seed (chosen at startup, or
+///   set with set_shuffle_base_seed()) and stable details of what is being shuffled. The base seed
+///   and the seeds used are logged, so the shuffles can be reproduced later (eg: to track down a
+///   playlist problem, or in benchmarks), whichever threads did them and in whatever order.
+
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include <algorithm>
+#include <iterator>
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+/// PCG random number generator with 64 bits of state and 32-bit output
+class pcg32 {
+public:
+  explicit pcg32(const uint64_t seed);
+  uint32_t next(); ///< Next number, in [0, 2^32)
+  uint32_t next_below(const uint32_t bound); ///< Next number in [0, bound), without modulo bias. bound must be > 0.
+
+private:
+  uint64_t m_state;
+};
+
+/// Shuffle a range with an unbiased Fisher-Yates shuffle. The same seed always gives the same order.
+template <class random_iter>
+void seeded_shuffle(random_iter first, random_iter last, const uint64_t seed) {
+  pcg32 rng(seed);
+  typename iterator_traits<random_iter>::difference_type n = last - first;
+  for (; n > 1; --n) {
+    swap(first[n - 1], first[rng.next_below((uint32_t)n)]);
+  }
+}
+
+/// The seed for a shuffle, derived from the base seed and strkey. strkey identifies what is being
+/// shuffled by details which are the same when it is shuffled again (eg: a segment and its
+/// scheduled start time), not by when or where it happens. Thread-safe.
+uint64_t shuffle_seed(const string & strkey);
+void set_shuffle_base_seed(const uint64_t seed); ///< Set the base seed (eg: to reproduce a day's playlists)
+uint64_t get_shuffle_base_seed(); ///< The current base seed
+
+#endif
@@ -0,0 +1,75 @@
+
+#include "string_pool.h"
+#include "exception.h"
+
+uint64_t fnv1a_hash(const char * data, const size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+unsigned long hash_table_size(const unsigned long lngcount) {
+  unsigned long lngsize = 16;
+  while (lngsize < lngcount * 2) lngsize *= 2;
+  return lngsize;
+}
+
+string_pool::string_pool() {
+  m_slots.resize(hash_table_size(0), 0);
+}
+
+long string_pool::find_slot(const string & str, const uint64_t hash) const {
+  // Linear probing. The table is never more than half full, so there is always an empty slot.
+  unsigned long lngmask = m_slots.size() - 1;
+  unsigned long lngslot = hash & lngmask;
+  while (m_slots[lngslot] != 0) {
+    uint32_t id = m_slots[lngslot] - 1;
+    if (m_hashes[id] == hash && m_strings[id] == str) break;
+    lngslot = (lngslot + 1) & lngmask;
+  }
+  return lngslot;
+}
+
+unsigned int string_pool::intern(const string & str) {
+  uint64_t hash = fnv1a_hash(str);
+  long lngslot = find_slot(str, hash);
+  if (m_slots[lngslot] != 0) return m_slots[lngslot] - 1;
+
+  unsigned int intid = m_strings.size();
+  m_strings.push_back(str);
+  m_hashes.push_back(hash);
+  m_slots[lngslot] = intid + 1;
+  if (m_strings.size() * 2 > m_slots.size()) grow();
+  return intid;
+}
+
+bool string_pool::find(const string & str, unsigned int & intid) const {
+  long lngslot = find_slot(str, fnv1a_hash(str));
+  if (m_slots[lngslot] == 0) return false;
+  intid = m_slots[lngslot] - 1;
+  return true;
+}
+
+const string & string_pool::get(const unsigned int intid) const {
+  if (intid >= m_strings.size()) LOGIC_ERROR;
+  return m_strings[intid];
+}
+
+void string_pool::clear() {
+  m_strings.clear();
+  m_hashes.clear();
+  m_slots.assign(hash_table_size(0), 0);
+}
+
+void string_pool::grow() {
+  m_slots.assign(m_slots.size() * 2, 0);
+  unsigned long lngmask = m_slots.size() - 1;
+  for (unsigned int id = 0; id < m_strings.size(); ++id) {
+    unsigned long lngslot = m_hashes[id] & lngmask;
+    while (m_slots[lngslot] != 0) lngslot = (lngslot + 1) & lngmask;
+    m_slots[lngslot] = id + 1;
+  }
+}
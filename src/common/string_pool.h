@@ -0,0 +1,42 @@
+/// @file
+/// Interned strings, for data where the same strings repeat a lot (eg: mp3 artists).
+/// Each distinct string is stored once and given a small integer id, so callers can
+/// store and compare ids instead of strings.
+
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// 64-bit FNV-1a hash of a string. Stable, so it can be stored in files.
+uint64_t fnv1a_hash(const char * data, const size_t len);
+inline uint64_t fnv1a_hash(const string & str) { return fnv1a_hash(str.data(), str.length()); }
+
+/// Returns a power of two hash table size (at least twice lngcount, so probe sequences stay short)
+unsigned long hash_table_size(const unsigned long lngcount);
+
+/// A set of strings with ids (0, 1, 2, ...), using an open-addressing hash table for lookups.
+class string_pool {
+public:
+  string_pool();
+
+  unsigned int intern(const string & str); ///< Return the id of a string, adding it if needed
+  bool find(const string & str, unsigned int & intid) const; ///< Look up the id of a string. Returns false if not in the pool
+  const string & get(const unsigned int intid) const; ///< The string with an id
+  unsigned int size() const { return m_strings.size(); } ///< Number of strings in the pool
+  void clear(); ///< Remove all strings. Ids are given out from 0 again.
+
+private:
+  vector<string> m_strings;   ///< Strings, indexed by id
+  vector<uint64_t> m_hashes;  ///< Hashes of m_strings, so the table can grow without re-hashing
+  vector<uint32_t> m_slots;   ///< Hash table: id + 1, or 0 for an empty slot
+
+  long find_slot(const string & str, const uint64_t hash) const; ///< Slot holding str, or the empty slot where it belongs
+  void grow(); ///< Double the hash table size
+};
+
+#endif
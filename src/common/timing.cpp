@@ -0,0 +1,68 @@
+
+#include "timing.h"
+#include "exception.h"
+#include "logging.h"
+#include "my_string.h"
+#include <cerrno>
+#include <cstdlib>
+#include <sys/time.h>
+#include <time.h>
+
+using namespace std;
+
+wall_clock_mapping wall_clock;
+
+long monotonic_ms() {
+  timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) my_throw("Could not read the monotonic clock!");
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+void sleep_until_monotonic_ms(const long lngdeadline_ms) {
+  timespec ts;
+  ts.tv_sec  = lngdeadline_ms / 1000;
+  ts.tv_nsec = (lngdeadline_ms % 1000) * 1000000L;
+  // An absolute deadline means a signal interrupting the sleep doesn't make us oversleep when it is restarted:
+  int intret;
+  do {
+    intret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  } while (intret == EINTR);
+  if (intret != 0) my_throw((string)strerror(intret) + ". Sleeping until a monotonic clock deadline");
+}
+
+wall_clock_mapping::wall_clock_mapping(const long lngstep_threshold_ms) : m_lngoffset_ms(system_offset_ms()), m_lngstep_threshold_ms(lngstep_threshold_ms), m_lngsteps(0) {
+}
+
+long wall_clock_mapping::now_ms() {
+  return to_wall_ms(monotonic_ms());
+}
+
+long wall_clock_mapping::to_wall_ms(const long lngmonotonic_ms) {
+  lock_guard<mutex> lock(m_mutex);
+  return lngmonotonic_ms + m_lngoffset_ms;
+}
+
+void wall_clock_mapping::check() {
+  long lngoffset_ms = system_offset_ms();
+  long lngstep_ms;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    lngstep_ms = lngoffset_ms - m_lngoffset_ms;
+    m_lngoffset_ms = lngoffset_ms;
+    // Small differences are the system time being slewed (or rounding), and are followed quietly:
+    if (labs(lngstep_ms) <= m_lngstep_threshold_ms) return;
+    ++m_lngsteps;
+  }
+  log_warning("Detected: System clock moved " + (string)(lngstep_ms < 0 ? "back " : "forward ") + ltostr(labs(lngstep_ms)) + " ms. Recalibrating player timing.");
+}
+
+unsigned long wall_clock_mapping::steps() {
+  lock_guard<mutex> lock(m_mutex);
+  return m_lngsteps;
+}
+
+long wall_clock_mapping::system_offset_ms() {
+  timeval tvnow;
+  gettimeofday(&tvnow, NULL);
+  return tvnow.tv_sec * 1000L + tvnow.tv_usec / 1000 - monotonic_ms();
+}
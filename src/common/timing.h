@@ -0,0 +1,51 @@
+/// @file
+/// Timing for the player.
+/// - Intervals and deadlines are measured on a monotonic millisecond clock (CLOCK_MONOTONIC),
+///   which isn't affected when the system time is set (eg: by ntpdate), so fades and timers
+///   can't fire early or late because of it.
+/// - The wall clock is only needed where the real time matters (eg: looking up the Format Clock
+///   schedule). wall_clock maps the monotonic clock to the wall clock with millisecond
+///   resolution, using a fixed offset. The player's main loop checks the offset against the
+///   system time, and counts it when the system time steps, so callers can recalibrate anything
+///   they remember in wall-clock time.
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <mutex>
+
+long monotonic_ms(); ///< Milliseconds on the monotonic clock (since an unspecified point, eg: boot)
+
+/// Sleep until the monotonic clock reaches lngdeadline_ms. Returns immediately if that has passed.
+void sleep_until_monotonic_ms(const long lngdeadline_ms);
+
+/// Maps monotonic clock times to wall-clock times, by a fixed offset. The offset only changes
+/// in check(), so conversions are cheap and consistent with each other in between. Thread-safe.
+class wall_clock_mapping {
+public:
+  wall_clock_mapping(const long lngstep_threshold_ms = 1000); ///< Constructor. Takes the offset from the system time.
+
+  long now_ms(); ///< Current wall-clock time, in ms since the epoch
+  long to_wall_ms(const long lngmonotonic_ms); ///< Wall-clock time (ms since the epoch) at a monotonic clock time
+
+  /// Check the offset against the system time, and follow it. A change of more than
+  /// lngstep_threshold_ms is logged and counted as a step. Logs, so only call it from the
+  /// player thread (once per main loop iteration).
+  void check();
+
+  /// Counts the times check() saw the system time step. Compare with an earlier result to find out
+  /// if it stepped since then.
+  unsigned long steps();
+
+private:
+  std::mutex m_mutex;
+  long m_lngoffset_ms; ///< Wall-clock ms minus monotonic ms
+  long m_lngstep_threshold_ms;
+  unsigned long m_lngsteps;
+
+  static long system_offset_ms(); ///< Wall-clock ms minus monotonic ms, from the system time
+};
+
+extern wall_clock_mapping wall_clock; ///< Shared by the whole program
+
+#endif
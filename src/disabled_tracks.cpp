@@ -0,0 +1,70 @@
+
+#include "disabled_tracks.h"
+#include "common/exception.h"
+#include "common/logging.h"
+#include "common/my_string.h"
+#include "common/psql.h"
+#include "common/string_splitter.h"
+#include <algorithm>
+
+using namespace std;
+
+disabled_track_set::disabled_track_set() : m_blnloaded(false), m_lngcount(0) {
+}
+
+void disabled_track_set::prune(pg_conn_exec & db, vector<string> & file_list) {
+  lock_guard<mutex> lock(m_mutex);
+  refresh(db);
+  if (m_tracks.empty()) return;
+  file_list.erase(remove_if(file_list.begin(), file_list.end(),
+                            [this](const string & strfile) { return m_tracks.count(strfile) != 0; }),
+                  file_list.end());
+}
+
+void disabled_track_set::clear() {
+  lock_guard<mutex> lock(m_mutex);
+  m_tracks.clear();
+  m_blnloaded = false;
+}
+
+void disabled_track_set::refresh(pg_conn_exec & db) {
+  // Did anything change since the list was fetched?
+  string strsql = "SELECT COUNT(*) AS lngcount, MAX(dtmtime) AS dtmlatest FROM tblplayeroutput WHERE strmsgdesc = " + psql_str("disabled");
+  ap_pg_result rs = db.exec(strsql);
+  long lngcount = rs->empty() ? 0 : strtol(rs->field("lngcount", "0"));
+  string strlatest = rs->empty() ? "" : rs->field("dtmlatest", "");
+  if (m_blnloaded && lngcount == m_lngcount && strlatest == m_strlatest) return;
+
+  // If songs were only added, fetch just those:
+  if (m_blnloaded && lngcount > m_lngcount && m_strlatest != "") {
+    long lngadded = add_rows(db, " AND dtmtime > " + psql_str(m_strlatest));
+    if (m_lngcount + lngadded == lngcount) {
+      m_lngcount = lngcount;
+      m_strlatest = strlatest;
+      return;
+    }
+  }
+
+  // Otherwise fetch the whole list again:
+  m_tracks.clear();
+  m_blnloaded = false;
+  add_rows(db, "");
+  m_lngcount = lngcount;
+  m_strlatest = strlatest;
+  m_blnloaded = true;
+}
+
+long disabled_track_set::add_rows(pg_conn_exec & db, const string & strwhere) {
+  string strsql = "SELECT strmessage FROM tblplayeroutput WHERE strmsgdesc = " + psql_str("disabled") + strwhere;
+  ap_pg_result rs = db.exec(strsql);
+  while (*rs) {
+    try {
+      string_splitter split(rs->field("strmessage", ""), "||");
+      string strdisabled_mp3 = split;
+      if (strdisabled_mp3 != "")
+        m_tracks.insert(strdisabled_mp3); // Inserting the same key twice has no effect, don't check...
+    } catch_exceptions;
+    (*rs)++;
+  }
+  return rs->size();
+}
@@ -0,0 +1,40 @@
+
+#ifndef DISABLED_TRACKS_H
+#define DISABLED_TRACKS_H
+
+#include <mutex>
+#include <string>
+#include <tr1/unordered_set>
+#include <vector>
+
+class pg_conn_exec;
+
+/// The songs which were disabled through the wizard (listed in tblplayeroutput), kept in memory
+/// between playlist builds.
+///
+/// Before each use, a one-row summary of the disabled songs (how many there are, and when the
+/// latest was disabled) is fetched. If only new songs were disabled, just those are fetched.
+/// Otherwise (eg: songs were enabled again), the whole list is fetched again.
+///
+/// The set is thread-safe.
+class disabled_track_set {
+public:
+  disabled_track_set(); ///< Constructor
+
+  /// Remove disabled songs from a file list (keeping the order of the rest), after fetching changes from the database
+  void prune(pg_conn_exec & db, std::vector<std::string> & file_list);
+
+  void clear(); ///< Fetch the whole list again next time (eg: because the database changed)
+
+private:
+  std::mutex m_mutex;
+  std::tr1::unordered_set<std::string> m_tracks;
+  bool m_blnloaded;         ///< Has the list been fetched?
+  long m_lngcount;          ///< Number of tblplayeroutput rows the list was fetched from
+  std::string m_strlatest;  ///< Latest dtmtime of those rows
+
+  void refresh(pg_conn_exec & db); ///< Fetch changes. Called with m_mutex locked.
+  long add_rows(pg_conn_exec & db, const std::string & strwhere); ///< Add songs from the tblplayeroutput rows matching strwhere. Returns the number of rows.
+};
+
+#endif
@@ -8,7 +8,9 @@
 
 #include "player.h"
 #include "common/exception.h"
+#include "common/my_string.h"
 #include "common/rr_misc.h"
+#include "common/shuffle.h"
 #include <iostream>
 
 #include "common/testing.h"
@@ -26,23 +28,25 @@ int main(int argc, char *argv[])
     logging.add_logger(log);
 
     // Check arguments:
-    {
-      if (argc > 1) {
-        string strarg = argv[1];
-        if (strarg == "help") {
-          cout << endl;
-          cout << "Run the Player with one of these arguments:" << endl;
-          cout << endl;
-          cout << "  <No arguments>  - Start up a normal Player session" << endl;
-          cout << "  debug           - Start up the Player in debug mode." << endl;
-          cout << "  help            - Display this help message." << endl;
-          cout << endl;
-          return EXIT_SUCCESS;
-        } else if (strarg == "debug") {
-          log_line("Starting the Player in debug mode.");
-          logging.blndebug = true;
-        } else my_throw("Unknown argument: " + strarg);
-      }
+    for (int intarg = 1; intarg < argc; ++intarg) {
+      string strarg = argv[intarg];
+      if (strarg == "help") {
+        cout << endl;
+        cout << "Run the Player with these arguments:" << endl;
+        cout << endl;
+        cout << "  <No arguments>  - Start up a normal Player session" << endl;
+        cout << "  debug           - Start up the Player in debug mode." << endl;
+        cout << "  seed <number>   - Shuffle playlists the same way as the session which logged" << endl;
+        cout << "                    this shuffle seed at startup." << endl;
+        cout << "  help            - Display this help message." << endl;
+        cout << endl;
+        return EXIT_SUCCESS;
+      } else if (strarg == "debug") {
+        log_line("Starting the Player in debug mode.");
+        logging.blndebug = true;
+      } else if (strarg == "seed" && intarg + 1 < argc) {
+        set_shuffle_base_seed(strtoull(argv[++intarg]));
+      } else my_throw("Unknown argument: " + strarg);
     }
 
     //  Init the player:
@@ -0,0 +1,115 @@
+
+#include "maintenance_scheduler.h"
+#include "common/exception.h"
+#include "common/logging.h"
+#include "common/my_string.h"
+#include "common/timing.h"
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+maintenance_scheduler::maintenance_scheduler() {
+}
+
+void maintenance_scheduler::add(const string & strname, const int intpriority, const long lngfreq_ms, const long lngestimate_ms, task_func func) {
+  task t;
+  t.strname         = strname;
+  t.intpriority     = intpriority;
+  t.lngfreq_ms      = lngfreq_ms;
+  t.lngestimate_ms  = lngestimate_ms;
+  t.func            = func;
+  t.lnglast_start_ms = LONG_MIN;
+  t.blnunfinished   = false;
+  t.blnpostponed    = false;
+  t.intnext_sample  = 0;
+  t.lngruns         = 0;
+  t.lngpostponed    = 0;
+
+  // Keep the tasks sorted by priority (tasks with the same priority run in the order they were added):
+  vector<task>::iterator it = m_tasks.begin();
+  while (it != m_tasks.end() && it->intpriority >= intpriority) ++it;
+  m_tasks.insert(it, t);
+}
+
+void maintenance_scheduler::run(const long lngbudget_ms) {
+  long lngcutoff_ms = monotonic_ms() + lngbudget_ms;
+  for (vector<task>::iterator it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+    // Is the task due?
+    long lngnow_ms = monotonic_ms();
+    if (due_ms(*it) > lngnow_ms) continue;
+
+    // Does it fit in what's left of the budget?
+    if (lngnow_ms + predicted_ms(*it) > lngcutoff_ms) {
+      ++it->lngpostponed;
+      it->blnpostponed = true;
+      continue;
+    }
+
+    // Run it:
+    it->blnpostponed = false;
+    if (!it->blnunfinished) it->lnglast_start_ms = lngnow_ms;
+    bool blnfinished = true;
+    try {
+      blnfinished = it->func(lngcutoff_ms);
+    } catch_exceptions;
+    it->blnunfinished = !blnfinished;
+    record(*it, monotonic_ms() - lngnow_ms);
+  }
+}
+
+void maintenance_scheduler::set_due(const string & strname) {
+  for (vector<task>::iterator it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+    if (it->strname != strname) continue;
+    it->lnglast_start_ms = LONG_MIN;
+    it->blnpostponed = false;
+    return;
+  }
+  LOGIC_ERROR; // No such task
+}
+
+long maintenance_scheduler::next_due_ms() const {
+  long lngnext_ms = LONG_MAX;
+  for (vector<task>::const_iterator it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+    if (!it->blnpostponed) lngnext_ms = min(lngnext_ms, due_ms(*it));
+  }
+  return lngnext_ms;
+}
+
+void maintenance_scheduler::log_stats() {
+  for (vector<task>::const_iterator it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+    if (it->lngruns == 0 && it->lngpostponed == 0) continue;
+    string strline = "Maintenance task " + it->strname + ": " + ltostr(it->lngruns) + " runs";
+    if (!it->samples.empty()) {
+      vector<long> sorted(it->samples);
+      sort(sorted.begin(), sorted.end());
+      strline += ", recently " + ltostr(sorted[sorted.size() / 2]) + " ms (median) to " + ltostr(sorted.back()) + " ms";
+    }
+    strline += ", postponed " + ltostr(it->lngpostponed) + " times";
+    log_line(strline);
+  }
+}
+
+long maintenance_scheduler::due_ms(const task & t) {
+  // Tasks which haven't run yet, or have more to do, are due now:
+  if (t.blnunfinished || t.lnglast_start_ms == LONG_MIN) return LONG_MIN;
+  return t.lnglast_start_ms + t.lngfreq_ms;
+}
+
+long maintenance_scheduler::predicted_ms(const task & t) {
+  // The longest recent run, with 50% to spare:
+  if (t.samples.empty()) return t.lngestimate_ms;
+  long lngmax_ms = *max_element(t.samples.begin(), t.samples.end());
+  return lngmax_ms + lngmax_ms / 2;
+}
+
+void maintenance_scheduler::record(task & t, const long lngtook_ms) {
+  ++t.lngruns;
+  if (t.samples.size() < intmax_samples) {
+    t.samples.push_back(lngtook_ms);
+  }
+  else {
+    t.samples[t.intnext_sample] = lngtook_ms;
+    t.intnext_sample = (t.intnext_sample + 1) % intmax_samples;
+  }
+}
@@ -0,0 +1,66 @@
+
+#ifndef MAINTENANCE_SCHEDULER_H
+#define MAINTENANCE_SCHEDULER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/// Runs the player's maintenance tasks in the idle time before the next playback event.
+///
+/// Each task has a priority and an interval between runs. run() is given the time available
+/// (its budget), and runs the due tasks in priority order, but only the ones whose predicted
+/// cost still fits in the budget. The others wait for a longer idle window. A task's predicted
+/// cost comes from how long its recent runs actually took (until it has run, an estimate given
+/// when it is added is used instead).
+///
+/// Long tasks can be split into resumable chunks: the task returns false when it has more work
+/// to do, and is called again (to carry on from where it left off) by the next run() with room
+/// for it, without waiting for its interval.
+///
+/// Between runs, next_due_ms() says when to call run() again, so the caller can sleep until then.
+class maintenance_scheduler {
+public:
+  /// A task. Should not run past lngcutoff_ms (a monotonic clock time, see common/timing.h).
+  /// Returns true when it is finished, or false if it stopped early and has more to do.
+  typedef std::function<bool (const long lngcutoff_ms)> task_func;
+
+  maintenance_scheduler(); ///< Constructor
+
+  /// Add a task. Tasks with higher priorities run first. lngestimate_ms is its predicted cost until it has run.
+  void add(const std::string & strname, const int intpriority, const long lngfreq_ms, const long lngestimate_ms, task_func func);
+
+  void run(const long lngbudget_ms); ///< Run the due tasks which fit in lngbudget_ms
+  void set_due(const std::string & strname); ///< Make a task due now, whatever its interval (eg: it has new work)
+
+  /// When the next task is due (a monotonic clock time), or LONG_MAX if none are. Tasks which didn't
+  /// fit in the last run()'s budget are left out: they wait for a longer idle window, which only comes
+  /// after the next playback event.
+  long next_due_ms() const;
+  void log_stats(); ///< Log how long each task takes, and how often it had to wait for a longer window
+
+private:
+  static const unsigned int intmax_samples = 32; ///< Recent run times remembered per task
+
+  struct task {
+    std::string strname;
+    int intpriority;
+    long lngfreq_ms;
+    long lngestimate_ms;
+    task_func func;
+    long lnglast_start_ms;      ///< When the task (or its first chunk) last started. LONG_MIN if never.
+    bool blnunfinished;         ///< The last chunk returned false
+    bool blnpostponed;          ///< Was due, but didn't fit in the last run()'s budget
+    std::vector<long> samples;  ///< Recent run times (ms), oldest overwritten first
+    unsigned int intnext_sample;
+    long lngruns;               ///< Number of runs (or chunks)
+    long lngpostponed;          ///< Number of times the task was due, but didn't fit in the budget
+  };
+  std::vector<task> m_tasks; ///< By priority
+
+  static long due_ms(const task & t); ///< When the task is due. LONG_MIN if it is due now.
+  static long predicted_ms(const task & t); ///< How long will the task's next run take?
+  static void record(task & t, const long lngtook_ms); ///< Remember how long a run took
+};
+
+#endif
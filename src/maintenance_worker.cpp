@@ -0,0 +1,153 @@
+
+#include "maintenance_worker.h"
+#include "common/exception.h"
+#include "common/timing.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+
+using namespace std;
+
+maintenance_worker::maintenance_worker() : m_blnstop(false), m_blnconfig_changed(false), m_lngplayer_posts(0), m_lngplayer_posts_seen(0) {
+  // The worker's own tasks:
+  m_scheduler.add("log_worker_stats", 0, 60*60*1000, 1000, [this](const long) { m_scheduler.log_stats(); return true; });
+}
+
+maintenance_worker::~maintenance_worker() {
+  stop();
+}
+
+void maintenance_worker::add(const string & strname, const int intpriority, const long lngfreq_ms, const long lngestimate_ms, task_func func) {
+  if (m_thread.joinable()) LOGIC_ERROR; // Too late, the thread is using m_scheduler
+  m_scheduler.add(strname, intpriority, lngfreq_ms, lngestimate_ms, [this, func](const long lngcutoff_ms) { return func(m_db, m_thread_config, lngcutoff_ms); });
+}
+
+void maintenance_worker::start(const string & strdb_conn) {
+  stop();
+  m_blnstop = false;
+  m_thread = thread(&maintenance_worker::run, this, strdb_conn);
+}
+
+void maintenance_worker::stop() {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_blnstop = true;
+  }
+  m_cv.notify_all();
+  if (m_thread.joinable()) m_thread.join();
+  m_jobs.clear();
+}
+
+void maintenance_worker::set_config(const player_config & config) {
+  lock_guard<mutex> lock(m_mutex);
+  m_config = config;
+  m_blnconfig_changed = true;
+}
+
+void maintenance_worker::post(const job_func & job) {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_jobs.push_back(job);
+  }
+  m_cv.notify_all();
+}
+
+void maintenance_worker::post_to_player(const action_func & action) {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_actions.push_back(action);
+    ++m_lngplayer_posts;
+  }
+  m_player_cv.notify_all();
+}
+
+void maintenance_worker::run_player_actions() {
+  // Take everything queued so far, so that the worker isn't held up while it runs:
+  deque<action_func> actions;
+  vector<log_info> captured;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    actions.swap(m_actions);
+    captured.swap(m_log);
+  }
+  logging.replay(captured);
+  for (deque<action_func>::iterator it = actions.begin(); it != actions.end(); ++it) {
+    try {
+      (*it)();
+    } catch_exceptions;
+  }
+}
+
+bool maintenance_worker::wait_for_player_actions(const long lngdeadline_ms) {
+  unique_lock<mutex> lock(m_mutex);
+  long lngnow_ms = monotonic_ms();
+  long lngwait_ms = lngdeadline_ms > lngnow_ms ? lngdeadline_ms - lngnow_ms : 0;
+  m_player_cv.wait_for(lock, chrono::milliseconds(lngwait_ms), [this] { return m_lngplayer_posts != m_lngplayer_posts_seen; });
+  bool blnposted = m_lngplayer_posts != m_lngplayer_posts_seen;
+  m_lngplayer_posts_seen = m_lngplayer_posts;
+  return blnposted;
+}
+
+void maintenance_worker::run(const string strdb_conn) {
+  // Runs on m_thread, until stop() is called.
+  long lngnext_connect_ms = LONG_MIN;
+  unique_lock<mutex> lock(m_mutex);
+  while (!m_blnstop) {
+    lock.unlock();
+    vector<log_info> captured;
+    logging.begin_capture(captured);
+    try {
+      // (Re)connect to the database if needed. Nothing can run without it:
+      if (!m_db.isopen() && monotonic_ms() >= lngnext_connect_ms) {
+        lngnext_connect_ms = monotonic_ms() + intreconnect_ms;
+        m_db.open(strdb_conn);
+      }
+    } catch_exceptions;
+    if (m_db.isopen()) round();
+    logging.end_capture();
+    capture_log(captured);
+
+    // Wait until the next task is due (or it's time to reconnect), or for work to be posted:
+    long lngwake_ms = m_db.isopen() ? m_scheduler.next_due_ms() : lngnext_connect_ms;
+    long lngnow_ms = monotonic_ms();
+    long lngwait_ms = lngwake_ms > lngnow_ms ? min(lngwake_ms - lngnow_ms, (long)intmax_idle_ms) : 0;
+    lock.lock();
+    m_cv.wait_for(lock, chrono::milliseconds(lngwait_ms), [this] { return m_blnstop || !m_jobs.empty(); });
+  }
+}
+
+void maintenance_worker::round() {
+  // Use the latest config:
+  {
+    lock_guard<mutex> lock(m_mutex);
+    if (m_blnconfig_changed) {
+      m_thread_config = m_config;
+      m_blnconfig_changed = false;
+    }
+  }
+
+  // Jobs from the player thread first, in the order they were posted:
+  deque<job_func> jobs;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    jobs.swap(m_jobs);
+  }
+  for (deque<job_func>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+    try {
+      (*it)(m_db);
+    } catch_exceptions;
+  }
+
+  // Then the due tasks:
+  m_scheduler.run(intbudget_ms);
+}
+
+void maintenance_worker::capture_log(vector<log_info> & captured) {
+  if (captured.empty()) return;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_log.insert(m_log.end(), captured.begin(), captured.end());
+    ++m_lngplayer_posts;
+  }
+  m_player_cv.notify_all();
+}
@@ -0,0 +1,90 @@
+
+#ifndef MAINTENANCE_WORKER_H
+#define MAINTENANCE_WORKER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "maintenance_scheduler.h"
+#include "player_config.h"
+#include "common/logging.h"
+#include "common/psql.h"
+
+/// Runs database & disk housekeeping on a background thread, so that it never has to wait for
+/// (or be skipped because of) playback transitions.
+///
+/// - The thread uses its own database connection, and a copy of the config (see set_config()).
+/// - Its tasks are timed by a maintenance_scheduler, like the player's own maintenance.
+/// - The player thread sends it work through post(). The work must only use its arguments and
+///   data that belongs to the worker, never the player's playback state.
+/// - Work that needs to change playback state goes the other way: worker tasks queue it with
+///   post_to_player(), and the player thread runs it in run_player_actions().
+/// - Messages logged on the thread are captured, and passed to the loggers by run_player_actions().
+/// - Neither thread polls: the worker sleeps until its next task is due (or work is posted), and
+///   the player thread can sleep in wait_for_player_actions(), which returns early when the worker
+///   queues actions or messages for it.
+class maintenance_worker {
+public:
+  /// A worker task. See maintenance_scheduler::task_func
+  typedef std::function<bool (pg_connection & db, const player_config & config, const long lngcutoff_ms)> task_func;
+  typedef std::function<void (pg_connection & db)> job_func; ///< Work sent to the worker thread
+  typedef std::function<void ()> action_func;               ///< Work sent to the player thread
+
+  maintenance_worker(); ///< Constructor
+  ~maintenance_worker(); ///< Stops the thread
+
+  /// Add a task, see maintenance_scheduler::add(). Tasks must be added before start().
+  void add(const std::string & strname, const int intpriority, const long lngfreq_ms, const long lngestimate_ms, task_func func);
+
+  void start(const std::string & strdb_conn); ///< Start the thread
+  void stop(); ///< Finish the current task, and stop the thread. Work still waiting to run is dropped.
+
+  void set_config(const player_config & config); ///< Update the worker's copy of the config
+  void post(const job_func & job); ///< Run job on the worker thread, before its next task
+
+  /// Called on the worker thread: run action on the player thread
+  void post_to_player(const action_func & action);
+
+  /// Called by the player thread: run the actions queued by the worker, and log its messages
+  void run_player_actions();
+
+  /// Called by the player thread: sleep until lngdeadline_ms (a monotonic clock time), or until the
+  /// worker queues actions or messages. Returns true if it queued any since the last call.
+  bool wait_for_player_actions(const long lngdeadline_ms);
+
+private:
+  static const int intbudget_ms = 60*1000;           ///< Time the scheduler is given each round
+  static const int intmax_idle_ms = 60*1000;         ///< Longest time between rounds, when no task is due and no work is posted
+  static const int intreconnect_ms = 30*1000;        ///< Time between attempts to connect to the database
+
+  std::thread m_thread;
+  std::mutex m_mutex; ///< Protects the members below
+  std::condition_variable m_cv;        ///< Wakes the worker
+  std::condition_variable m_player_cv; ///< Wakes the player thread
+  bool m_blnstop;
+  bool m_blnconfig_changed;
+  player_config m_config;
+  std::deque<job_func> m_jobs;
+  std::deque<action_func> m_actions;
+  std::vector<log_info> m_log;
+  unsigned long m_lngplayer_posts;      ///< Counts the times actions or messages were queued for the player thread
+  unsigned long m_lngplayer_posts_seen; ///< m_lngplayer_posts when wait_for_player_actions() last returned
+
+  // Used by the thread only:
+  maintenance_scheduler m_scheduler;
+  pg_connection m_db;
+  player_config m_thread_config;
+
+  void run(const std::string strdb_conn); ///< Main function of m_thread
+  void round(); ///< Run the waiting jobs, and then the due tasks
+  void capture_log(std::vector<log_info> & captured); ///< Hand captured messages to the player thread
+
+  // Not copyable (owns a thread):
+  maintenance_worker(const maintenance_worker &);
+  maintenance_worker & operator=(const maintenance_worker &);
+};
+
+#endif
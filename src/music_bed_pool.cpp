@@ -0,0 +1,214 @@
+
+#include "music_bed_pool.h"
+#include "common/binary_file.h"
+#include "common/exception.h"
+#include "common/file.h"
+#include "common/logging.h"
+#include "common/my_string.h"
+#include "common/psql.h"
+#include "common/shuffle.h"
+
+using namespace std;
+
+music_bed_pool::music_bed_pool(const int intmax_age) : m_intmax_age(intmax_age) {
+}
+
+void music_bed_pool::load(pg_conn_exec & db, const string & strsub_cat) {
+  if (!needs_listing(strsub_cat)) return;
+  vector<string> media;
+  set<string> dirs;
+  list_media(db, strsub_cat, media, dirs);
+  update(strsub_cat, media, dirs);
+}
+
+string music_bed_pool::next(pg_conn_exec & db, const string & strsub_cat) {
+  if (needs_listing(strsub_cat)) {
+    try {
+      load(db, strsub_cat);
+    }
+    catch(const my_exception & e) {
+      // Carry on with the old list (if there is one), and try again later:
+      lock_guard<mutex> lock(m_mutex);
+      map<string, pool>::iterator it = m_pools.find(strsub_cat);
+      if (it == m_pools.end() || it->second.media.empty()) throw;
+      log_warning("Could not list music bed media again, using the old list: " + e.get_error());
+      it->second.dtmlisted = now();
+      it->second.blnstale = false;
+    }
+  }
+
+  // Fetch the next item, and move the rotation along:
+  lock_guard<mutex> lock(m_mutex);
+  map<string, pool>::iterator it = m_pools.find(strsub_cat);
+  if (it == m_pools.end() || it->second.media.empty()) LOGIC_ERROR;
+  pool & bed = it->second;
+  string strret = bed.media[bed.intnext];
+  if (++bed.intnext >= bed.media.size()) bed.intnext = 0;
+  return strret;
+}
+
+void music_bed_pool::check_source_changed(const string & strpath) {
+  // Media directories are affected by changes to the files directly inside them, and by
+  // changes to the directories themselves:
+  string strdir = ensure_last_char(strpath, '/');
+  string strparent = strpath;
+  if (strparent != "" && strparent[strparent.length() - 1] == '/') strparent.erase(strparent.length() - 1);
+  string::size_type pos = strparent.rfind('/');
+  strparent = pos == string::npos ? "" : strparent.substr(0, pos + 1);
+
+  lock_guard<mutex> lock(m_mutex);
+  for (map<string, pool>::iterator it = m_pools.begin(); it != m_pools.end(); ++it) {
+    if (it->second.dirs.count(strdir) != 0 || it->second.dirs.count(strparent) != 0) {
+      it->second.blnstale = true;
+    }
+  }
+}
+
+void music_bed_pool::mark_stale() {
+  lock_guard<mutex> lock(m_mutex);
+  for (map<string, pool>::iterator it = m_pools.begin(); it != m_pools.end(); ++it) {
+    it->second.blnstale = true;
+  }
+}
+
+bool music_bed_pool::needs_listing(const string & strsub_cat) {
+  lock_guard<mutex> lock(m_mutex);
+  map<string, pool>::const_iterator it = m_pools.find(strsub_cat);
+  return it == m_pools.end() || it->second.blnstale || now() - it->second.dtmlisted > m_intmax_age;
+}
+
+void music_bed_pool::list_media(pg_conn_exec & db, const string & strsub_cat, vector<string> & media, set<string> & dirs) {
+  // List the music bed media for a sub-category (unshuffled):
+  media.clear();
+  dirs.clear();
+  string strsql = "SELECT strfile, strdir FROM tblfc_media INNER JOIN tlkfc_sub_cat ON tblfc_media.lngsub_cat = tlkfc_sub_cat.lngfc_sub_cat WHERE lngsub_cat = " + strsub_cat;
+  ap_pg_result rs = db.exec(strsql);
+  if (rs->size() == 0) my_throw("Could not find music bed media in the database (lngsub_cat=" + strsub_cat + ")!");
+
+  while(*rs) {
+    string strdir = ensure_last_char(rs->field("strdir"), '/');
+    string strfile = strdir + rs->field("strfile");
+    dirs.insert(strdir);
+    if (!file_exists(strfile)) {
+      log_warning("Music bed media listed in database but not found on disk: " + strfile);
+    }
+    else {
+      media.push_back(strfile);
+    }
+    (*rs)++;
+  }
+
+  // Check if we have any music bed files:
+  if (media.size() == 0) my_throw("Could not find any Music Bed media!");
+}
+
+void music_bed_pool::update(const string & strsub_cat, const vector<string> & media, const set<string> & dirs) {
+  lock_guard<mutex> lock(m_mutex);
+  map<string, pool>::iterator it = m_pools.find(strsub_cat);
+  if (it == m_pools.end()) {
+    // First time this music bed is used. Shuffle the list:
+    pool & bed = m_pools[strsub_cat];
+    bed.media = media;
+    uint64_t seed = shuffle_seed("music bed|" + strsub_cat);
+    log_message("Shuffling " + itostr(bed.media.size()) + " music bed items (seed " + ulltostr(seed) + ")");
+    seeded_shuffle(bed.media.begin(), bed.media.end(), seed);
+    bed.intnext = 0;
+    bed.dirs = dirs;
+    bed.dtmlisted = now();
+    bed.blnstale = false;
+    return;
+  }
+
+  // Keep the order of media which are still listed, and where the rotation is up to:
+  pool & bed = it->second;
+  set<string> listed(media.begin(), media.end());
+  set<string> existing(bed.media.begin(), bed.media.end());
+  vector<string> kept;
+  vector<string>::size_type intnext = 0;
+  for (vector<string>::size_type i = 0; i < bed.media.size(); ++i) {
+    if (listed.count(bed.media[i]) == 0) continue;
+    kept.push_back(bed.media[i]);
+    if (i < bed.intnext) ++intnext;
+  }
+  vector<string>::size_type intremoved = bed.media.size() - kept.size();
+
+  // Shuffle new media into the rest of the rotation:
+  vector<string>::size_type intadded = 0;
+  for (vector<string>::const_iterator item = media.begin(); item != media.end(); ++item) {
+    if (existing.count(*item) == 0) {
+      kept.push_back(*item);
+      ++intadded;
+    }
+  }
+  if (intnext >= kept.size()) intnext = 0;
+  if (intadded != 0) {
+    uint64_t seed = shuffle_seed("music bed|" + strsub_cat + "|" + itostr(kept.size()) + "|" + itostr(intnext));
+    log_message("Shuffling " + itostr(intadded) + " new music bed items into the rotation (seed " + ulltostr(seed) + ")");
+    seeded_shuffle(kept.begin() + intnext, kept.end(), seed);
+  }
+  if (intadded != 0 || intremoved != 0) {
+    log_message("Music bed media changed: " + itostr(intadded) + " added, " + itostr(intremoved) + " removed");
+  }
+
+  bed.media.swap(kept);
+  bed.intnext = intnext;
+  bed.dirs = dirs;
+  bed.dtmlisted = now();
+  bed.blnstale = false;
+}
+
+void music_bed_pool::save_snapshot(ostream & out) {
+  lock_guard<mutex> lock(m_mutex);
+  write_bin_long(out, m_pools.size());
+  for (map<string, pool>::const_iterator it = m_pools.begin(); it != m_pools.end(); ++it) {
+    write_bin_string(out, it->first);
+    write_bin_long(out, it->second.media.size());
+    for (vector<string>::const_iterator item = it->second.media.begin(); item != it->second.media.end(); ++item) {
+      write_bin_string(out, *item);
+    }
+    write_bin_long(out, it->second.intnext);
+    write_bin_long(out, it->second.dirs.size());
+    for (set<string>::const_iterator dir = it->second.dirs.begin(); dir != it->second.dirs.end(); ++dir) {
+      write_bin_string(out, *dir);
+    }
+  }
+}
+
+void music_bed_pool::load_snapshot(istream & in) {
+  // Read everything before replacing the current lists, so a corrupt snapshot doesn't leave
+  // them half-loaded:
+  map<string, pool> pools;
+  long lngpools = read_bin_long(in);
+  if (lngpools < 0) my_throw("Invalid music bed count in snapshot: " + ltostr(lngpools));
+  for (long i = 0; i < lngpools; ++i) {
+    string strsub_cat = read_bin_string(in);
+    pool & bed = pools[strsub_cat];
+    long lngcount = read_bin_long(in);
+    if (lngcount < 0) my_throw("Invalid music bed list length in snapshot: " + ltostr(lngcount));
+    for (long j = 0; j < lngcount; ++j) {
+      bed.media.push_back(read_bin_string(in));
+    }
+    long lngnext = read_bin_long(in);
+    if (lngnext < 0 || (lngcount > 0 && lngnext >= lngcount)) my_throw("Invalid music bed position in snapshot: " + ltostr(lngnext));
+    bed.intnext = lngnext;
+    lngcount = read_bin_long(in);
+    if (lngcount < 0) my_throw("Invalid music bed directory count in snapshot: " + ltostr(lngcount));
+    for (long j = 0; j < lngcount; ++j) {
+      bed.dirs.insert(read_bin_string(in));
+    }
+    // Files may have changed since the snapshot was written:
+    bed.dtmlisted = 0;
+    bed.blnstale = true;
+  }
+
+  lock_guard<mutex> lock(m_mutex);
+  m_pools.swap(pools);
+}
+
+void music_bed_pool::swap(music_bed_pool & other) {
+  if (&other == this) return;
+  lock(m_mutex, other.m_mutex);
+  lock_guard<mutex> lock1(m_mutex, adopt_lock);
+  lock_guard<mutex> lock2(other.m_mutex, adopt_lock);
+  m_pools.swap(other.m_pools);
+}
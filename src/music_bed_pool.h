@@ -0,0 +1,64 @@
+
+#ifndef MUSIC_BED_POOL_H
+#define MUSIC_BED_POOL_H
+
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "common/my_time.h"
+
+class pg_conn_exec;
+
+/// Shuffled lists of music bed media, one per music bed sub-category, shared by all segments.
+///
+/// Each list remembers where its rotation is up to, so segments which use the same music bed
+/// (including reloads of the same segment) carry on from where the last one left off instead of
+/// starting again from a freshly shuffled list.
+///
+/// Lists are only fetched again (from the database and disk) when they were marked stale: when
+/// a file in a media directory changes (check_source_changed()), when the database may have
+/// changed (mark_stale(), eg: after an RPLS), or after intmax_age seconds. Re-listing keeps the
+/// order of media which are still there, and shuffles new media into the rest of the rotation.
+///
+/// The pool is thread-safe.
+class music_bed_pool {
+public:
+  music_bed_pool(const int intmax_age = 30*60); ///< Constructor
+
+  /// Make sure the media for a sub-category are listed and current. Throws if there are none.
+  void load(pg_conn_exec & db, const std::string & strsub_cat);
+
+  /// The next media to play for a sub-category. Re-lists the media first if they are stale, but
+  /// keeps using the old list if that fails.
+  std::string next(pg_conn_exec & db, const std::string & strsub_cat);
+
+  void check_source_changed(const std::string & strpath); ///< A file or directory changed on disk
+  void mark_stale(); ///< List all media again when they are next used (eg: the database changed)
+
+  void save_snapshot(std::ostream & out); ///< Write the lists & rotation positions to a binary player snapshot
+  void load_snapshot(std::istream & in);  ///< Read lists written by save_snapshot(). They are re-listed before use.
+  void swap(music_bed_pool & other); ///< Exchange lists with another pool
+
+private:
+  struct pool {
+    std::vector<std::string> media; ///< Shuffled
+    std::vector<std::string>::size_type intnext; ///< Position in media of the next item to play
+    std::set<std::string> dirs; ///< Directories (with trailing slashes) the media are in
+    datetime dtmlisted; ///< When media were last listed
+    bool blnstale; ///< Set when media need to be listed again
+  };
+
+  std::mutex m_mutex;
+  std::map<std::string, pool> m_pools; ///< By sub-category
+  int m_intmax_age;
+
+  bool needs_listing(const std::string & strsub_cat); ///< Does a sub-category need to be (re-)listed?
+  /// Fetch a sub-category's media (and their directories) from the database and disk. Called without m_mutex locked.
+  static void list_media(pg_conn_exec & db, const std::string & strsub_cat, std::vector<std::string> & media, std::set<std::string> & dirs);
+  void update(const std::string & strsub_cat, const std::vector<std::string> & media, const std::set<std::string> & dirs); ///< Merge a new listing into a pool
+};
+
+#endif
@@ -1,97 +1,233 @@
 
 #include "music_history.h"
+#include "common/binary_file.h"
+#include "common/file.h"
 #include "common/psql.h"
 #include "common/my_string.h"
 
-void music_history::load(pg_connection & db)
+music_history::music_history() : m_seq(0), m_lnglast_db_id(-1) {
+}
+
+void music_history::load(pg_connection & db, mp3_tags & mp3tags)
 {
   // Load the most recent music history entries from the schedule database:
-  ap_pg_result rs = db.exec("SELECT strfile FROM tblmusichistory WHERE strfile IS NOT NULL ORDER BY lngplayedmp3 DESC LIMIT " + itostr(max_history_length));
+  load_newest(db, "strfile IS NOT NULL", mp3tags);
+}
+
+void music_history::load_played_since(pg_connection & db, const datetime dtmsaved, mp3_tags & mp3tags)
+{
+  // Add songs which were played after the snapshot was saved. The snapshot already has the
+  // songs up to its last database row, so adding them again would count them twice:
+  string strafter = m_lnglast_db_id != -1 ? "lngplayedmp3 > " + ltostr(m_lnglast_db_id) : "dtmtime > " + datetime_to_psql(dtmsaved);
+  load_newest(db, "strfile IS NOT NULL AND " + strafter, mp3tags);
+}
 
+void music_history::load_newest(pg_connection & db, const string & strwhere, mp3_tags & mp3tags)
+{
+  ap_pg_result rs = db.exec("SELECT lngplayedmp3, strfile FROM tblmusichistory WHERE " + strwhere + " ORDER BY lngplayedmp3 DESC LIMIT " + itostr(max_history_length));
+
+  // The query returns the newest entries first, but the ring buffer needs to
+  // be filled starting from the oldest entry:
+  vector<string> files;
   while (*rs) {
-    m_history.push_back(rs->field("strfile"));
+    if (files.empty()) m_lnglast_db_id = strtol(rs->field("lngplayedmp3"));
+    files.push_back(rs->field("strfile"));
     (*rs)++;
   }
 
-  tidy(); // Clear out old history entries.
+  for (vector<string>::reverse_iterator it = files.rbegin(); it != files.rend(); ++it) {
+    song_played_no_db(*it, "", mp3tags);
+  }
+}
+
+void music_history::save_snapshot(ostream & out) const
+{
+  // Write the history entries, oldest first. Artists are written by name
+  // so that loading the snapshot doesn't need to read any tags.
+  unsigned long lngcount = m_seq < m_ring.size() ? m_seq : m_ring.size();
+  write_bin_long(out, lngcount);
+  for (unsigned long seq = m_seq - lngcount + 1; seq <= m_seq; ++seq) {
+    const history_entry & entry = m_ring[(seq - 1) % max_history_length];
+    write_bin_string(out, m_track_paths[entry.track]);
+    write_bin_bool(out, entry.artist != unknown_artist);
+    write_bin_string(out, entry.artist == unknown_artist ? "" : m_artist_names[entry.artist]);
+  }
+  write_bin_long(out, m_lnglast_db_id);
+}
+
+void music_history::load_snapshot(istream & in)
+{
+  // Replace the in-memory history with the entries in the snapshot
+  clear();
+  long lngcount = read_bin_long(in);
+  if (lngcount < 0 || lngcount > (long)max_history_length) my_throw("Invalid music history length in snapshot: " + ltostr(lngcount));
+  for (long i = 0; i < lngcount; ++i) {
+    history_entry entry;
+    entry.track = intern_track(read_bin_string(in));
+    bool blnartist_known = read_bin_bool(in);
+    string strartist = read_bin_string(in);
+    entry.artist = blnartist_known ? intern_artist_name(strartist) : unknown_artist;
+    add_entry(entry);
+  }
+  m_lnglast_db_id = read_bin_long(in);
 }
 
-void music_history::song_played(pg_connection & db, const string & strfile, const string & strdescr)
+void music_history::song_played(pg_connection & db, const string & strfile, const string & strdescr, mp3_tags & mp3tags)
 {
   // Called when a song has started playing. Updates the music history.
   // Does not delete old music history entries. The database maintenance
   // script now does that.
-  song_played_no_db(strfile, strdescr);
+  song_played_no_db(strfile, strdescr, mp3tags);
 
-  // Store the song in tblmusichistory:
-  db.exec("INSERT INTO tblmusichistory (dtmtime, strdescription, strfile) VALUES ("
-          + psql_now + ", " + psql_str(strdescr) + ", " + psql_str(strfile) + ")");
+  // Store the song in tblmusichistory, and remember its row for the next snapshot:
+  ap_pg_result rs = db.exec("INSERT INTO tblmusichistory (dtmtime, strdescription, strfile) VALUES ("
+          + psql_now + ", " + psql_str(strdescr) + ", " + psql_str(strfile) + ") RETURNING lngplayedmp3");
+  m_lnglast_db_id = strtol(rs->field("lngplayedmp3"));
 }
 
-void music_history::song_played_no_db(const string & strfile, [[maybe_unused]] const string & strdescr)
+void music_history::song_played_no_db(const string & strfile, [[maybe_unused]] const string & strdescr, mp3_tags & mp3tags)
 {
   // This function is used when building a playlist, to "simulate" the "don't repeat recent
   // music" effect
-  m_history.push_front(strfile);
-  tidy(); // Delete old entries
+  history_entry entry;
+  entry.track  = intern_track(strfile);
+  entry.artist = intern_artist(strfile, mp3tags);
+  add_entry(entry);
+}
+
+void music_history::add_entry(const history_entry & entry) {
+  // Record the play in the ring buffer. Once the buffer is full, the oldest
+  // entry gets overwritten:
+  ++m_seq;
+  unsigned int intslot = (m_seq - 1) % max_history_length;
+  if (m_ring.size() < max_history_length) {
+    m_ring.push_back(entry);
+  }
+  else {
+    m_ring[intslot] = entry;
+  }
+
+  m_track_last_played[entry.track] = m_seq;
+  if (entry.artist != unknown_artist) {
+    m_artist_last_played[entry.artist] = m_seq;
+  }
 }
 
 bool music_history::song_played_recently(const string & strfile, const int count)
 {
-  auto i = m_history.begin();
-  int c = 0; // How many items we have iterated over;
-  bool found = false; // Set to true if we find the song
-  while (i != m_history.end() && c < count) {
-    if (*i == strfile) {
-      found = true;
-      break;
-    }
-    i++; c++;
-  }
-  return found;
+  long lngage = track_age(strfile);
+  return lngage != -1 && lngage < count;
 }
 
 /// Did a song by the specified artist play within the most recent X songs?
 bool music_history::artist_song_played_recently(const std::string & strartist,
-                                                const int count,
-                                                mp3_tags & mp3tags) {
-  auto i = m_history.begin();
-  int c = 0; // How many items we have iterated over;
-  bool found = false; // Set to true if we find the song
-  while (i != m_history.end() && c < count) {
-    // Skip checking the file if it doesn't exist on the harddrive. This can
-    // happen when files have been stored in the music history, but which
-    // have since been moved around by some external process.
-    if (!file_exists(*i)) {
-      log_warning("File " + *i + " exists in music history, but not on harddrive. Have the files been moved around recently?");
-    }
-    else {
-      string item_artist = mp3tags.get_mp3_artist(*i);
-      if (item_artist == strartist) {
-        found = true;
-        break;
-      }
-    }
-    i++; c++;
-  }
-  return found;
+                                                const int count) {
+  tr1::unordered_map<string, artist_id>::const_iterator it = m_artist_ids.find(strartist);
+  if (it == m_artist_ids.end()) return false;
+
+  unsigned long seq = m_artist_last_played[it->second];
+  if (seq == 0) return false;
+
+  // Plays older than the ring buffer size have been forgotten:
+  unsigned long age = m_seq - seq;
+  return age < m_ring.size() && (long)age < count;
 }
 
 
 void music_history::clear() {
   // Clear the in-memory history (not the database table)
-  m_history.clear();
+  m_ring.clear();
+  m_seq = 0;
+  m_lnglast_db_id = -1;
+  m_track_paths.clear();
+  m_track_ids.clear();
+  m_track_last_played.clear();
+  m_artist_names.clear();
+  m_artist_ids.clear();
+  m_artist_last_played.clear();
 }
 
 const std::list<std::string> music_history::get_history() const {
   // Fetch a read-only copy of the music history list
   // (newer entries are at the front of the queue)
-  return m_history;
+  list<string> history;
+  for (unsigned long seq = m_seq; seq > 0 && m_seq - seq < m_ring.size(); --seq) {
+    history.push_back(m_track_paths[m_ring[(seq - 1) % max_history_length].track]);
+  }
+  return history;
 }
 
-void music_history::tidy()
-{
-  // Clear out the oldest history entries:
-  while (m_history.size() > max_history_length)
-    m_history.pop_back();
+std::vector<music_history::history_item> music_history::get_history_items() const {
+  // Fetch the music history entries, including artists (newer entries first)
+  vector<history_item> items;
+  for (unsigned long seq = m_seq; seq > 0 && m_seq - seq < m_ring.size(); --seq) {
+    const history_entry & entry = m_ring[(seq - 1) % max_history_length];
+    history_item item;
+    item.strfile = m_track_paths[entry.track];
+    item.blnartist_known = entry.artist != unknown_artist;
+    item.strartist = item.blnartist_known ? m_artist_names[entry.artist] : "";
+    items.push_back(item);
+  }
+  return items;
+}
+
+music_history::track_id music_history::intern_track(const string & strfile) {
+  // Fetch the id for a music file, interning it if it hasn't been seen before
+  tr1::unordered_map<string, track_id>::const_iterator it = m_track_ids.find(strfile);
+  if (it != m_track_ids.end()) return it->second;
+
+  track_id id = m_track_paths.size();
+  m_track_paths.push_back(strfile);
+  m_track_last_played.push_back(0);
+  m_track_ids[strfile] = id;
+  return id;
+}
+
+music_history::artist_id music_history::intern_artist(const string & strfile, mp3_tags & mp3tags) {
+  // Fetch the id for a file's artist, interning it if it hasn't been seen before.
+
+  // Files that have been moved around by some external process, or that aren't
+  // mp3s, don't have a known artist. Files the tag cache knows are unchanged don't need a stat:
+  if (!mp3tags.is_unchanged(strfile) && !file_exists(strfile)) {
+    log_warning("File " + strfile + " was added to the music history, but is not on the harddrive. Have the files been moved around recently?");
+    return unknown_artist;
+  }
+  if (lcase(get_file_ext(strfile)) != "mp3") return unknown_artist;
+
+  string strartist = "";
+  try {
+    strartist = mp3tags.get_mp3_artist(strfile);
+  } catch(...) {
+    log_warning("Could not fetch the artist for music history entry " + strfile);
+    return unknown_artist;
+  }
+
+  return intern_artist_name(strartist);
+}
+
+music_history::artist_id music_history::intern_artist_name(const string & strartist) {
+  // Fetch the id for an artist name, interning it if it hasn't been seen before
+  tr1::unordered_map<string, artist_id>::const_iterator it = m_artist_ids.find(strartist);
+  if (it != m_artist_ids.end()) return it->second;
+
+  artist_id id = m_artist_names.size();
+  m_artist_names.push_back(strartist);
+  m_artist_last_played.push_back(0);
+  m_artist_ids[strartist] = id;
+  return id;
+}
+
+long music_history::track_age(const string & strfile) const {
+  // How many songs ago the track played (0 = most recent), or -1 if it
+  // is not in the in-memory history
+  tr1::unordered_map<string, track_id>::const_iterator it = m_track_ids.find(strfile);
+  if (it == m_track_ids.end()) return -1;
+
+  unsigned long seq = m_track_last_played[it->second];
+  if (seq == 0) return -1;
+
+  // Plays older than the ring buffer size have been forgotten:
+  unsigned long age = m_seq - seq;
+  if (age >= m_ring.size()) return -1;
+  return age;
 }
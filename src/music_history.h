@@ -3,9 +3,13 @@
 #define MUSIC_HISTORY_DP20060525_H
 
 #include "common/mp3_tags.h"
+#include "common/my_time.h"
 
+#include <iostream>
 #include <list>
 #include <string>
+#include <vector>
+#include <tr1/unordered_map>
 
 // Forward declarations:
 class pg_connection;
@@ -16,21 +20,34 @@ class pg_connection;
 class music_history
 {
  public:
+   music_history(); ///< Constructor
    virtual ~music_history() {};
    /// Load music history from the schedule database
-   void load(pg_connection & db);
+   void load(pg_connection & db, mp3_tags & mp3tags);
+
+   /// Add songs from the schedule database which were played after the history was saved by
+   /// save_snapshot() (used to catch up after loading a snapshot). Songs after the last
+   /// tblmusichistory row in the snapshot are added. dtmsaved (when the snapshot was written) is
+   /// only used if the snapshot doesn't know its last row.
+   void load_played_since(pg_connection & db, const datetime dtmsaved, mp3_tags & mp3tags);
+
+   /// Write the in-memory history to, or read it from, a binary player snapshot
+   void save_snapshot(ostream & out) const;
+   void load_snapshot(istream & in);
 
    /// Called when a song has started playing. Updates the music history.
-   void song_played(pg_connection & db, const std::string & strfile, const std::string & strdescr);
+   /// The song's artist is looked up now and remembered with the history entry.
+   void song_played(pg_connection & db, const std::string & strfile, const std::string & strdescr, mp3_tags & mp3tags);
 
    /// Same as song_played(), but does not update the database
-   void song_played_no_db(const std::string & strfile, const std::string & strdescr);
+   void song_played_no_db(const std::string & strfile, const std::string & strdescr, mp3_tags & mp3tags);
 
    /// Did this song play within the most recent X songs?
    virtual bool song_played_recently(const std::string & strfile, const int count);
 
    /// Did a song by the specified artist play within the most recent X songs?
-   virtual bool artist_song_played_recently(const std::string & strartist, const int count, mp3_tags & mp3tags);
+   /// Uses the artists recorded when the songs played, so no tags or files are checked here.
+   virtual bool artist_song_played_recently(const std::string & strartist, const int count);
 
    /// Clear the in-memory music history (not the database table)
    virtual void clear();
@@ -39,15 +56,80 @@ class music_history
    /// (newer entries are at the front of the queue)
    const std::list<std::string> get_history() const;
 
- private:
+   /// A music history entry, as returned by get_history_items()
+   struct history_item {
+     std::string strfile;   ///< Music file that played
+     bool blnartist_known;  ///< Was the artist known when the song played?
+     std::string strartist; ///< Artist (as returned by mp3_tags::get_mp3_artist())
+   };
+
+   /// Fetch the music history entries, including artists (newer entries first)
+   std::vector<history_item> get_history_items() const;
+
    /// Maximum history entries to keep in memory
    static const unsigned int max_history_length = 1000;
 
-   /// A list of the most recent music files played
-   std::list<std::string> m_history;
+ private:
+
+   /// Music files and artists are interned, and the history refers to them by id
+   typedef unsigned int track_id;
+   typedef unsigned int artist_id;
+
+   /// Used for history entries where the artist could not be determined
+   static const artist_id unknown_artist = (artist_id)-1;
+
+   /// A single music history entry
+   struct history_entry {
+     track_id track;
+     artist_id artist;
+   };
+
+   /// Fetch the id for a music file, interning it if it hasn't been seen before
+   track_id intern_track(const std::string & strfile);
+
+   /// Fetch the id for a file's artist, interning it if it hasn't been seen
+   /// before. Returns unknown_artist if the artist can't be determined.
+   artist_id intern_artist(const std::string & strfile, mp3_tags & mp3tags);
+
+   /// Fetch the id for an artist name, interning it if it hasn't been seen before
+   artist_id intern_artist_name(const std::string & strartist);
+
+   /// Add an entry to the ring buffer
+   void add_entry(const history_entry & entry);
+
+   /// Add the newest (up to max_history_length) tblmusichistory rows matching strwhere, oldest first
+   void load_newest(pg_connection & db, const std::string & strwhere, mp3_tags & mp3tags);
+
+   /// How many songs ago the track played (0 = most recent), or -1 if it
+   /// is not in the in-memory history
+   long track_age(const std::string & strfile) const;
+
+   /// Ring buffer of the most recent history entries. The play with sequence
+   /// number N is stored at (N - 1) % max_history_length
+   std::vector<history_entry> m_ring;
+
+   /// Sequence number of the most recent play (0 if nothing has played)
+   unsigned long m_seq;
+
+   /// tblmusichistory.lngplayedmp3 of the newest play loaded from or written to the database
+   /// (-1 if not known)
+   long m_lnglast_db_id;
+
+   /// Interned music file paths, indexed by track id
+   std::vector<std::string> m_track_paths;
+   std::tr1::unordered_map<std::string, track_id> m_track_ids;
+
+   /// Sequence number of the most recent play of each track, indexed
+   /// by track id (0 if the track has not played)
+   std::vector<unsigned long> m_track_last_played;
+
+   /// Interned artists (as returned by mp3_tags::get_mp3_artist())
+   std::vector<std::string> m_artist_names;
+   std::tr1::unordered_map<std::string, artist_id> m_artist_ids;
 
-   /// Clear out the oldest history entries
-   void tidy();
+   /// Sequence number of the most recent play by each artist, indexed
+   /// by artist id
+   std::vector<unsigned long> m_artist_last_played;
 };
 
 #endif
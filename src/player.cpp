@@ -18,7 +18,9 @@
 #include "common/rr_misc.h"
 #include "common/rr_misc_db.h"
 #include "common/rr_security.h"
+#include "common/shuffle.h"
 #include "common/system.h"
+#include <map>
 #include <unistd.h>
 
 #include "common/testing.h"
@@ -27,6 +29,9 @@ namespace xmmsc = xmms_controller;
 
 player * pplayer = NULL; // A pointer to the player object, used by callback functions.
 
+// tbldefs setting holding the missed promo watermark (see write_errors_for_missed_promos())
+static const string strmissed_promos_watermark_setting = "dtmMissedAdsCheckedUntil";
+
 // Information about "events" that take place during playback of the current item.
 // (current item ends, music bed starts, music bed starts
 
@@ -46,13 +51,8 @@ void playback_events_info::reset() {
   inthour_change_interrupt_ms = INT_MAX;
 }
 
-// A function we use with the sort() algorithm:
-bool transition_event_less_than(const transition_event & e1, const transition_event & e2) {
-  return e1.intrun_ms < e2.intrun_ms;
-}
-
 // Constructor:
-player::player() {
+player::player() : m_mp3_tag_warmup(mp3tags) {
   // Throw an exception if there is already a player object instantiated:
   if (pplayer != NULL) my_throw("Only one player object is allowed!");
 
@@ -101,13 +101,27 @@ void player::run() {
   // Reset playback
   run_data.reset_playback();
 
+  // Resume the segment & waiting promos from the fast-start snapshot, if one was loaded:
+  try {
+    restore_snapshot_playback();
+  } catch_exceptions;
+
+  // The loop below sleeps until the next playback events come within the safety margin, the next
+  // maintenance task is due, promos can be queried for again, or the maintenance worker has
+  // something for this thread, whichever comes first. Wake-up times are on the monotonic clock,
+  // so they don't drift or jump when the system time is set.
+  long lngwake_ms = monotonic_ms();
   while (true) {
     bool blnsuccess = false; // Set to true at the end of each iteration where no exceptions are trapped
     try {
-      // Sleep until the next second arrives (ie, usually less than 1000ms)
-      timeval tvnow;
-      gettimeofday(&tvnow, NULL);
-      usleep(1000000 - tvnow.tv_usec);
+      // Sleep until something is due:
+      if (m_worker.wait_for_player_actions(lngwake_ms)) m_maintenance.set_due("worker_actions");
+      long lngnow_ms = monotonic_ms();
+      lngwake_ms = lngnow_ms + intmax_player_sleep_ms;
+
+      // Follow changes to the system time. This is the only place the wall clock mapping is updated,
+      // so everything below sees the same mapping:
+      wall_clock.check(); // Check the playback status now and then, even if nothing is due
 
       // Check playback status of XMMS, LineIn, etc. Throw errors here if there is something wrong.
       check_playback_status();
@@ -123,10 +137,22 @@ void player::run() {
         // If we have enough time left (> Safety margin, or unknown), then:
         // - Do background maintenance (separate function). Has built-in timing.
         player_maintenance(playback_events.intnext_ms - intnext_playback_safety_margin_ms);
+
+        // Wake up for the next maintenance task, or when the events come within the safety margin:
+        lngwake_ms = MIN(lngwake_ms, m_maintenance.next_due_ms());
+        if (playback_events.intnext_ms != INT_MAX) {
+          lngwake_ms = MIN(lngwake_ms, lngnow_ms + playback_events.intnext_ms - intnext_playback_safety_margin_ms);
+        }
+
+        // Music can be interrupted by promos, so also wake up when they can next be queried for:
+        if (m_lnglast_promo_query_ms != LONG_MIN && m_lnglast_promo_query_ms + intpromo_query_interval_ms > lngnow_ms) {
+          lngwake_ms = MIN(lngwake_ms, m_lnglast_promo_query_ms + intpromo_query_interval_ms);
+        }
       }
       else {
         // We're close to one or more a playback events. Handle them in an intensive timing section.
         playback_transition(playback_events);
+        lngwake_ms = monotonic_ms(); // Look for the next events straight away
       }
       blnsuccess=true; // No exception took place this iteration
     } catch_exceptions;
@@ -136,6 +162,7 @@ void player::run() {
       // Reset playback:
       log_error("Playback reset is now required.");
       run_data.reset_playback();
+      lngwake_ms = monotonic_ms() + intplayback_retry_ms; // Don't retry straight away
     }
   }
 }
@@ -157,6 +184,9 @@ void player::init() {
   // Log the today's RR date.
   log_line("Today's RR date: " + datetime_to_rrdate(date()));
 
+  // Log the shuffle seed, so that today's playlists can be reproduced (see "player help"):
+  log_line("Shuffle seed: " + ulltostr(get_shuffle_base_seed()));
+
   // Read database connection settings from the Players config file
   log_line("Reading config file");
 
@@ -167,7 +197,7 @@ void player::init() {
   log_line("Connecting to instore database (" + config.db.strdb + " on " + config.db.strserver + ")...");
 
   // Get schedule database connection string.
-  string strconn = pg_create_conn_str(
+  strdb_conn = pg_create_conn_str(
     config.db.strserver,
     config.db.strport,
     config.db.strdb,
@@ -178,7 +208,7 @@ void player::init() {
   db.call_on_connect_error(callback_check_db_error);
 
   // Now attempt to connect to the database, and retry until successful
-  db.open(strconn);
+  db.open(strdb_conn);
 
   // Reload all config settings from the database:
   load_db_config();
@@ -199,11 +229,11 @@ void player::init() {
 
   // Write LiveInfo data:
   log_message("Writing LiveInfo data...");
-  write_liveinfo();
+  write_liveinfo(db, config);
 
   // Check the received folder
   log_message("Checking the received folder...");
-  check_received();              // Check the received folder, scan for CMD files
+  check_received(db, config);    // Check the received folder, scan for CMD files
 
   // Added in version 6.06 - if the player is not busy playing ads, then check if there are
   // any ads that are marked as about to play. It can happen that ads are queued to play,
@@ -215,18 +245,32 @@ void player::init() {
 
   // Write errors for missed announcements...
   log_message("Checking for missed promos...");
-  write_errors_for_missed_promos();
+  write_errors_for_missed_promos(db, config);
 
-  // Load music history:
-  log_message("Loading music history...");
-  m_music_history.load(db);
+  // Init the mp3 tags (music history needs them to remember artists):
+  mp3tags.init(PLAYER_DIR + "mp3_tags.cache", PLAYER_DIR + "mp3_tags.txt");
 
-  // Also init the mp3 tags:
-  mp3tags.init(PLAYER_DIR + "mp3_tags.txt");
+  // Watch the media directories, so that files are only checked when they change:
+  start_dir_watches();
+
+  // Read tags for the rest of the music library in the background, so that playlist
+  // generation doesn't need to wait for them:
+  start_mp3_tag_warmup();
+
+  // Load music history (and playback state) from the fast-start snapshot if it
+  // is fresh, otherwise from the database:
+  log_message("Loading music history...");
+  if (!load_snapshot()) {
+    m_music_history.load(db, mp3tags);
+  }
 
   // Setup the XMMS module:
   xmmsc::set_num_xmms_sessions(intmax_xmms); // 2 XMMS sessions
 
+  // Setup the tasks run by player_maintenance() and the maintenance worker, and start the worker:
+  add_maintenance_tasks();
+  m_worker.start(strdb_conn);
+
   // Show that the init succeeded.
   log_message("Player startup complete.");
   log_message("Player main event loop starting...");
@@ -276,6 +320,16 @@ void player::reset() {
   store_status.volumes.intannounce = -1;
   store_status.volumes.intlinein   = -1;
   store_status.volumes.dblxmmseqpreamp = -1;
+
+  // No snapshot has been loaded yet:
+  snapshot.blnloaded = false;
+
+  // The missed promo watermark is loaded from the database by the first check:
+  dtmmissed_promos_checked_day   = datetime_error;
+  dtmmissed_promos_checked_until = datetime_error;
+
+  // Promos haven't been queried for yet:
+  m_lnglast_promo_query_ms = LONG_MIN;
 }
 
 void player::remove_waiting_mediaplayer_cmds() {
@@ -408,6 +462,9 @@ void player::load_db_config() {
     log_warning("Config setting for Crossfade length ( " + itostr(config.intcrossfade_length_ms) + "ms) is too long! (defaulting to 30,000ms)");
     config.intcrossfade_length_ms = 30000;
   }
+
+  // The maintenance worker uses its own copy of the settings:
+  m_worker.set_config(config);
 }
 
 void player::load_store_status(const bool blnverbose, const bool blnforceload) {
@@ -563,7 +620,7 @@ void player::update_output_volumes() {
   }
 }
 
-void player::write_liveinfo() {
+void player::write_liveinfo(pg_conn_exec & db, const player_config & config) {
   // Player version 6.15 - removing use of loaderinfo.tmp and liveinfo.chk.
   // liveinfo is a collection of information about the store computer's running software
 
@@ -637,9 +694,9 @@ void player::write_liveinfo() {
 */
 }
 
-void player::check_received() {
+void player::check_received(pg_conn_exec & db, const player_config & config) {
   // this procedure checks the apppaths.recieved directory for the following files to process
-  // .cmd
+  // .cmd. The commands are run soon after by the maintenance worker (see queue_waiting_cmds).
 
   // Go through all files in the received folder and where necessary reset their
   // Read-Only attribute
@@ -654,131 +711,153 @@ void player::check_received() {
     log_message("Processing CMD file: " + FileName);
     // Load the command file into the database
     try {
-      load_cmd_into_db(Full_Path);
-      process_waiting_cmds();
+      load_cmd_into_db(db, Full_Path);
     } catch_exceptions;
     rm(Full_Path);
   }
 }
 
-void player::load_cmd_into_db([[maybe_unused]] const string strfull_path) {
+void player::load_cmd_into_db([[maybe_unused]] pg_conn_exec & db, [[maybe_unused]] const string strfull_path) {
   undefined_throw;
 }
 
-void player::process_waiting_cmds() {
-  // Process CMD command files that are sent to the store and stored in the database
-  long lngWaitingCMD = -1; // Used for error logging
-  string strSQL;
-
-  try {
-    string chDay, chZone, chTime;
+vector<player::waiting_cmd> player::fetch_waiting_cmds(pg_conn_exec & db) {
+  // Fetch CMD command files that are sent to the store and stored in the database
+  vector<waiting_cmd> cmds;
+  string strSQL = "SELECT lngWaitingCMD, strCommand, strParams, dtmProcessed, bitComplete, bitError FROM tblwaitingcmd LEFT OUTER JOIN tblcmdtype USING (lngcmdtype) LEFT OUTER JOIN tblapp USING (lngapp) WHERE COALESCE(bitComplete, '0') = '0' AND lower(COALESCE(tblapp.strdescr, 'player')) = 'player'";
+  ap_pg_result rsCMD = db.exec(strSQL);
+  while(*rsCMD) {
+    waiting_cmd cmd;
+    cmd.lngwaiting_cmd = strtoi(rsCMD->field("lngWaitingCMD"));
+    cmd.strcommand     = ucase(rsCMD->field("strCommand", ""));
+    cmd.strparams      = rsCMD->field("strParams", "");
+    cmds.push_back(cmd);
+    (*rsCMD)++;
+  }
+  return cmds;
+}
 
-    string psql_Time;
-    string psql_Now;
+void player::queue_waiting_cmds(pg_connection & db) {
+  // Runs on the maintenance worker. Commands change the player's settings and playback state, so
+  // they are run on the player thread, which then hands them back to the worker to be marked as done.
+  vector<waiting_cmd> cmds = fetch_waiting_cmds(db);
+  for (vector<waiting_cmd>::const_iterator it = cmds.begin(); it != cmds.end(); ++it) {
+    if (m_queued_cmds.count(it->lngwaiting_cmd) > 0) continue; // Already on its way
+    m_queued_cmds.insert(it->lngwaiting_cmd);
+    waiting_cmd cmd = *it;
+    m_worker.post_to_player([this, cmd]() {
+      bool blnerror = !run_waiting_cmd(cmd);
+      m_worker.post([this, cmd, blnerror](pg_connection & db) {
+        m_queued_cmds.erase(cmd.lngwaiting_cmd);
+        mark_waiting_cmd_done(db, cmd.lngwaiting_cmd, blnerror);
+      });
+    });
+  }
+}
 
-    // Run through the waiting player commands
-    string strSQL = "SELECT lngWaitingCMD, strCommand, strParams, dtmProcessed, bitComplete, bitError FROM tblwaitingcmd LEFT OUTER JOIN tblcmdtype USING (lngcmdtype) LEFT OUTER JOIN tblapp USING (lngapp) WHERE COALESCE(bitComplete, '0') = '0' AND lower(COALESCE(tblapp.strdescr, 'player')) = 'player'";
-    ap_pg_result rsCMD = db.exec(strSQL);
+void player::mark_waiting_cmd_done(pg_conn_exec & db, const long lngwaiting_cmd, const bool blnerror) {
+  string strSQL = "UPDATE tblWaitingCMD SET bitComplete = '1', bitError = '" + (string)(blnerror ? "1" : "0") + "', dtmProcessed = " + psql_now + " WHERE lngWaitingCMD = " + ltostr(lngwaiting_cmd);
+  db.exec(strSQL);
+}
 
-    while(*rsCMD) {
-      string strCommand = ucase(rsCMD->field("strCommand", ""));
-      string strParams = rsCMD->field("strParams", "");
-      lngWaitingCMD = strtoi(rsCMD->field("lngWaitingCMD"));
+bool player::run_waiting_cmd(const waiting_cmd & cmd) {
+  // Run a command from tblwaitingcmd
+  const string & strCommand = cmd.strcommand;
+  const string & strParams = cmd.strparams;
 
-      log_message("Processing this command: \"" + strCommand + " " + strParams + "\"");
+  log_message("Processing this command: \"" + strCommand + " " + strParams + "\"");
 
-      try {
-        if (strCommand=="RPLS") {
-          // Added by David - 12 November 2002
-          // This is a new command in player version 6.02 when this command is found, the player will instantly stop
-          // playing, reload the strmp3 path (where music is expected to be found), check the current music profile,
-          // rebuild the playlist from scratch, and then resume playback. This command was added so that when the Wizard
-          // wants to change the current music selection, the player will instantly respond and start playing this music.
-          log_message("Processing RPLS (Reload Playlist) command...");
-
-          // Log a warning if there are args
-          if (strParams != "") log_warning("This command does not take arguments!");
-
-          // 1) Reload various database & store details from the database:
-          load_db_config();
-          load_store_status();
-
-          // 2) Tell the player to re-load the current segment
-          //    - This also reloads the current Music Profile (if music profiles are playing)
-          run_data.blnforce_segment_reload = true;
-        }
-        // Some commands added in version 6.11 - allow the user to pause, stop and resume the media playback.
-        //
-        else if (strCommand=="MPPA") {
-          undefined_throw;
-        /*
-          log_message("Processing MPPA (Media Player Pause) command...");
-          // Log a warning if there are args
-          if (strParams != "") log_warning("This command does not take arguments!");
-          Media_Pause();
+  try {
+    if (strCommand=="RPLS") {
+      // Added by David - 12 November 2002
+      // This is a new command in player version 6.02 when this command is found, the player will instantly stop
+      // playing, reload the strmp3 path (where music is expected to be found), check the current music profile,
+      // rebuild the playlist from scratch, and then resume playback. This command was added so that when the Wizard
+      // wants to change the current music selection, the player will instantly respond and start playing this music.
+      log_message("Processing RPLS (Reload Playlist) command...");
+
+      // Log a warning if there are args
+      if (strParams != "") log_warning("This command does not take arguments!");
+
+      // 1) Reload various database & store details from the database:
+      load_db_config();
+      load_store_status();
+
+      // 2) The music library (or the directories) may have changed, so refresh the tag cache
+      start_dir_watches();
+      start_mp3_tag_warmup();
+      segment::clear_source_cache();
+      segment::music_beds.mark_stale();
+      m_segment_preloader.discard();
+
+      // 3) Tell the player to re-load the current segment
+      //    - This also reloads the current Music Profile (if music profiles are playing)
+      run_data.blnforce_segment_reload = true;
+    }
+    // Some commands added in version 6.11 - allow the user to pause, stop and resume the media playback.
+    //
+    else if (strCommand=="MPPA") {
+      undefined_throw;
+    /*
+      log_message("Processing MPPA (Media Player Pause) command...");
+      // Log a warning if there are args
+      if (strParams != "") log_warning("This command does not take arguments!");
+      Media_Pause();
 */
-        }
-        else if (strCommand=="MPST") {
-          undefined_throw;
-          /*
-          log_message("Processing MPST (Media Player Stop) command...");
-          // Log a warning if there are args
-          if (strParams != "") log_warning("This command does not take arguments!");
-          Media_Stop();
-          */
-        }
-        else if (strCommand=="MPRE") {
-        undefined_throw;
-        /*
-          log_message("Processing MPRE (Media Player Resume) command...");
-          // Log a warning if there are args
-          if (strParams != "") log_warning("This command does not take arguments!");
-          Media_Resume();
-         */
-        }
-        else if (strCommand=="RCFG") {
-          // Added in version 6.14 on 05/08/2003 - the player now loads some of it's config options from the
-          // database at startup. When the player reads an "RCFG" command it will reload these settings
-          log_message("Processing RCFG (Reload Config) command...");
-          // Log a warning if there are args
-          if (strParams != "") log_warning("This command does not take arguments!");
-          load_db_config();
-        }
-        else if (strCommand=="RVOL") {
-          // Reload volumes
-          log_message("Processing RVOL (Reload Volumes) command...");
-
-          // Log a warning if there are args
-          if (strParams != "") log_warning("This command does not take arguments!");
+    }
+    else if (strCommand=="MPST") {
+      undefined_throw;
+      /*
+      log_message("Processing MPST (Media Player Stop) command...");
+      // Log a warning if there are args
+      if (strParams != "") log_warning("This command does not take arguments!");
+      Media_Stop();
+      */
+    }
+    else if (strCommand=="MPRE") {
+    undefined_throw;
+    /*
+      log_message("Processing MPRE (Media Player Resume) command...");
+      // Log a warning if there are args
+      if (strParams != "") log_warning("This command does not take arguments!");
+      Media_Resume();
+     */
+    }
+    else if (strCommand=="RCFG") {
+      // Added in version 6.14 on 05/08/2003 - the player now loads some of it's config options from the
+      // database at startup. When the player reads an "RCFG" command it will reload these settings
+      log_message("Processing RCFG (Reload Config) command...");
+      // Log a warning if there are args
+      if (strParams != "") log_warning("This command does not take arguments!");
+      load_db_config();
+    }
+    else if (strCommand=="RVOL") {
+      // Reload volumes
+      log_message("Processing RVOL (Reload Volumes) command...");
 
-          // Reload volumes from the database:
-          load_store_status(false, true); // Not verbose, force a load now (even if a load took place in the last 30 seconds).
+      // Log a warning if there are args
+      if (strParams != "") log_warning("This command does not take arguments!");
 
-          // Update volumes of linein & xmms sessions as appropriately:
-          update_output_volumes();
-        }
-        else {
-          // The command is unknown, report an error
-          my_throw("Unknown command " + strCommand);
-        }
+      // Reload volumes from the database:
+      load_store_status(false, true); // Not verbose, force a load now (even if a load took place in the last 30 seconds).
 
-        strSQL = "UPDATE tblWaitingCMD SET bitComplete = '1',bitError = '0',dtmProcessed = " +
-                 psql_now + " WHERE lngWaitingCMD = " + rsCMD->field("lngWaitingCMD", "-1");
-        db.exec(strSQL);
-      }
-      catch(const my_exception & E) {
-        log_error("Error with this command: " + strCommand + (strParams != "" ? (string(" ") + strParams + string(" ")) : "") + " - " + E.get_error());
-        strSQL = "UPDATE tblWaitingCMD SET bitComplete = '1', bitError = '1', dtmProcessed = " + psql_now + " WHERE lngWaitingCMD = " + rsCMD->field("lngWaitingCMD", "-1");
-        db.exec(strSQL);
-      }
-      (*rsCMD)++;
+      // Update volumes of linein & xmms sessions as appropriately:
+      update_output_volumes();
+    }
+    else {
+      // The command is unknown, report an error
+      my_throw("Unknown command " + strCommand);
     }
   }
+  catch(const my_exception & E) {
+    log_error("Error with this command: " + strCommand + (strParams != "" ? (string(" ") + strParams + string(" ")) : "") + " - " + E.get_error());
+    return false;
+  }
   catch(...) {
-    strSQL = "UPDATE tblWaitingCMD SET dtmProcessed=" + psql_now + ", bitComplete='1', bitError='1' WHERE lngWaitingCMD = " + ltostr(lngWaitingCMD);
-    db.exec(strSQL);
-    throw;
+    log_error("Error with this command: " + strCommand + (strParams != "" ? (string(" ") + strParams + string(" ")) : "") + " - Unknown exception");
+    return false;
   }
+  return true;
 }
 
 void player::correct_waiting_promos() {
@@ -799,35 +878,40 @@ void player::correct_waiting_promos() {
   }
 }
 
-void player::write_errors_for_missed_promos() {
+void player::write_errors_for_missed_promos(pg_connection & db, const player_config & config) {
   // Look for ads from today that are older than [Config.intMinsToMissAdsAfter] minutes
   // have not yet been played (or scheduled to play)
 
   // Work out the earliest time today (adverts older than this have been missed)
-  string psql_EarliestTime = "";
+  datetime dtmtoday = date();
+  datetime dtmearliest = datetime_error;
   {
     // Make sure that our earliest time does not wrap around to late in the evening!
     // - Not comparing datetime values in case after converting the earliest time to a
     // timetamp, it ends up as a later time of day anyway.
     datetime dtmnow = now();
-    datetime dtmearliest = get_miss_promos_before_time();
+    dtmearliest = get_miss_promos_before_time(config);
     string strnow      = format_datetime(dtmnow,      "%T");
     string strearliest = format_datetime(dtmearliest, "%T");
-    if (strearliest > strnow) dtmearliest = dtmnow;
-    psql_EarliestTime = time_to_psql(dtmearliest);
+    if (strearliest > strnow) dtmearliest = time();
   }
-
-  string strSQL = "SELECT tblSchedule_TZ_Slot.lngTZ_Slot, tblSched.strFilename, tblSched.strProductCat, "
-     "tblSchedule_TZ_Slot.dtmDay, tblSlot_Assign.dtmStart, tblSlot_Assign.dtmEnd, "
-     "tblSched.strPriorityOriginal, tblSched.strPriorityConverted, "
-     "tblSchedule_TZ_Slot.bitScheduled, tblSchedule_TZ_Slot.bitPlayed, tblSchedule_TZ_Slot.dtmForcePlayAt "
-     "FROM tblSchedule_TZ_Slot "
-     "INNER JOIN tblsched ON tblSchedule_TZ_Slot.lngsched=tblsched.lngschedule "
-     "INNER JOIN tblSlot_Assign USING (lngassign) "
-     "WHERE "
-
-     // Time is ok?
-     "("
+  string psql_EarliestTime = time_to_psql(dtmearliest);
+
+  // Use the watermark saved by the last check, even if that was by an earlier player process:
+  if (dtmmissed_promos_checked_day == datetime_error) load_missed_promos_watermark(db);
+
+  // Slots which closed before the watermark were already checked, so we only need to look at
+  // slots which closed since then. We also look back intmissed_promos_recheck_secs before the
+  // watermark, to pick up slots which were loaded (or reset to "SNS loaded") after their window had
+  // closed. Slots already reported are skipped by the bitMissErrorWritten check, so the recheck
+  // doesn't report anything twice.
+  string strtime_condition;
+  datetime dtmnew_day   = dtmtoday;
+  datetime dtmnew_until = dtmearliest;
+  if (dtmmissed_promos_checked_day == datetime_error) {
+    // No watermark was saved yet (first check on this database), so check everything once:
+    strtime_condition =
+      "("
          // Yesterday or earlier? If so then the ad is missed
          "(tblSchedule_TZ_Slot.dtmDay < " + psql_date + ") OR "
 
@@ -835,80 +919,122 @@ void player::write_errors_for_missed_promos() {
              "(tblSchedule_TZ_Slot.dtmDay = " + psql_date + ") AND "
              "(tblSlot_Assign.dtmStart < " + psql_EarliestTime + ")"
          ")"
-     ")"
+      ")";
+  }
+  else {
+    datetime dtmfrom_day  = dtmmissed_promos_checked_day;
+    datetime dtmfrom_time = clamp_time(dtmmissed_promos_checked_until - intmissed_promos_recheck_secs);
+    if (dtmfrom_day > dtmtoday) {
+      // The system clock moved back past the watermark. Only recheck today:
+      dtmfrom_day  = dtmtoday;
+      dtmfrom_time = clamp_time(make_time(0, 0, 0));
+    }
+    else if (dtmfrom_day == dtmtoday && dtmmissed_promos_checked_until > dtmearliest) {
+      // The cutoff moved backwards (clock or config change). Keep the watermark where it was:
+      dtmnew_until = dtmmissed_promos_checked_until;
+    }
+    if (dtmfrom_day == dtmtoday) {
+      if (dtmfrom_time >= dtmearliest) return; // Nothing closed in the range yet
+      strtime_condition =
+        "("
+           "(tblSchedule_TZ_Slot.dtmDay = " + psql_date + ") AND "
+           "(tblSlot_Assign.dtmStart >= " + time_to_psql(dtmfrom_time) + ") AND "
+           "(tblSlot_Assign.dtmStart < " + psql_EarliestTime + ")"
+        ")";
+    }
+    else {
+      // The day changed since the watermark. Finish off the watermark's day (and any days the
+      // player was not running), and then check today:
+      strtime_condition =
+        "("
+           "("
+               "(tblSchedule_TZ_Slot.dtmDay = " + date_to_psql(dtmfrom_day) + ") AND "
+               "(tblSlot_Assign.dtmStart >= " + time_to_psql(dtmfrom_time) + ")"
+           ") OR "
+           "("
+               "(tblSchedule_TZ_Slot.dtmDay > " + date_to_psql(dtmfrom_day) + ") AND "
+               "(tblSchedule_TZ_Slot.dtmDay < " + psql_date + ")"
+           ") OR "
+           "("
+               "(tblSchedule_TZ_Slot.dtmDay = " + psql_date + ") AND "
+               "(tblSlot_Assign.dtmStart < " + psql_EarliestTime + ")"
+           ")"
+        ")";
+    }
+  }
+
+  // Mark the missed slots and fetch their details in a single statement, instead of
+  // one UPDATE per missed slot:
+  string strSQL = "UPDATE tblSchedule_TZ_Slot SET bitMissErrorWritten = '1' "
+     "FROM tblsched, tblSlot_Assign "
+     "WHERE tblSchedule_TZ_Slot.lngsched = tblsched.lngschedule "
+     " AND tblSchedule_TZ_Slot.lngassign = tblSlot_Assign.lngassign "
+
+     // Time is ok?
+     " AND " + strtime_condition +
 
      // Check the various bits
      " AND (tblSchedule_TZ_Slot.bitScheduled = " + itostr(ADVERT_SNS_LOADED) + ") "
      " AND (COALESCE (tblschedule_tz_slot.bitMissErrorWritten, '0') = '0')"
 
-     // Ordering
-     " ORDER BY tblSched.strFileName, tblSchedule_TZ_Slot.lngTZ_Slot";
+     " RETURNING tblSchedule_TZ_Slot.lngTZ_Slot, tblSched.strFilename, "
+     "tblSchedule_TZ_Slot.dtmDay, tblSlot_Assign.dtmStart, tblSchedule_TZ_Slot.dtmForcePlayAt";
 
-  ap_pg_result RS = db.exec(strSQL);
+  // Save the new watermark along with the slots it covers, so that they can't get out of step:
+  ap_pg_result RS;
+  {
+    pg_transaction T(db);
+    RS = T.exec(strSQL);
+    save_tbldefs(T, strmissed_promos_watermark_setting, "dtm", format_datetime(dtmnew_day, "%F") + " " + format_datetime(dtmnew_until, "%T"));
+    T.commit();
+  }
+  dtmmissed_promos_checked_day   = dtmnew_day;
+  dtmmissed_promos_checked_until = dtmnew_until;
 
   // We need to gather statistics for each missed announcement (first time missed, last time, number)
-  // and display summaries of each. The query is sorted by filename to facilitate this also.
-  string strmissed_file = "";
-  string strmissed_prev_file="";
-  long lngmissed_count=0;
-  datetime dtmmissed_first=datetime_error;
-  datetime dtmmissed_last=datetime_error;
+  // and display summaries of each. RETURNING rows are not ordered, so we gather them per filename
+  // here (the map also keeps the log output sorted by filename, as before).
+  struct missed_stats {
+    long lngcount;
+    datetime dtmfirst;
+    datetime dtmlast;
+  };
+  map<string, missed_stats> missed;
 
   while (*RS) {
-    string strTZ_Slot = RS->field("lngTZ_Slot");
     datetime dtmDay  = parse_psql_date(RS->field("dtmDay"));
     datetime dtmTime = parse_psql_time(RS->field("dtmForcePlayAt", RS->field("dtmStart", " ").c_str()));
     datetime dtmPlayAt = dtmDay + dtmTime - timezone;
 
-    // We don't want to generate errors for each individual missed announcement. We
-    // are ordering the returned results by filename, so we can gather statistics for each
-    // announcement and display a  summary "missed" error.
-
-    // - Is this the same file as the last returned, or is this the first file?
-    strmissed_file = RS->field("strFileName", "ERROR");
+    string strmissed_file = RS->field("strFileName", "ERROR");
 
-    // Does the line list a new mp3?
-    if (strmissed_file != strmissed_prev_file) {
-      // This recordset lists details for a new mp3 that was missed.
-      // - Are there previously gathered stats?
-      if (strmissed_prev_file != "") {
-        // Yes, so print out the stats gathered so far
-        write_errors_for_missed_promos_log_missed(strmissed_prev_file, lngmissed_count, dtmmissed_first, dtmmissed_last);
-      }
-      // Now initialize the stats.
-      lngmissed_count=1;
-      dtmmissed_first=dtmPlayAt;
-      dtmmissed_last=dtmPlayAt;
+    map<string, missed_stats>::iterator it = missed.find(strmissed_file);
+    if (it == missed.end()) {
+      // First missed slot for this mp3. Initialize the stats.
+      missed_stats stats;
+      stats.lngcount = 1;
+      stats.dtmfirst = dtmPlayAt;
+      stats.dtmlast  = dtmPlayAt;
+      missed[strmissed_file] = stats;
     }
     else {
-      // This recordset lists details for the same missed mp3 as the last recordset that was processed.
-      // - Update the stats.
-      ++lngmissed_count;
-      if (dtmPlayAt < dtmmissed_first) {
-        dtmmissed_first = dtmPlayAt;
+      // Another missed slot for the same mp3. Update the stats.
+      ++it->second.lngcount;
+      if (dtmPlayAt < it->second.dtmfirst) {
+        it->second.dtmfirst = dtmPlayAt;
       }
-      if (dtmPlayAt > dtmmissed_last) {
-        dtmmissed_last = dtmPlayAt;
+      if (dtmPlayAt > it->second.dtmlast) {
+        it->second.dtmlast = dtmPlayAt;
       }
     }
 
-    // Now update the previous missed file, we need to use this value outside
-    // the loop...
-    strmissed_prev_file = strmissed_file;
-
-    // We have gathered the stat details for this record. Mark the "miss error written" field true
-    strSQL = "UPDATE tblSchedule_TZ_Slot SET bitMissErrorWritten = '1' WHERE lngTZ_Slot = " + strTZ_Slot;
-    db.exec(strSQL);
-
     // Now move to the next record.
     (*RS)++;
   }
 
-  // Now, at the end of the loop, write the details for the last missed announcement that we
-  // were processing above.
-  if (strmissed_prev_file != "") {
-    // Yes, so print out the stats gathered for the last processed filename.
-    write_errors_for_missed_promos_log_missed(strmissed_prev_file, lngmissed_count, dtmmissed_first, dtmmissed_last);
+  // Now write the details for each missed announcement:
+  for (map<string, missed_stats>::const_iterator it = missed.begin(); it != missed.end(); ++it) {
+    write_errors_for_missed_promos_log_missed(it->first, it->second.lngcount, it->second.dtmfirst, it->second.dtmlast);
   }
 }
 
@@ -925,7 +1051,15 @@ void player::write_errors_for_missed_promos_log_missed(const string strmissed_fi
   }
 }
 
-datetime player::get_miss_promos_before_time() {
+void player::load_missed_promos_watermark(pg_conn_exec & db) {
+  string strwatermark = load_tbldefs(db, strmissed_promos_watermark_setting, "", "dtm");
+  if (strwatermark == "") return; // Not saved yet
+  datetime dtmwatermark = parse_datetime_string(strwatermark);
+  dtmmissed_promos_checked_day   = get_datetime_date(dtmwatermark);
+  dtmmissed_promos_checked_until = get_datetime_time(dtmwatermark);
+}
+
+datetime player::get_miss_promos_before_time(const player_config & config) {
   // Return the time (no date) before which we start missing promos (aka
   // adverts/announcements)
 
@@ -1022,7 +1156,7 @@ void player::check_playback_status() {
   }
 }
 
-long player::get_fc_segment(const long lngfc, const string & strsql_time) {
+long player::get_fc_segment(pg_conn_exec & db, const long lngfc, const string & strsql_time) {
   // Fetch the the segment of format clock [lngfc] which is to be used at time [strsql_time]
   string strsql = "SELECT lngfc_seg FROM tblfc_seg WHERE lngfc=" + ltostr(lngfc) + " AND time '" + strsql_time + "' BETWEEN dtmstart AND dtmend ORDER BY lngfc_seg DESC";
   ap_pg_result rs = db.exec(strsql);
@@ -1055,7 +1189,7 @@ void player::get_playback_events_info(playback_events_info & event_info, const i
 
   // Fetch which XMMS session is being used to play the current item. (or if linein is being used).
   bool blnlinein_used = run_data.uses_linein(SU_CURRENT_FG);
-  int intxmms_song_length_ms = -1;
+  int intsong_length_ms = -1;
   int intxmms_song_pos_ms = -1;
   string stritem_ends_descr = "Item ends"; // Default description for the item end
 
@@ -1063,19 +1197,30 @@ void player::get_playback_events_info(playback_events_info & event_info, const i
     // XMMS is being used to play this item.
     int intxmms_session    = run_data.get_xmms_used(SU_CURRENT_FG);
     intxmms_song_pos_ms    = xmmsc::xmms[intxmms_session].get_song_pos_ms();
-    intxmms_song_length_ms = xmmsc::xmms[intxmms_session].get_song_length_ms();
 
-    // Default to assuming the item ends when XMMS gets to the end of the item:
-    int intend_ms = intxmms_song_length_ms;
+    // Length of the item. For mp3s this comes from the file itself (it's exact, and cached), otherwise ask XMMS:
+    if (lcase(right(run_data.current_item.strmedia, 4)) == ".mp3") {
+      try {
+        intsong_length_ms = mp3tags.get_mp3_length_ms(run_data.current_item.strmedia);
+      } catch(...) {
+        // Not logged here (this runs very often). Fall back to XMMS below.
+      }
+    }
+    if (intsong_length_ms < 0) {
+      intsong_length_ms = xmmsc::xmms[intxmms_session].get_song_length_ms();
+    }
+
+    // Default to assuming the item ends when playback gets to the end of the item:
+    int intend_ms = intsong_length_ms;
 
     // For songs we check the end more closely (if we have the info):
     if (run_data.current_item.cat == SCAT_MUSIC &&
         run_data.current_item.media_info.blnloaded) {
       // Ending information is available, so we might end the song early.
-      // Check that XMMS's end matches the end recorded in the DB fairly closely:
-      int intdiff = abs(intxmms_song_length_ms - run_data.current_item.media_info.intlength_ms);
+      // Check that the item's length matches the length recorded in the DB fairly closely:
+      int intdiff = abs(intsong_length_ms - run_data.current_item.media_info.intlength_ms);
       if (intdiff > 500) {
-        log_debug("XMMS says that " + run_data.current_item.strmedia + " is " + itostr(intxmms_song_length_ms) + " ms long, but the DB says it is " + itostr(run_data.current_item.media_info.intlength_ms) + " ms. I might not end the song at the correct time!");
+        log_debug(run_data.current_item.strmedia + " is " + itostr(intsong_length_ms) + " ms long, but the DB says it is " + itostr(run_data.current_item.media_info.intlength_ms) + " ms. I might not end the song at the correct time!");
       }
 
       // Log a warning if the item is dynamically compressed:
@@ -1161,14 +1306,13 @@ void player::get_playback_events_info(playback_events_info & event_info, const i
 
     // Is the current item inside the current playlist?
     bool blnfound = false;
-    programming_element_list::iterator i = run_data.current_segment->programming_elements.begin();
+    const segment_playlist & playlist = run_data.current_segment->playlist;
     string strcurrent_item_media = run_data.current_item.strmedia;
-    while (i != run_data.current_segment->programming_elements.end()) {
-      if (strcurrent_item_media == i->strmedia) {
+    for (long lngitem = 0; lngitem < playlist.size(); ++lngitem) {
+      if (strcurrent_item_media == playlist.media(lngitem)) {
         blnfound = true;
         break;
       }
-      i++;
     }
     if (blnfound) {
       // Current item is within the new playlist. ie, no need to transition immediately to the
@@ -1189,9 +1333,7 @@ void player::get_playback_events_info(playback_events_info & event_info, const i
   //    the next hour:
 
   // - How many ms into the current hour?
-  timeval tvnow;
-  gettimeofday(&tvnow, NULL);
-  int ms_into_hour = ((tvnow.tv_sec % (60*60)) * 1000) + (tvnow.tv_usec / 1000);
+  int ms_into_hour = wall_clock.now_ms() % (60*60*1000);
   // - ms until the start of the next segment?
   event_info.inthour_change_interrupt_ms = (60*60*1000) - ms_into_hour;
 
@@ -1300,15 +1442,6 @@ void write_tblplayeroutput(pg_conn_exec & conn, const string strMessage, const s
 
 void player::log_mp_status_to_db(const sound_usage sound_usage) {
   try {
-    const string strXMMS_Status = "mp_status";
-
-    // Start a database transaction:
-    pg_transaction T(db);
-
-    // Delete all of the mp_Status records
-    string strSQL = "DELETE FROM tblplayeroutput WHERE strmsgdesc = " + psql_str(strXMMS_Status);
-    T.exec(strSQL);
-
     // Fetch info about the current or next item?
     programming_element * pe = NULL;
     switch(sound_usage) {
@@ -1355,18 +1488,33 @@ void player::log_mp_status_to_db(const sound_usage sound_usage) {
       strmusic_source = "xmms";
     }
 
-    // Now log this data to the database:
-    write_tblplayeroutput(T, "Playing: "      + strmp_status_playing, strXMMS_Status);
-    write_tblplayeroutput(T, "Time: "         + strmp_status_time, strXMMS_Status);
-    write_tblplayeroutput(T, "Left volume: "  + itostr(intmp_status_volume), strXMMS_Status);
-    write_tblplayeroutput(T, "Right volume: " + itostr(intmp_status_volume), strXMMS_Status);
+    // Now the maintenance worker logs this data to the database:
+    m_worker.post([strmp_status_playing, strmp_status_time, intmp_status_volume, strmusic_source](pg_connection & db) {
+      write_mp_status_to_db(db, strmp_status_playing, strmp_status_time, intmp_status_volume, strmusic_source);
+    });
+  } catch_exceptions;
+}
 
-    // No problems, so commit the database transaction:
-    T.commit();
+void player::write_mp_status_to_db(pg_connection & db, const string & strplaying, const string & strtime, const int intvolume, const string & strmusic_source) {
+  const string strXMMS_Status = "mp_status";
 
-    // Also update tblliveinfo:
-    write_liveinfo_setting(db, "Music source", strmusic_source);
-  } catch_exceptions;
+  // Start a database transaction:
+  pg_transaction T(db);
+
+  // Delete all of the mp_Status records
+  string strSQL = "DELETE FROM tblplayeroutput WHERE strmsgdesc = " + psql_str(strXMMS_Status);
+  T.exec(strSQL);
+
+  write_tblplayeroutput(T, "Playing: "      + strplaying, strXMMS_Status);
+  write_tblplayeroutput(T, "Time: "         + strtime, strXMMS_Status);
+  write_tblplayeroutput(T, "Left volume: "  + itostr(intvolume), strXMMS_Status);
+  write_tblplayeroutput(T, "Right volume: " + itostr(intvolume), strXMMS_Status);
+
+  // No problems, so commit the database transaction:
+  T.commit();
+
+  // Also update tblliveinfo:
+  write_liveinfo_setting(db, "Music source", strmusic_source);
 }
 
 int player::get_next_playback_safety_margin_ms() {
@@ -1376,3 +1524,36 @@ int player::get_next_playback_safety_margin_ms() {
   return config.intcrossfade_length_ms + 10000; // crossfade length + 10s.
 }
 
+
+void player::start_mp3_tag_warmup() {
+  // (Re)start reading tags for the music library in the background. Results are logged
+  // by maintenance_operational_check().
+  vector<string> dirs;
+  dirs.push_back(config.dirs.strmp3);
+  dirs.push_back(config.dirs.strprofiles);
+  if (dir_exists(config.strdefault_music_source)) dirs.push_back(config.strdefault_music_source);
+  log_message("Starting background mp3 tag scan...");
+  m_mp3_tag_warmup.start(dirs);
+}
+
+void player::start_dir_watches() {
+  // (Re)start watching the media directories for changes. Cached details of files under
+  // fully-watched directories are then only checked when the files change.
+  vector<string> dirs;
+  dirs.push_back(config.dirs.strmp3);
+  dirs.push_back(config.dirs.strprofiles);
+  dirs.push_back(config.dirs.stradverts);
+  dirs.push_back(FORMAT_CLOCK_DIR);
+  if (dir_exists(config.strdefault_music_source)) dirs.push_back(config.strdefault_music_source);
+
+  m_dir_watcher.clear();
+  for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+    if (dir_exists(*it) && !m_dir_watcher.add_tree(*it)) {
+      log_warning("Could not watch " + *it + " for changes (is the inotify watch limit too low?). Its files will be checked each time they are used.");
+    }
+  }
+  mp3tags.set_watched_dirs(m_dir_watcher.watched_trees(), m_dir_watcher.aliases());
+
+  // Changes made while nothing was watching were missed:
+  mp3tags.invalidate_all();
+}
@@ -2,12 +2,19 @@
 #ifndef PLAYER_H
 #define PLAYER_H
 
+#include <set>
 #include <string>
 #include <vector>
 
 #include "music_history.h"
+#include "common/deadline_queue.h"
+#include "common/dir_watcher.h"
+#include "maintenance_scheduler.h"
+#include "maintenance_worker.h"
+#include "common/mp3_tag_warmup.h"
 #include "player_config.h"
 #include "player_run_data.h"
+#include "segment_preloader.h"
 #include "common/my_time.h"
 #include "common/psql.h"
 
@@ -29,13 +36,10 @@ public:
 
 /// Structure for storing events that take place during a playback transition (see player::playback_transition)
 struct transition_event {
-  int intrun_ms; ///< When does the event run?
+  int intrun_ms; ///< When does the event run? (ms after the transition's queue started)
   std::string strevent; ///< Lists the event.
 };
-typedef std::vector <transition_event> transition_event_list;
-
-/// A function we use with the sort() algorithm:
-bool transition_event_less_than(const transition_event & e1, const transition_event & e2);
+typedef deadline_queue <transition_event> transition_event_list; ///< Events by intrun_ms
 
 // Forward declarations:
 class log_info;
@@ -52,17 +56,38 @@ private:
   // FUNCTIONS AND ATTRIBUTES USED DURING INIT():
   void reset(); ///< Reset ALL object attributes to default, uninitialized values.
   void remove_waiting_mediaplayer_cmds(); ///< Remove waiting MediaPlayer commands (pause, stop, resume, etc)
-  void write_liveinfo(); ///< Write status info to a table for the Global Reporter to read.
-  void check_received(); ///< Check the Received directory for .CMD files
-  void load_cmd_into_db(const std::string strfull_path);
-  void process_waiting_cmds();
+  static void write_liveinfo(pg_conn_exec & db, const player_config & config); ///< Write status info to a table for the Global Reporter to read.
+  static void check_received(pg_conn_exec & db, const player_config & config); ///< Check the Received directory for .CMD files
+  static void load_cmd_into_db(pg_conn_exec & db, const std::string strfull_path);
+
+  /// A player command waiting in tblwaitingcmd
+  struct waiting_cmd {
+    long lngwaiting_cmd;
+    std::string strcommand;
+    std::string strparams;
+  };
+  static std::vector<waiting_cmd> fetch_waiting_cmds(pg_conn_exec & db); ///< Fetch the commands which haven't been run yet
+  bool run_waiting_cmd(const waiting_cmd & cmd); ///< Run a command. Returns false (and logs why) if it failed.
+  static void mark_waiting_cmd_done(pg_conn_exec & db, const long lngwaiting_cmd, const bool blnerror); ///< Record that a command was run
+  void queue_waiting_cmds(pg_connection & db); ///< Maintenance worker: pass new waiting commands to the player thread to run
+  std::set<long> m_queued_cmds; ///< Waiting commands passed to the player thread, which aren't marked as done yet (maintenance worker only)
+
   void correct_waiting_promos();
-  void write_errors_for_missed_promos();
+  void write_errors_for_missed_promos(pg_connection & db, const player_config & config);
   void write_errors_for_missed_promos_log_missed(const std::string strmissed_file, const long lngmissed_count, const datetime dtmmissed_first, const datetime dtmmissed_last);
-  datetime get_miss_promos_before_time(); // Return the time (no date) before which we start missing promos
+  static datetime get_miss_promos_before_time(const player_config & config); // Return the time (no date) before which we start missing promos
+
+  /// Watermark used by write_errors_for_missed_promos(). Slots which started before
+  /// dtmmissed_promos_checked_until (a time, no date) on dtmmissed_promos_checked_day have already been
+  /// checked. Saved in tbldefs, so that it survives restarts. After startup, only the maintenance
+  /// worker uses these.
+  datetime dtmmissed_promos_checked_day;
+  datetime dtmmissed_promos_checked_until;
+  void load_missed_promos_watermark(pg_conn_exec & db); ///< Load the watermark saved by an earlier check
   void log_xmms_status_to_db();
 
   pg_connection db; ///< Connection to the schedule database. This is used to run queries and fetch records.
+  string strdb_conn; ///< Connection string for db. Background threads use it to open their own connections.
 
   /// A callback function called by the db (database connection) object when there is a database
   /// connection problem. It keeps music going, etc.
@@ -121,10 +146,13 @@ private:
   // Functions called by get_next_item():
     void get_next_item_check_fc_seg_change(const int intstarts_ms); // Call this before the others, to detect FC seg changes.
     void get_next_item_promo(programming_element & next_item, const int intstarts_ms, const bool blnwould_interrupt_song); // Populate argument with the next promo if there are promos waiting.
+    long m_lnglast_promo_query_ms; ///< When get_next_item_promo() last queried the database for promos (monotonic clock). LONG_MIN if never.
     void get_next_item_format_clock(programming_element & next_item, const int intstarts_ms); // Use Format Clocks to determine an item to be played.
 
-    // Functions called by get_next_item_format_clock:
-    long get_fc_segment(const long lngfc, const string & strsql_time);
+    // Functions called by get_next_item_check_fc_seg_change. They only use their arguments, so that the
+    // segment preloader can call them from its thread:
+    static long find_fc_segment(pg_conn_exec & db, const player_config & config, const datetime dtmdelayed); ///< Fetch the segment scheduled at a format clock time (-1 for a music profile)
+    static long get_fc_segment(pg_conn_exec & db, const long lngfc, const string & strsql_time);
 
   // Fetch timing info about events that will take place during playback of the current item
   // (music bed starts, music bed ends, item ends).
@@ -171,21 +199,38 @@ private:
 
   // Timed player maintenance events. Run when there is spare time during playback.
   // - Called by player_maintenance();
-  void maintenance_check_received(const datetime dtmcutoff);
-  void maintenance_check_waiting_cmds(const datetime dtmcutoff);
-  void maintenance_operational_check(const datetime dtmcutoff);
-  void maintenance_player_running(const datetime dtmcutoff);
-  void maintenance_hide_xmms_windows([[maybe_unused]] const datetime dtmcutoff); ///< Hide all visible XMMS windows.
-
-  // Functions called by maintenance_operational_check:
-  void log_music_playlist_to_db(); ///< Log the contents of the current music playlist to the database
+  // (lngcutoff_ms is a monotonic clock time, see common/timing.h)
+  maintenance_scheduler m_maintenance; ///< Runs the tasks below
+  void add_maintenance_tasks(); ///< Called during init. Also adds the maintenance worker's tasks (see m_worker).
+  void maintenance_operational_check([[maybe_unused]] const long lngcutoff_ms);
+  void maintenance_player_running(const long lngcutoff_ms);
+  void maintenance_hide_xmms_windows([[maybe_unused]] const long lngcutoff_ms); ///< Hide all visible XMMS windows.
+  void maintenance_check_file_changes([[maybe_unused]] const long lngcutoff_ms); ///< Invalidate cached details of media files which changed.
+  void maintenance_preload_segment([[maybe_unused]] const long lngcutoff_ms); ///< Start loading the next format clock segment, shortly before it is due.
+
+  void maintenance_log_music_playlist(); ///< Pass the music playlist to the maintenance worker to log, after it changes.
+
+  /// Progress of logging the music playlist to the database, which is done in chunks (maintenance worker only)
+  struct playlist_log_progress {
+    bool blnactive;              ///< Busy logging a playlist
+    std::vector<string> media;   ///< The playlist being logged
+    long lngnext_item;           ///< Next item to log
+    playlist_log_progress() : blnactive(false), lngnext_item(0) {}
+  } m_playlist_log;
+  bool log_music_playlist_to_db(pg_connection & db, const long lngcutoff_ms); ///< Log the next chunk of m_playlist_log to the database. Returns true when done.
 
   // Log the current media playback status to the database.
   // Call with a sound_usage of SU_NEXT_FG when you are busy transitioning to the next item
   // and want to get status info for the next item, not the current item.
   void log_mp_status_to_db(const sound_usage sound_usage = SU_CURRENT_FG);
+  static void write_mp_status_to_db(pg_connection & db, const string & strplaying, const string & strtime, const int intvolume, const string & strmusic_source); ///< Called by the maintenance worker for log_mp_status_to_db()
 
   mp3_tags mp3tags; ///< A cache of mp3 tags, used for quickly retrieving mp3 details.
+  mp3_tag_warmup m_mp3_tag_warmup; ///< Reads tags for the whole music library into mp3tags, in the background.
+  void start_mp3_tag_warmup(); ///< (Re)start the background tag warmup over the music & profile directories
+  dir_watcher m_dir_watcher; ///< Watches the media directories, so that cached details are only re-checked when files change
+  segment_preloader m_segment_preloader; ///< Loads the next format clock segment in the background
+  void start_dir_watches(); ///< (Re)start watching the media directories for changes
 
   // Fetch the current playback safety margin:
   //   How long before important playback events, the player should be ready and
@@ -194,6 +239,25 @@ private:
 
   /// Player music history. For updating tblmusichistory & preventing song repetition.
   music_history m_music_history;
+
+  // Fast-start snapshot (see player_snapshot.cpp):
+  void save_snapshot(); ///< Write the music history & playback state to PLAYER_SNAPSHOT_FILE
+  bool load_snapshot(); ///< Load a fresh snapshot at startup. Returns false if there isn't a usable one.
+  void restore_snapshot_playback(); ///< Move the playback state loaded by load_snapshot() into run_data
+
+  /// Playback state loaded by load_snapshot(), waiting for restore_snapshot_playback()
+  struct snapshot_state {
+    bool blnloaded;
+    ap_segment segment;
+    segment_playlist prev_music_seg_pel;
+    programming_element_list waiting_promos;
+    int intsegment_delay;
+    datetime dtmlast_promo_batch_item_played;
+  } snapshot;
+
+  /// Runs database & disk housekeeping on a background thread (see add_maintenance_tasks()).
+  /// Declared last, so that it stops before the members its tasks use are destroyed.
+  maintenance_worker m_worker;
 };
 
 extern player * pplayer; // A pointer to the currently-running player instance. Automatically maintained
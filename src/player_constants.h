@@ -5,6 +5,8 @@
 const string PLAYER_DIR      = "/data/radio_retail/progs/player/"; ///< Player program directory. Binary & logfile lives here.
 const string PLAYER_LOG_FILE = PLAYER_DIR + "player.log";
 const string PLAYER_DEBUG_LOG_FILE = PLAYER_DIR + "player_debug.log";
+const string PLAYER_SNAPSHOT_FILE = PLAYER_DIR + "player_snapshot.bin"; ///< Fast-start snapshot of music history & playback state
+const string FORMAT_CLOCK_DIR = "/data/radio_retail/stores_software/data/fc/"; ///< Format clock sub-category media lives under here
 
 const int intmax_xmms = 2;                           ///< Number of XMMS sessions required. Only 2 are needed until we start using music beds.
                                                      ///< crossfading between two items, both with underlying music.
@@ -14,6 +16,16 @@ const int intprevent_song_repeat_factor = 75;        ///< After a music item pla
                                                      ///< before the same song can be played again. The amount of other songs
                                                      ///<that need to play is [intprevent_song_repeat_factor]% of the current music
                                                      ///<playlists length
+const int intsnapshot_max_age = 5*60;                ///< Player snapshots older than this (in seconds) are not used at startup
+const int intsegment_preload_secs = 5*60;            ///< How long (in seconds) before a segment ends, the next segment is loaded in the background
+const int intplaylist_log_chunk_ms = 500;           ///< Longest (in ms) spent logging the music playlist to the database at a time
+const int intplaylist_log_rows_per_insert = 100;     ///< Music playlist rows logged to the database per INSERT
+const int intpromo_query_interval_ms = 30*1000;     ///< Shortest time (in ms) between database queries for promos to play
+const int intplayback_retry_ms = 1000;               ///< How long (in ms) the player waits after resetting playback, before trying again
+const int intmax_player_sleep_ms = 60*1000;          ///< Longest time (in ms) the player sleeps without checking playback status, when
+                                                     ///< no playback events or maintenance tasks are due
+const int intmissed_promos_recheck_secs = 60*60;     ///< Missed promo checks also look this far back before the watermark, for
+                                                     ///< slots loaded after their window had closed
 
 #endif
 
@@ -107,26 +107,26 @@ void player::get_next_item_promo(programming_element & item, const int intstarts
     log_debug(" - No. Will check if we can query for promos to add to the queue.");
 
     // Timing variables:
-    static datetime dtmlast_now = datetime_error; // Used to check for system clock changes
-    static datetime dtmlast_run = datetime_error; // The last time the function's main logic ran.
+    static unsigned long lngclock_steps = wall_clock.steps(); // Used to check for system clock changes
 
-    // Check if the system clock was set back in time since the last time:
-    datetime dtmnow = now();
-    if (dtmnow < dtmlast_now) {
+    // Check if the system clock was set since the last time:
+    long lngnow_ms = monotonic_ms();
+    if (wall_clock.steps() != lngclock_steps) {
       log_message("System clock change detected, recallibrating function timing...");
-      dtmlast_run = datetime_error;
+      lngclock_steps = wall_clock.steps();
+      m_lnglast_promo_query_ms = LONG_MIN;
       run_data.dtmlast_promo_batch_item_played = datetime_error;
     }
 
     // Don't query the database for adverts too regularly. Require that either at
-    // least 30 seconds have elapsed from the last time, or that the Format Clock
-    // segment has changed
+    // least intpromo_query_interval_ms have elapsed from the last time, or that the
+    // Format Clock segment has changed
     bool blnallow_query = false;
 
     log_debug("Can we query the database for adverts now?");
 
     if (!blnallow_query) {
-      if (dtmlast_run == datetime_error || (dtmnow/30 != dtmlast_run/30)) {
+      if (m_lnglast_promo_query_ms == LONG_MIN || lngnow_ms - m_lnglast_promo_query_ms >= intpromo_query_interval_ms) {
         log_debug(" - Yes. Enough time has elapsed since the last query");
         blnallow_query = true;
       }
@@ -145,7 +145,7 @@ void player::get_next_item_promo(programming_element & item, const int intstarts
     }
 
     // Now remember the last time we ran:
-    dtmlast_run = dtmnow;
+    m_lnglast_promo_query_ms = lngnow_ms;
 
     // Now check that the minimum time has passed since the last announcement batch
 
@@ -176,7 +176,7 @@ void player::get_next_item_promo(programming_element & item, const int intstarts
       "Current segment does not allow promos");
     {
       datetime dtmwaiting_until = run_data.dtmlast_promo_batch_item_played + 60 * config.intmin_mins_between_batches;
-      CHECK((dtmnow >= dtmwaiting_until),
+      CHECK((now() >= dtmwaiting_until),
         "Enough time has elapsed since the last advert batch",
         "Not enough time has elapsed since the last advert batch. Waiting until " + format_datetime(dtmwaiting_until, "%T"));
     }
@@ -225,7 +225,7 @@ void player::get_next_item_promo(programming_element & item, const int intstarts
       datetime dtmquery_until = datetime_error;
 
       // When do we start missing ads before? (we query for ads after this time):
-      datetime dtmmiss_ads_before = get_miss_promos_before_time();
+      datetime dtmmiss_ads_before = get_miss_promos_before_time(config);
 
       if (config.blnformat_clocks_enabled) {
         // When Format Clocks are enabled we query for ads between X and Y, where:
@@ -823,14 +823,7 @@ void player::get_next_item_check_fc_seg_change(const int intstarts_ms) {
   //   the next item, then truncate to seconds precision. Our "segment delay
   //   factor" logic prevents any format clock time from being unaccounted for
   //   due to rounding issues.
-  datetime dtmnext_starts = datetime_error;
-  {
-    timeval tvnow;
-    gettimeofday(&tvnow, NULL);
-    tvnow.tv_usec += (intstarts_ms * 1000);
-    normalise_timeval(tvnow);
-    dtmnext_starts = tvnow.tv_sec;
-  }
+  datetime dtmnext_starts = wall_clock.to_wall_ms(monotonic_ms() + intstarts_ms) / 1000;
 
   // Work out the current delays.
 
@@ -924,93 +917,11 @@ void player::get_next_item_check_fc_seg_change(const int intstarts_ms) {
     }
   }
 
-  long lngfc     = -1; // -1 means no Format Clock found...
-  long lngfc_seg = -1; // -1 means no Format Clock segment found.
-
-  // Are format clocks enabled?
-  if (!config.blnformat_clocks_enabled) {
-    // Format clocks are not enabled. We don't query the database
-    log_line("Format Clocks are disabled. Will use a music profile instead.");
-  }
-  else {
-    // Format clocks are enabled. Query for the Format Clock database id & segment for this time.
-    // Include the current "segment delay" factor
-    log_line("Fetching Format Clock and Segment scheduled for " + format_datetime(dtmdelayed, "%T"));
-
-    // Variables used for fetching format clock segments:
-    string strfc_date              = format_datetime(dtmdelayed, "%F");
-    string strfc_time_with_hour    = format_datetime(dtmdelayed, "%T");
-    string strfc_time_without_hour = format_datetime(dtmdelayed, "00:%M:%S");
-
-    // Find a format clock and segment scheduled for this time:
-    {
-      // We need to fetch lngfc and lngfc_seg:
-      // Fetch lngfc:
-      string strsql = "SELECT lngfc FROM tblfc_sched INNER JOIN tblfc_sched_day USING (lngfc_sched) "
-                      "WHERE (tblfc_sched.intday = " + itostr(weekday(dtmdelayed)) + " OR tblfc_sched.intday IS NULL) AND "
-                      "date '" + strfc_date + "' BETWEEN COALESCE(tblfc_sched.dtmstart, '0001-01-01') AND "
-                                                        "COALESCE(tblfc_sched.dtmend, '9999-12-25') AND "
-                      "time '" + strfc_time_with_hour + "' BETWEEN tblfc_sched_day.dtmstart AND tblfc_sched_day.dtmend "
-                      "ORDER BY tblfc_sched.lngfc_sched DESC LIMIT 1";
-      ap_pg_result rs = db.exec(strsql);
-
-      // How many results?
-      if (rs->size() <= 0) { // No format clocks scheduled.
-        log_warning("No Format Clocks scheduled for this hour. Will revert to the default Format Clock.");
-      } else { // User scheduled 1 or more format clocks.
-        // We found a user-scheduled format clock. Fetch the segment:
-        lngfc = strtol(rs->field("lngfc"));
-        try {
-          lngfc_seg = get_fc_segment(lngfc, strfc_time_without_hour);
-        }
-        catch(const my_exception & e) {
-          // We failed to get a segment.
-          log_warning(e.get_error());
-          log_warning("Will revert to the default format clock");
-          lngfc = -1;
-          lngfc_seg = -1;
-        }
-      }
-    }
-
-    // Did we find a format clock & segment to use?
-    if (lngfc == -1) {
-      // No. Fetch the Default format clock
-      log_message("Reverting to Default Format Clock...");
-      // Check if we have the setting:
-      if (config.lngdefault_format_clock <= 0) {
-        // Default clock is not set!
-        log_warning("Default Format Clock is not set! Reverting to a music profile...");
-      }
-      else {
-        // Default clock is set (in tbldefs). See if it exists on the system.
-        string strsql = "SELECT lngfc FROM tblfc WHERE lngfc = " + ltostr(config.lngdefault_format_clock);
-        ap_pg_result rs = db.exec(strsql);
-        // Did we find 1 record?
-        if (rs->size() != 1) {
-          // Nope
-          log_warning("Could not find the Default Format clock! (lngfc=" + ltostr(config.lngdefault_format_clock) +"). I will revert to a music profile.");
-        }
-        else {
-          // We found the Format Clock record. Now find the current Format Clock segment
-          lngfc = config.lngdefault_format_clock;
-          try {
-            lngfc_seg = get_fc_segment(lngfc, strfc_time_without_hour);
-          }
-          catch(const my_exception & e) {
-            // We failed to get a segment.
-            log_warning(e.get_error());
-            log_warning("Will default to a music profile");
-            lngfc = -1;
-            lngfc_seg = -1;
-          }
-        }
-      }
-    }
-  }
+  long lngfc_seg = find_fc_segment(db, config, dtmdelayed); // -1 means no Format Clock segment found.
 
   // Has the current segment changed?
   // Or, does the system want to reload the segment data?
+  // Or, have the files the segment's playlist was generated from changed?
   // Or, has the current segment expired?
 
   // - 'Segment expired' means that the segment's time has run out.
@@ -1019,17 +930,28 @@ void player::get_next_item_check_fc_seg_change(const int intstarts_ms) {
   if (!run_data.current_segment->blnloaded ||
        lngfc_seg != run_data.current_segment->lngfc_seg ||
        run_data.blnforce_segment_reload ||
+       run_data.current_segment->blnplaylist_dirty ||
        blnsegment_expired) {
 
-    // Reset the "force segment reload" control variable:
+    // Reset the "force segment reload" control variable. A preloaded segment is out of date
+    // if the system wants to reload the segment data:
+    if (run_data.blnforce_segment_reload) m_segment_preloader.discard();
     run_data.blnforce_segment_reload = false;
 
-    // Load the new segment:
-    log_message("Loading Format Clock segment (id: " + itostr(lngfc_seg) + ")");
+    // Was the new segment already loaded in the background? (see maintenance_preload_segment())
+    ap_segment preloaded_segment;
+    if (m_segment_preloader.take(lngfc_seg, dtmdelayed, preloaded_segment)) {
+      log_message("Using the preloaded Format Clock segment (id: " + itostr(lngfc_seg) + ")");
+      run_data.current_segment = std::move(preloaded_segment);
+    }
+    else {
+      // Load the new segment:
+      log_message("Loading Format Clock segment (id: " + itostr(lngfc_seg) + ")");
 
-    // A -1 lngfc_seg means load the currently-scheduled music profile instead
+      // A -1 lngfc_seg means load the currently-scheduled music profile instead
 
-    run_data.current_segment->load_from_db(db, lngfc_seg, dtmdelayed, config, mp3tags, m_music_history);
+      run_data.current_segment->load_from_db(db, lngfc_seg, dtmdelayed, config, mp3tags, m_music_history);
+    }
 
     // Log more info about the segment we just loaded:
     log_message("Loaded segment " + itostr(run_data.current_segment->intseg_no) +
@@ -1041,10 +963,10 @@ void player::get_next_item_check_fc_seg_change(const int intstarts_ms) {
       run_data.current_segment->fc.strname + "\" (id: " +
       ltostr(run_data.current_segment->fc.lngfc) + ")");
 
-    // If this is a user-scheduled music segment, then remember the programming
-    // elements (used later for reverting  when we run out of items)
+    // If this is a user-scheduled music segment, then remember the playlist
+    // (used later for reverting  when we run out of items)
     if (lngfc_seg != -1 && run_data.current_segment->cat.cat == SCAT_MUSIC) {
-      prev_music_seg_pel = run_data.current_segment->programming_elements;
+      prev_music_seg_pel = run_data.current_segment->playlist;
     }
 
     // How far into the segment did we query for?
@@ -1121,6 +1043,97 @@ void player::get_next_item_check_fc_seg_change(const int intstarts_ms) {
   }
 }
 
+long player::find_fc_segment(pg_conn_exec & db, const player_config & config, const datetime dtmdelayed) {
+  // Fetch the Format Clock segment scheduled at [dtmdelayed] (a Format Clock time, ie including the
+  // segment delay). Returns -1 if a music profile should play instead.
+  long lngfc     = -1; // -1 means no Format Clock found...
+  long lngfc_seg = -1; // -1 means no Format Clock segment found.
+
+  // Are format clocks enabled?
+  if (!config.blnformat_clocks_enabled) {
+    // Format clocks are not enabled. We don't query the database
+    log_line("Format Clocks are disabled. Will use a music profile instead.");
+  }
+  else {
+    // Format clocks are enabled. Query for the Format Clock database id & segment for this time.
+    // Include the current "segment delay" factor
+    log_line("Fetching Format Clock and Segment scheduled for " + format_datetime(dtmdelayed, "%T"));
+
+    // Variables used for fetching format clock segments:
+    string strfc_date              = format_datetime(dtmdelayed, "%F");
+    string strfc_time_with_hour    = format_datetime(dtmdelayed, "%T");
+    string strfc_time_without_hour = format_datetime(dtmdelayed, "00:%M:%S");
+
+    // Find a format clock and segment scheduled for this time:
+    {
+      // We need to fetch lngfc and lngfc_seg:
+      // Fetch lngfc:
+      string strsql = "SELECT lngfc FROM tblfc_sched INNER JOIN tblfc_sched_day USING (lngfc_sched) "
+                      "WHERE (tblfc_sched.intday = " + itostr(weekday(dtmdelayed)) + " OR tblfc_sched.intday IS NULL) AND "
+                      "date '" + strfc_date + "' BETWEEN COALESCE(tblfc_sched.dtmstart, '0001-01-01') AND "
+                                                        "COALESCE(tblfc_sched.dtmend, '9999-12-25') AND "
+                      "time '" + strfc_time_with_hour + "' BETWEEN tblfc_sched_day.dtmstart AND tblfc_sched_day.dtmend "
+                      "ORDER BY tblfc_sched.lngfc_sched DESC LIMIT 1";
+      ap_pg_result rs = db.exec(strsql);
+
+      // How many results?
+      if (rs->size() <= 0) { // No format clocks scheduled.
+        log_warning("No Format Clocks scheduled for this hour. Will revert to the default Format Clock.");
+      } else { // User scheduled 1 or more format clocks.
+        // We found a user-scheduled format clock. Fetch the segment:
+        lngfc = strtol(rs->field("lngfc"));
+        try {
+          lngfc_seg = get_fc_segment(db, lngfc, strfc_time_without_hour);
+        }
+        catch(const my_exception & e) {
+          // We failed to get a segment.
+          log_warning(e.get_error());
+          log_warning("Will revert to the default format clock");
+          lngfc = -1;
+          lngfc_seg = -1;
+        }
+      }
+    }
+
+    // Did we find a format clock & segment to use?
+    if (lngfc == -1) {
+      // No. Fetch the Default format clock
+      log_message("Reverting to Default Format Clock...");
+      // Check if we have the setting:
+      if (config.lngdefault_format_clock <= 0) {
+        // Default clock is not set!
+        log_warning("Default Format Clock is not set! Reverting to a music profile...");
+      }
+      else {
+        // Default clock is set (in tbldefs). See if it exists on the system.
+        string strsql = "SELECT lngfc FROM tblfc WHERE lngfc = " + ltostr(config.lngdefault_format_clock);
+        ap_pg_result rs = db.exec(strsql);
+        // Did we find 1 record?
+        if (rs->size() != 1) {
+          // Nope
+          log_warning("Could not find the Default Format clock! (lngfc=" + ltostr(config.lngdefault_format_clock) +"). I will revert to a music profile.");
+        }
+        else {
+          // We found the Format Clock record. Now find the current Format Clock segment
+          lngfc = config.lngdefault_format_clock;
+          try {
+            lngfc_seg = get_fc_segment(db, lngfc, strfc_time_without_hour);
+          }
+          catch(const my_exception & e) {
+            // We failed to get a segment.
+            log_warning(e.get_error());
+            log_warning("Will default to a music profile");
+            lngfc = -1;
+            lngfc_seg = -1;
+          }
+        }
+      }
+    }
+  }
+
+  return lngfc_seg;
+}
+
 void player::get_next_item_format_clock(programming_element & next_item, const int intstarts_ms) {
   // Fetch the next item from the current format clock
   // NB: You should call get_next_item_check_fc_seg_change() before calling this function.
@@ -1179,7 +1192,7 @@ void get_next_ok_music_item(
   // an item which hasn't been played recently. Using * 2 because it is possible for the
   // playlist to change during this process (eg, a music segment with repeating disabled,
   // and the system reverts to a music profile instead
-  int intattempts_left = run_data.current_segment->programming_elements.size() * 2;
+  int intattempts_left = run_data.current_segment->playlist.size() * 2;
   if (intattempts_left < 100) intattempts_left = 100;
 
   int intnum_skipped_songs = 0; // Number of songs skipped by our logic
@@ -1257,7 +1270,7 @@ void get_next_ok_music_item(
 
             // Did a song by this artist play recently?
             if (music_history.artist_song_played_recently(
-                artist, num_artists-1, mp3tags)) {
+                artist, num_artists-1)) {
                 blnskip = true;
                 strskip_reason = "a song by the same artist (" + artist +
                                  ") was played recently";
@@ -7,77 +7,92 @@
 #include "common/my_string.h"
 #include "common/temp_dir.h"
 #include "common/linein.h"
+#include "common/maths.h"
 #include "common/rr_misc.h"
 
 namespace xmmsc = xmms_controller;
 
 void player::player_maintenance(const int intmax_time_ms) {
-  // Do background maintenance (separate function). Events have frequencies, (sometimes desired "second" to take place at), and are prioritiesed.
-  //  - Also includes resetting info about the next playback item (highest priority, every 30 seconds..., seconds: 00, 30)
-//  log_line("I have up to " + itostr(intmax_time_ms/1000) + "s to do maintenance in...");
-  datetime dtmcutoff = now() + intmax_time_ms / 1000; // Logic not allowed to run past this length.
-
-  // These events run immediately, and then only after their
-  // frequency (in seconds) has elapsed:
-  RUN_TIMED_CUTOFF(maintenance_check_received(dtmcutoff),     10,   dtmcutoff);
-  RUN_TIMED_CUTOFF(maintenance_check_waiting_cmds(dtmcutoff), 5,    dtmcutoff);
-  RUN_TIMED_CUTOFF(maintenance_operational_check(dtmcutoff),  30,   dtmcutoff);
-  RUN_TIMED_CUTOFF(maintenance_player_running(dtmcutoff),     60,   dtmcutoff);
-  RUN_TIMED_CUTOFF(maintenance_hide_xmms_windows(dtmcutoff),  5*60, dtmcutoff); // Hide all XMMS windows
+  // Do background maintenance. Tasks have frequencies & priorities, and only run if they are
+  // expected to finish within intmax_time_ms. See maintenance_scheduler.h
+  m_maintenance.run(intmax_time_ms);
 }
 
-void player::maintenance_check_received(const datetime dtmcutoff) {
-  // Run this logic only if we have 30s or more remaining:
-  if (dtmcutoff >= now() + 30) {
-    check_received();
-  }
-}
-
-void player::maintenance_check_waiting_cmds(const datetime dtmcutoff) {
-  // Run this logic only if we have 10s or more remaining:
-  if (dtmcutoff >= now() + 10) {
-    process_waiting_cmds();
-  }
-}
-
-void player::maintenance_operational_check(const datetime dtmcutoff) {
-  // Update the live-info table every 10 minutes;
-  if (dtmcutoff >= now() + 60) {
-    static datetime dtmlast_run = datetime_error;
-    if (now()/(10*60) != dtmlast_run/(10*60)) {
-      try {
-        write_liveinfo();
-      } catch_exceptions;
-      dtmlast_run = now();
+void player::add_maintenance_tasks() {
+  // Timed player maintenance tasks, by priority. The estimates are how long to allow each task
+  // before it has been timed, and are on the generous side. worker_actions is also made due
+  // whenever the maintenance worker queues something (see run()):
+  //              Name                    Priority Frequency (ms) Estimate (ms)
+  m_maintenance.add("worker_actions",      100,    60*1000,       1000,  [this](const long) { m_worker.run_player_actions(); return true; });
+  m_maintenance.add("check_file_changes",   90,    5*1000,        1000,  [this](const long lngcutoff_ms) { maintenance_check_file_changes(lngcutoff_ms); return true; });
+  m_maintenance.add("operational_check",    60,    30*1000,       5*1000,  [this](const long lngcutoff_ms) { maintenance_operational_check(lngcutoff_ms); return true; });
+  m_maintenance.add("preload_segment",      50,    30*1000,       1000,  [this](const long lngcutoff_ms) { maintenance_preload_segment(lngcutoff_ms); return true; });
+  m_maintenance.add("player_running",       40,    60*1000,       1000,  [this](const long lngcutoff_ms) { maintenance_player_running(lngcutoff_ms); return true; });
+  m_maintenance.add("hide_xmms_windows",    30,    5*60*1000,     1000,  [this](const long lngcutoff_ms) { maintenance_hide_xmms_windows(lngcutoff_ms); return true; });
+  m_maintenance.add("log_music_playlist",   10,    30*1000,       1000,  [this](const long) { maintenance_log_music_playlist(); return true; });
+  m_maintenance.add("log_maintenance_stats", 0,    60*60*1000,    1000,  [this](const long) { m_maintenance.log_stats(); return true; });
+
+  // Database & disk housekeeping, on the maintenance worker's thread. These tasks only use their
+  // arguments and data which belongs to the worker (see maintenance_worker.h):
+  m_worker.add("check_waiting_cmds",        80,    5*1000,        10*1000, [this](pg_connection & db, const player_config &, const long) { queue_waiting_cmds(db); return true; });
+  m_worker.add("check_received",            70,    10*1000,       30*1000, [](pg_connection & db, const player_config & config, const long) { check_received(db, config); return true; });
+  m_worker.add("missed_promos",             60,    30*1000,       5*1000,  [this](pg_connection & db, const player_config & config, const long) { write_errors_for_missed_promos(db, config); return true; });
+  // (mp3tags doesn't hold its lock while writing the journal, and compacts the cache on its own thread, so
+  // saving doesn't hold up the tag lookups done during playback)
+  m_worker.add("save_mp3_tags",             50,    30*1000,       5*1000,  [this](pg_connection &, const player_config &, const long) { mp3tags.save_changes(); return true; });
+  m_worker.add("write_liveinfo",            20,    10*60*1000,    60*1000, [](pg_connection & db, const player_config & config, const long) { write_liveinfo(db, config); return true; });
+  m_worker.add("log_music_playlist",        10,    30*1000,       2000,  [this](pg_connection & db, const player_config &, const long lngcutoff_ms) {
+    // Log the playlist to the DB, a chunk at a time:
+    if (!m_playlist_log.blnactive) return true;
+    try {
+      return log_music_playlist_to_db(db, lngcutoff_ms);
     }
-  }
+    catch(...) {
+      m_playlist_log.blnactive = false; // Give up on this playlist
+      throw;
+    }
+  });
+}
 
+void player::maintenance_log_music_playlist() {
   // If the music playlist changed, then the global variable [run_data.blnlog_all_music_to_db] is set. Here is where
-  // we actually log all the available music on the machine.
-  if (run_data.blnlog_all_music_to_db && run_data.current_segment->cat.cat == SCAT_MUSIC && dtmcutoff >= now() + 120) {
+  // we actually log all the available music on the machine (the maintenance worker writes it to the database).
+  if (run_data.blnlog_all_music_to_db && run_data.current_segment->cat.cat == SCAT_MUSIC) {
     // Log an informative message.
     log_message("Music playlist was updated, writing to database...");
-    // Log the playlist to the DB
-    try {
-      log_music_playlist_to_db();
-    } catch_exceptions;
-
-    // Done now:
+    const segment_playlist & playlist = run_data.current_segment->playlist;
+    vector<string> media;
+    for (long lngitem = 0; lngitem < playlist.size(); ++lngitem) {
+      media.push_back(playlist.media(lngitem));
+    }
+    // (Re)start writing with the current playlist:
+    m_worker.post([this, media](pg_connection &) {
+      m_playlist_log.media = media;
+      m_playlist_log.lngnext_item = 0;
+      m_playlist_log.blnactive = true;
+    });
     run_data.blnlog_all_music_to_db = false;
   }
+}
 
-  // Check for ads that have been missed (they were meant to play but it's been too long since the correct time.
-  write_errors_for_missed_promos();
-
-  // If the cached mp3 tags have changed, write them to disk now:
-  mp3tags.save_changes();
+void player::maintenance_operational_check([[maybe_unused]] const long lngcutoff_ms) {
+  // Log the result of the background mp3 tag scan, once it finishes:
+  long lngfiles, lngfailed;
+  if (m_mp3_tag_warmup.check_finished(lngfiles, lngfailed)) {
+    log_message("Background mp3 tag scan complete: " + ltostr(lngfiles) + " mp3s, " + ltostr(lngfailed) + " could not be read.");
+  }
 
   // Approximately every 30 seconds we update tblplayeroutput & tblliveinfo with the current
   // playback status:
   log_mp_status_to_db();
+
+  // Also write the fast-start snapshot, used if the player is restarted:
+  try {
+    save_snapshot();
+  } catch_exceptions;
 }
 
-void player::maintenance_player_running(const datetime dtmcutoff) {
+void player::maintenance_player_running(const long lngcutoff_ms) {
   // Display a line (once every minute) showing that the player is running...
   string strline = "Running... (";
   if (run_data.current_item.cat == SCAT_SILENCE) {
@@ -101,7 +116,7 @@ void player::maintenance_player_running(const datetime dtmcutoff) {
   // If the next playback event is more than an 24 hours in the future then don't
   // print it. Probably the end time is undefined (eg: silence, linein).
   {
-    long lngseconds_remaining = dtmcutoff - now();
+    long lngseconds_remaining = (lngcutoff_ms - monotonic_ms()) / 1000;
     if (lngseconds_remaining < 24*60*60) {
       // Time of the next playback event is approximate. It sometimes falls short by 1 second.
       strline += ". Next playback event: ~" + format_datetime(now() + lngseconds_remaining + 1, "%T") + " (" + itostr(lngseconds_remaining + 1) +"s)";
@@ -111,7 +126,7 @@ void player::maintenance_player_running(const datetime dtmcutoff) {
   log_line(strline);
 }
 
-void player::maintenance_hide_xmms_windows([[maybe_unused]] const datetime dtmcutoff) {
+void player::maintenance_hide_xmms_windows([[maybe_unused]] const long lngcutoff_ms) {
   // Hide all visible XMMS windows.
   for (int intsession=0; intsession < intmax_xmms; intsession++) {
     xmmsc::xmms[intsession].hide_windows();
@@ -119,28 +134,31 @@ void player::maintenance_hide_xmms_windows([[maybe_unused]] const datetime dtmcu
 }
 
 
-// Functions called by maintenance_operational_check:
-void player::log_music_playlist_to_db() {
-  // Log the contents of the current music playlist to the database
-  // - Check that the current segment is loaded and has a music category:
-  if (!run_data.current_segment->blnloaded) my_throw("Current Format Clock segment is not loaded!");
-  if (run_data.current_segment->cat.cat != SCAT_MUSIC) my_throw("Current Segment does not have a MUSIC category");
+// Called by the maintenance worker:
+bool player::log_music_playlist_to_db(pg_connection & db, const long lngcutoff_ms) {
+  // Log the next chunk of m_playlist_log to the database. Returns true once the whole playlist is logged.
+  // Rows are written with a temporary description, and only replace the logged playlist after the
+  // last chunk, so readers never see a half-written playlist.
+  const string strPlaylistDescr = "playlist";
+  const string strUpdatingDescr = "playlist (updating)";
 
   // Create a postgresql transaction. We're going to be doing a lot of updates:
   pg_transaction transaction(db);
 
-  const string strPlaylistDescr = "playlist";
-
-  // Remove all existing playlist records:
-  string strsql = "DELETE FROM tblplayeroutput WHERE strmsgdesc = " + psql_str(strPlaylistDescr);
-  transaction.exec(strsql);
-
-  // Now proceed through the playlist:
-  programming_element_list::const_iterator pe = run_data.current_segment->programming_elements.begin();
+  // Remove rows from an earlier attempt:
+  if (m_playlist_log.lngnext_item == 0) {
+    transaction.exec("DELETE FROM tblplayeroutput WHERE strmsgdesc = " + psql_str(strUpdatingDescr));
+  }
 
-  while (pe != run_data.current_segment->programming_elements.end()) {
+  // Now proceed through the playlist, until this chunk's time is up. Rows are inserted
+  // several at a time:
+  long lngchunk_end_ms = MIN(lngcutoff_ms, monotonic_ms() + intplaylist_log_chunk_ms);
+  long lngitem = m_playlist_log.lngnext_item;
+  string strvalues = "";
+  int introws = 0;
+  while (lngitem < (long)m_playlist_log.media.size() && monotonic_ms() < lngchunk_end_ms) {
     try {
-      string strfile = pe->strmedia;
+      string strfile = m_playlist_log.media[lngitem];
       string strtitle = mp3tags.get_mp3_description(strfile);
 
       string strlength = "N/A";
@@ -149,12 +167,83 @@ void player::log_music_playlist_to_db() {
       } catch(...) {}
 
       string strmessage = strfile + "||" + strtitle + "||" + strlength; ///< Goes into tblplayeroutput.strmessage
-      string strsql = "INSERT INTO tblplayeroutput (strmessage, strmsgdesc, dtmtime) VALUES (" + psql_str(strmessage) + ", " + psql_str(strPlaylistDescr) + ", now())";
-      transaction.exec(strsql);
+      strvalues += (strvalues == "" ? "" : ", ") + (string)"(" + psql_str(strmessage) + ", " + psql_str(strUpdatingDescr) + ", now())";
+      ++introws;
     } catch_exceptions;
-    pe++;
+    ++lngitem;
+
+    if (introws == intplaylist_log_rows_per_insert || lngitem == (long)m_playlist_log.media.size()) {
+      if (strvalues != "") transaction.exec("INSERT INTO tblplayeroutput (strmessage, strmsgdesc, dtmtime) VALUES " + strvalues);
+      strvalues = "";
+      introws = 0;
+    }
+  }
+  if (strvalues != "") transaction.exec("INSERT INTO tblplayeroutput (strmessage, strmsgdesc, dtmtime) VALUES " + strvalues);
+
+  // After the last chunk, replace the logged playlist:
+  bool blndone = lngitem >= (long)m_playlist_log.media.size();
+  if (blndone) {
+    transaction.exec("DELETE FROM tblplayeroutput WHERE strmsgdesc = " + psql_str(strPlaylistDescr));
+    transaction.exec("UPDATE tblplayeroutput SET strmsgdesc = " + psql_str(strPlaylistDescr) + " WHERE strmsgdesc = " + psql_str(strUpdatingDescr));
   }
 
   // No problems, so commit the database transaction:
   transaction.commit();
+  m_playlist_log.lngnext_item = lngitem;
+  if (blndone) {
+    m_playlist_log.blnactive = false;
+    m_playlist_log.media.clear();
+  }
+  return blndone;
+}
+
+void player::maintenance_check_file_changes([[maybe_unused]] const long lngcutoff_ms) {
+  // Fetch changes to the media directories, and invalidate cached details of the changed files.
+  // This is quick (no disk access), so it runs regardless of the cutoff.
+  vector<string> changed_paths;
+  bool blnwas_dirty = run_data.current_segment->blnplaylist_dirty;
+  if (!m_dir_watcher.poll(changed_paths)) {
+    // Events were lost, so we don't know what changed. Check everything:
+    log_warning("Lost track of changes to the media directories. All files will be checked again.");
+    start_dir_watches();
+    if (run_data.current_segment->blnloaded) run_data.current_segment->blnplaylist_dirty = true;
+    segment::music_beds.mark_stale();
+    m_segment_preloader.discard();
+  }
+
+  // New symlinks can add (or remove) other paths to watched directories:
+  if (m_dir_watcher.trees_changed()) mp3tags.set_watched_dirs(m_dir_watcher.watched_trees(), m_dir_watcher.aliases());
+
+  for (vector<string>::const_iterator it = changed_paths.begin(); it != changed_paths.end(); ++it) {
+    mp3tags.invalidate(*it);
+    run_data.current_segment->check_source_changed(*it);
+    segment::music_beds.check_source_changed(*it);
+    m_segment_preloader.check_source_changed(*it);
+  }
+
+  // The playlist is regenerated when the next item is fetched:
+  if (!blnwas_dirty && run_data.current_segment->blnplaylist_dirty) {
+    log_message("Files used by the current playlist have changed. It will be reloaded before the next item.");
+  }
+}
+
+void player::maintenance_preload_segment([[maybe_unused]] const long lngcutoff_ms) {
+  // Start loading the next format clock segment in the background, a few minutes before the current
+  // one ends. get_next_item_check_fc_seg_change() uses it if it still matches when the segment changes.
+  // Music profiles depend on the current time, so they aren't preloaded.
+  if (!config.blnformat_clocks_enabled) return;
+  const segment & current = *run_data.current_segment;
+  if (!current.blnloaded || current.dtmstart == datetime_error || current.intlength <= 0 || current.intlength > 24*60*60) return;
+
+  // When does the current segment end, and which part of the format clock comes next?
+  datetime dtmnext_segment_starts = current.dtmstart + current.intlength;
+  datetime dtmnext_delayed = current.scheduled.dtmend + 1;
+  if (now() < dtmnext_segment_starts - intsegment_preload_secs || now() >= dtmnext_segment_starts) return;
+  if (m_segment_preloader.preload_time() == dtmnext_delayed) return; // Already started
+
+  // Format clock media is filtered by the current date, so don't preload across midnight:
+  if (get_datetime_date(dtmnext_delayed) != date()) return;
+
+  log_message("Preloading the Format Clock segment scheduled at " + format_datetime(dtmnext_delayed, "%T") + " in the background");
+  m_segment_preloader.start(strdb_conn, dtmnext_delayed, find_fc_segment, config, mp3tags, m_music_history);
 }
@@ -24,9 +24,6 @@ void player::playback_transition(playback_events_info & playback_events) {
   // 3) Music bed ends
   // 4) Promo interrupts current playback.
 
-  struct timeval tvprev_now; // Used for checking if the system time moves backwards (eg: ntpdate)
-  gettimeofday(&tvprev_now, NULL);
-
   // Variable used to check if any upcoming events that need to be waited for & handled.
   int intnext_playback_safety_margin_ms = get_next_playback_safety_margin_ms();
 
@@ -40,8 +37,8 @@ void player::playback_transition(playback_events_info & playback_events) {
 
     // Our queue is based on the present point in time. If for example it takes 5 seconds to
     // setup the queue, then the logic will treat the queue as if it is 5 seconds late.
-    struct timeval tvqueue_start;
-    gettimeofday(&tvqueue_start, NULL);
+    // (Measured on the monotonic clock, so setting the system time doesn't move our events)
+    long lngqueue_start_ms = monotonic_ms();
 
     // Declare a list of events to be processed:
     transition_event_list events;
@@ -328,16 +325,10 @@ void player::playback_transition(playback_events_info & playback_events) {
           queue_event(events, "stop_current_item", intitem_ends_ms);
         }
 
-        // Sort the queue.
-        sort (events.begin(), events.end(), transition_event_less_than);
-
         // Add a "next becomes current" event which takes place, after all the other events:
         // - This releases the resources of the "current" item, and switches the "next" item over to
         //   the "current" item
-        {
-          transition_event last_event = events.back();
-          queue_event(events, "next_becomes_current", last_event.intrun_ms + 1);
-        }
+        queue_event(events, "next_becomes_current", events.latest_deadline() + 1);
       }
     }
 
@@ -347,56 +338,20 @@ void player::playback_transition(playback_events_info & playback_events) {
     int intvol_next    = 100;
 
     // Now we have our queue of things to do in the near future. Start a loop where we go through these
-    // things.
-    transition_event_list::const_iterator current_event = events.begin();
-    while (current_event != events.end()) {
-      // Fetch the current time:
-      timeval tvnow;
-      gettimeofday(&tvnow, NULL);
-
-      // Check that the previous recorded time is less than or equal to the current time:
-      if (tvnow.tv_sec < tvprev_now.tv_sec || (tvnow.tv_sec == tvprev_now.tv_sec && tvnow.tv_usec < tvprev_now.tv_usec)) {
-        testing_throw;
-        // System time has moved backwards! Possibly an ntpdate...
-        // Calculate how far back the time has moved back.
-        timeval tvdiff = tvprev_now;
-        tvdiff.tv_sec  -= tvnow.tv_sec;
-        tvdiff.tv_usec -= tvnow.tv_usec;
-        normalise_timeval(tvdiff);
-        log_warning("Detected: System clock moved back " + itostr(tvdiff.tv_sec) + " seconds and " + itostr(tvdiff.tv_usec) + " usecs. Optimistically adjusting playback timing back by this amount.");
-        tvqueue_start.tv_sec  -= tvdiff.tv_sec;
-        tvqueue_start.tv_usec -= tvdiff.tv_usec;
-      }
-      tvprev_now = tvnow; // Setup for the next check.
-
-      // Calculate when the next event is to be run:
-      timeval tvrun_event;
-      tvrun_event = tvqueue_start;
-      tvrun_event.tv_usec += current_event->intrun_ms * 1000;
-      normalise_timeval(tvrun_event);
-
-      // Calculate difference in usecs:
-      timeval tvdiff = tvrun_event;
-      tvdiff.tv_sec  -= tvnow.tv_sec;
-      tvdiff.tv_usec -= tvnow.tv_usec;
-      normalise_timeval(tvdiff);
-
-      long lngusec_diff = tvdiff.tv_sec * 1000000 + tvdiff.tv_usec;
-
-      // If the event is still coming, then wait for it:
-      if (lngusec_diff > 0) {
-        usleep(lngusec_diff);
-      }
+    // things, sleeping until each one is due.
+    while (!events.empty()) {
+      sleep_until_monotonic_ms(lngqueue_start_ms + events.next_deadline());
+      transition_event current_event = events.pop();
 
       // Now handle the event:
       {
-        log_debug("[" + itostr(current_event->intrun_ms) + "] " + current_event->strevent);
+        log_debug("[" + itostr(current_event.intrun_ms) + "] " + current_event.strevent);
         // Fetch the main command, and any argument from the event string:
         string strcmd = "";
         string strarg = "";
         {
           // Do the splitting here.
-          string_splitter event_split(current_event->strevent);
+          string_splitter event_split(current_event.strevent);
 
           // Check split result:
           if (event_split.size() < 1 || event_split.size() > 2) LOGIC_ERROR;
@@ -588,12 +543,7 @@ void player::playback_transition(playback_events_info & playback_events) {
   testing_throw;
               log_debug("Queuing any music bed events (for the next item), during the upcoming crossfade...");
               // Work out the current time in ms, compared to when the queue started:
-              timeval tvnow;
-              gettimeofday(&tvnow, NULL);
-              tvnow.tv_sec  -= tvqueue_start.tv_sec;
-              tvnow.tv_usec -= tvqueue_start.tv_usec;
-              normalise_timeval(tvnow);
-              int intnow_ms = tvnow.tv_sec * 1000 + tvnow.tv_usec / 1000; // How many ms since the queue started.
+              int intnow_ms = monotonic_ms() - lngqueue_start_ms; // How many ms since the queue started.
 
               // Queue a "next_music_bed_start" if it does start in the near future...
               if (run_data.next_item.music_bed.intstart_ms < intnext_becomes_current_ms) {
@@ -607,10 +557,7 @@ void player::playback_transition(playback_events_info & playback_events) {
                 queue_event(events, "next_music_bed_stop", intnow_ms + 2 + run_data.next_item.music_bed.intstart_ms + run_data.next_item.music_bed.intlength_ms);
               }
 
-              // Now sort the list of events:
-              sort(events.begin(), events.end(), transition_event_less_than);
-
-              testing_throw; // Check if we are at the same position in the queue as before!
+              testing_throw; // Check that the new events run in the right order
             }
           }
         }
@@ -639,7 +586,7 @@ void player::playback_transition(playback_events_info & playback_events) {
 
             // Also update the music history if the next item is a music item:
             if (run_data.next_item.cat == SCAT_MUSIC) {
-              m_music_history.song_played(db, run_data.next_item.strmedia, mp3tags.get_mp3_description(run_data.next_item.strmedia));
+              m_music_history.song_played(db, run_data.next_item.strmedia, mp3tags.get_mp3_description(run_data.next_item.strmedia), mp3tags);
             }
           }
 
@@ -774,8 +721,6 @@ void player::playback_transition(playback_events_info & playback_events) {
         }
         else my_throw("Unknown playback transition command! \"" + strcmd + "\"");
       }
-      // Now go to the next event.
-      ++current_event;
     }
 
     // Done with the transitions. Look for any other upcoming events during playback of the current item:
@@ -795,7 +740,7 @@ void player::queue_event(transition_event_list & events, const string & strevent
   event.strevent  = strevent;
 
   // Add it to the queue:
-  events.push_back(event);
+  events.push(intwhen_ms, event);
 }
 
 void player::queue_volslide(transition_event_list & events, const string & strwhich_item, const int intfrom_vol_percent, const int intto_vol_percent, const int intwhen_ms, const int intlength_ms) {
@@ -0,0 +1,194 @@
+
+#include "player.h"
+#include "common/binary_file.h"
+#include "common/exception.h"
+#include "common/file.h"
+#include "common/my_string.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+// The fast-start snapshot lets the player resume quickly after a restart (eg,
+// by the watchdog), without reloading the music history from the database and
+// without regenerating the current segment's playlist.
+
+// Written at the start of the file, and bumped when the layout changes:
+static const string strsnapshot_magic = "RR_PLAYER_SNAPSHOT";
+static const long lngsnapshot_version = 5;
+
+// Helper functions for programming element lists:
+static void save_pel_snapshot(ostream & out, const programming_element_list & pel) {
+  write_bin_long(out, pel.size());
+  for (programming_element_list::const_iterator it = pel.begin(); it != pel.end(); ++it) {
+    it->save_snapshot(out);
+  }
+}
+
+static void load_pel_snapshot(istream & in, programming_element_list & pel) {
+  pel.clear();
+  long lngcount = read_bin_long(in);
+  if (lngcount < 0) my_throw("Invalid list length in snapshot: " + ltostr(lngcount));
+  for (long i = 0; i < lngcount; ++i) {
+    programming_element pe;
+    pe.load_snapshot(in);
+    pel.push_back(pe);
+  }
+}
+
+void player::save_snapshot() {
+  // Write the current music history & playback state to the snapshot file.
+  // We write to a temporary file first, so that a crash while writing doesn't
+  // leave a half-written snapshot behind.
+  string strtmp_file = PLAYER_SNAPSHOT_FILE + ".tmp";
+  {
+    ofstream out(strtmp_file.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out) my_throw("Could not open " + strtmp_file + " for writing.");
+
+    write_bin_string(out, strsnapshot_magic);
+    write_bin_long(out, lngsnapshot_version);
+    write_bin_long(out, now());
+
+    // Music history:
+    m_music_history.save_snapshot(out);
+
+    // The current segment, if there is one:
+    bool blnsegment = run_data.current_segment.get() != NULL && run_data.current_segment->blnloaded;
+    write_bin_bool(out, blnsegment);
+    if (blnsegment) run_data.current_segment->save_snapshot(out);
+    prev_music_seg_pel.save_snapshot(out);
+
+    // Music beds, so their rotation carries on where it left off:
+    segment::music_beds.save_snapshot(out);
+
+    // Promos & segment timing:
+    save_pel_snapshot(out, run_data.waiting_promos);
+    write_bin_long(out, run_data.intsegment_delay);
+    write_bin_long(out, run_data.dtmlast_promo_batch_item_played);
+
+    // Marks the snapshot as complete:
+    write_bin_string(out, strsnapshot_magic);
+
+    out.close();
+    if (!out) my_throw("Error while writing " + strtmp_file);
+  }
+  CHECK_LIBC(rename(strtmp_file.c_str(), PLAYER_SNAPSHOT_FILE.c_str()), "Rename " + strtmp_file + " to " + PLAYER_SNAPSHOT_FILE);
+}
+
+bool player::load_snapshot() {
+  // Load the music history from a fresh snapshot, and keep the playback
+  // state for restore_snapshot_playback(). Returns false if there is no
+  // usable snapshot, in which case the caller loads everything from the database.
+  snapshot.blnloaded = false;
+  if (!file_exists(PLAYER_SNAPSHOT_FILE)) return false;
+
+  try {
+    ifstream in(PLAYER_SNAPSHOT_FILE.c_str(), ios::in | ios::binary);
+    if (!in) my_throw("Unable to open " + PLAYER_SNAPSHOT_FILE);
+
+    if (read_bin_string(in) != strsnapshot_magic) my_throw("Not a player snapshot: " + PLAYER_SNAPSHOT_FILE);
+    long lngversion = read_bin_long(in);
+    if (lngversion != lngsnapshot_version) {
+      log_message("Ignoring player snapshot with version " + ltostr(lngversion) + " (expected " + ltostr(lngsnapshot_version) + ")");
+      return false;
+    }
+
+    // Is the snapshot fresh enough to use?
+    datetime dtmsaved = read_bin_long(in);
+    if (dtmsaved > now() || now() - dtmsaved > intsnapshot_max_age) {
+      log_message("Player snapshot from " + format_datetime(dtmsaved, "%F %T") + " is stale, not using it.");
+      return false;
+    }
+
+    // Load everything into temporary objects first, so a corrupt snapshot
+    // doesn't leave us half-restored:
+    music_history history;
+    history.load_snapshot(in);
+
+    ap_segment seg;
+    if (read_bin_bool(in)) {
+      seg = ap_segment(new segment);
+      seg->load_snapshot(in);
+    }
+    segment_playlist prev_music_pel;
+    prev_music_pel.load_snapshot(in);
+    music_bed_pool music_beds;
+    music_beds.load_snapshot(in);
+
+    programming_element_list waiting_promos;
+    load_pel_snapshot(in, waiting_promos);
+    int intsegment_delay = read_bin_int(in);
+    datetime dtmlast_promo_batch_item_played = read_bin_long(in);
+
+    if (read_bin_string(in) != strsnapshot_magic) my_throw("Player snapshot is incomplete: " + PLAYER_SNAPSHOT_FILE);
+
+    // The snapshot was read successfully. Use it:
+    m_music_history = history;
+    snapshot.segment = std::move(seg);
+    snapshot.prev_music_seg_pel = prev_music_pel;
+    segment::music_beds.swap(music_beds);
+    snapshot.waiting_promos = waiting_promos;
+    snapshot.intsegment_delay = intsegment_delay;
+    snapshot.dtmlast_promo_batch_item_played = dtmlast_promo_batch_item_played;
+    snapshot.blnloaded = true;
+
+    log_message("Loaded player snapshot from " + format_datetime(dtmsaved, "%F %T"));
+
+    // Songs may have played after the snapshot was written:
+    m_music_history.load_played_since(db, dtmsaved, mp3tags);
+    return true;
+  } catch_exceptions;
+
+  log_warning("Could not load the player snapshot. Falling back to the database.");
+  m_music_history.clear();
+  return false;
+}
+
+void player::restore_snapshot_playback() {
+  // Move the playback state loaded by load_snapshot() into run_data. Called
+  // after playback has been reset at startup.
+  if (!snapshot.blnloaded) return;
+  snapshot.blnloaded = false;
+
+  if (snapshot.segment.get() != NULL) {
+    log_message("Resuming segment " + ltostr(snapshot.segment->lngfc_seg) + " from the player snapshot");
+    run_data.current_segment = std::move(snapshot.segment);
+  }
+  prev_music_seg_pel = snapshot.prev_music_seg_pel;
+  run_data.intsegment_delay = snapshot.intsegment_delay;
+  run_data.dtmlast_promo_batch_item_played = snapshot.dtmlast_promo_batch_item_played;
+
+  // Waiting promos were reset to "SNS loaded" by correct_waiting_promos() during
+  // init. Mark them as listed to play again, and keep only those which haven't
+  // been played (or deleted, etc) in the meantime:
+  run_data.waiting_promos.clear();
+  if (!snapshot.waiting_promos.empty()) {
+    string strslots = "";
+    for (programming_element_list::const_iterator it = snapshot.waiting_promos.begin(); it != snapshot.waiting_promos.end(); ++it) {
+      if (it->promo.lngtz_slot == -1) continue;
+      if (strslots != "") strslots += ",";
+      strslots += ltostr(it->promo.lngtz_slot);
+    }
+
+    if (strslots != "") {
+      ap_pg_result rs = db.exec("UPDATE tblSchedule_TZ_Slot SET bitScheduled = " + itostr(ADVERT_LISTED_TO_PLAY) +
+                                " WHERE lngTZ_Slot IN (" + strslots + ") AND bitScheduled = " + itostr(ADVERT_SNS_LOADED) +
+                                " RETURNING lngTZ_Slot");
+      vector<long> slots;
+      while (*rs) {
+        slots.push_back(strtol(rs->field("lngTZ_Slot")));
+        (*rs)++;
+      }
+
+      for (programming_element_list::const_iterator it = snapshot.waiting_promos.begin(); it != snapshot.waiting_promos.end(); ++it) {
+        if (find(slots.begin(), slots.end(), it->promo.lngtz_slot) != slots.end()) {
+          run_data.waiting_promos.push_back(*it);
+        }
+      }
+      log_message("Resumed " + itostr(run_data.waiting_promos.size()) + " of " + itostr(snapshot.waiting_promos.size()) + " waiting promo(s) from the player snapshot");
+    }
+  }
+
+  // Done with the snapshot data:
+  snapshot.prev_music_seg_pel.clear();
+  snapshot.waiting_promos.clear();
+}
@@ -0,0 +1,78 @@
+
+#include "playlist_source_cache.h"
+#include <sys/stat.h>
+
+using namespace std;
+
+playlist_source_cache::playlist_source_cache(const unsigned int intmax_entries, const int intmax_age) : m_intmax_entries(intmax_entries), m_intmax_age(intmax_age), m_lngcounter(0) {
+}
+
+void playlist_source_cache::get_stamp(const string & strpath, source_stamp & stamp) {
+  struct stat st;
+  set_stamp(strpath, stat(strpath.c_str(), &st) == 0 ? &st : NULL, stamp);
+}
+
+void playlist_source_cache::set_stamp(const string & strpath, const struct stat * st, source_stamp & stamp) {
+  stamp.strpath = strpath;
+  stamp.blnexists = st != NULL;
+  stamp.lngmtime_sec  = stamp.blnexists ? st->st_mtim.tv_sec : 0;
+  stamp.lngmtime_nsec = stamp.blnexists ? st->st_mtim.tv_nsec : 0;
+  stamp.lngsize       = stamp.blnexists ? st->st_size : 0;
+  stamp.dtmtaken = now();
+}
+
+bool playlist_source_cache::find(const string & strkey, vector<string> & file_list, vector<source_stamp> & sources) {
+  lock_guard<mutex> lock(m_mutex);
+  map<string, entry>::iterator it = m_entries.find(strkey);
+  if (it == m_entries.end()) return false;
+  if (now() - it->second.dtmstored > m_intmax_age) {
+    m_entries.erase(it);
+    return false;
+  }
+
+  // Check that none of the sources changed:
+  for (vector<source_stamp>::const_iterator source = it->second.sources.begin(); source != it->second.sources.end(); ++source) {
+    source_stamp stamp;
+    get_stamp(source->strpath, stamp);
+    if (stamp.blnexists != source->blnexists || stamp.lngmtime_sec != source->lngmtime_sec ||
+        stamp.lngmtime_nsec != source->lngmtime_nsec || stamp.lngsize != source->lngsize) {
+      m_entries.erase(it);
+      return false;
+    }
+  }
+
+  it->second.lnglast_used = ++m_lngcounter;
+  file_list = it->second.file_list;
+  sources = it->second.sources;
+  return true;
+}
+
+void playlist_source_cache::store(const string & strkey, const vector<string> & file_list, const vector<source_stamp> & sources) {
+  entry new_entry;
+  new_entry.file_list = file_list;
+  new_entry.dtmstored = now();
+  new_entry.sources = sources;
+  for (vector<source_stamp>::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+    // A source modified within a second of its stamp could have changed again after the stamp
+    // was taken, without its modification time changing, so don't trust the result:
+    if (it->blnexists && it->lngmtime_sec >= it->dtmtaken - 1) return;
+  }
+
+  lock_guard<mutex> lock(m_mutex);
+  new_entry.lnglast_used = ++m_lngcounter;
+  m_entries[strkey] = new_entry;
+
+  // Drop the least-recently used result if there are too many:
+  if (m_entries.size() > m_intmax_entries) {
+    map<string, entry>::iterator oldest = m_entries.begin();
+    for (map<string, entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+      if (it->second.lnglast_used < oldest->second.lnglast_used) oldest = it;
+    }
+    m_entries.erase(oldest);
+  }
+}
+
+void playlist_source_cache::clear() {
+  lock_guard<mutex> lock(m_mutex);
+  m_entries.clear();
+}
@@ -0,0 +1,63 @@
+
+#ifndef PLAYLIST_SOURCE_CACHE_H
+#define PLAYLIST_SOURCE_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "common/my_time.h"
+
+struct stat;
+
+/// Remembers how playlist sources (directories, M3U files, etc) were resolved into lists of
+/// files, so that segments which use the same source again don't need to re-list directories,
+/// re-read M3U files and re-query the database.
+///
+/// Each result remembers the modification times of the directories & files it was resolved
+/// from, taken before they were read, and is only re-used if none of them changed. Results also depend on the database (eg:
+/// format clock media), so callers should clear() the cache when they know the database changed
+/// (eg: after an RPLS), and results expire after intmax_age seconds in case they didn't.
+///
+/// The cache is thread-safe.
+class playlist_source_cache {
+public:
+  playlist_source_cache(const unsigned int intmax_entries = 16, const int intmax_age = 30*60); ///< Constructor. The least-recently used results are dropped beyond intmax_entries.
+
+  /// A source, and its details when it was about to be read. If they are the same later, then
+  /// the source hasn't changed since.
+  struct source_stamp {
+    std::string strpath;
+    bool blnexists;
+    long lngmtime_sec, lngmtime_nsec;
+    long lngsize;
+    datetime dtmtaken; ///< When the details were fetched
+  };
+  static void get_stamp(const std::string & strpath, source_stamp & stamp); ///< Fetch a source's current details
+  static void set_stamp(const std::string & strpath, const struct stat * st, source_stamp & stamp); ///< Details from a stat() result (NULL if the stat failed)
+
+  /// Fetch a cached result. Returns false if there isn't one, or if its sources changed.
+  bool find(const std::string & strkey, std::vector<std::string> & file_list, std::vector<source_stamp> & sources);
+
+  /// Remember a result, and the directories & files (sources) it was resolved from. The stamps
+  /// must be taken before the sources were read, or changes made meanwhile would be missed.
+  void store(const std::string & strkey, const std::vector<std::string> & file_list, const std::vector<source_stamp> & sources);
+
+  void clear(); ///< Forget all results
+
+private:
+  struct entry {
+    std::vector<std::string> file_list;
+    std::vector<source_stamp> sources;
+    unsigned long lnglast_used; ///< For dropping the least-recently used results
+    datetime dtmstored;         ///< When the result was stored
+  };
+
+  std::mutex m_mutex;
+  std::map<std::string, entry> m_entries;
+  unsigned int m_intmax_entries;
+  int m_intmax_age;
+  unsigned long m_lngcounter; ///< Incremented on each use
+};
+
+#endif
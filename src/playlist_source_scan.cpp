@@ -0,0 +1,190 @@
+
+#include "playlist_source_scan.h"
+#include "common/file.h"
+#include "common/my_string.h"
+#include "common/rr_misc.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
+#include <mutex>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+
+using namespace std;
+
+// Sort names the same way as dir_list (scandir with alphasort):
+static bool name_less_than(const string & a, const string & b) {
+  return strcoll(a.c_str(), b.c_str()) < 0;
+}
+
+static bool is_m3u(const string & strname) {
+  return lcase(get_file_ext(strname)) == "m3u";
+}
+
+// Set up a node, before it is scanned:
+static void init_node(source_node & node, const string & strpath, const int intrecursion_level) {
+  node.type = source_node::SN_MISSING;
+  node.strpath = strpath;
+  node.intrecursion_level = intrecursion_level;
+  node.blnopened = false;
+  playlist_source_cache::set_stamp(strpath, NULL, node.stamp);
+}
+
+// List a directory in a single pass, keeping the regular files (and symlinks to them):
+static void scan_directory(source_node & node) {
+  string strdir = ensure_last_char(node.strpath, '/');
+  string strabs_dir = ensure_last_char(relpath_to_abs(strdir, PATH_IS_DIR), '/');
+  DIR * dir = opendir(strabs_dir.c_str());
+  if (dir == NULL) return;
+  struct dirent * entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+    bool blnregular = entry->d_type == DT_REG;
+    if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      blnregular = stat((strabs_dir + entry->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+    if (blnregular) node.names.push_back(entry->d_name);
+  }
+  closedir(dir);
+  sort(node.names.begin(), node.names.end(), name_less_than);
+
+  // M3U files inside are followed if the recursion level allows:
+  if (node.intrecursion_level > 0) {
+    long lngm3us = count_if(node.names.begin(), node.names.end(), is_m3u);
+    node.children.resize(lngm3us);
+    long lngchild = 0;
+    for (vector<string>::const_iterator it = node.names.begin(); it != node.names.end(); ++it) {
+      if (is_m3u(*it)) init_node(node.children[lngchild++], strdir + *it, node.intrecursion_level - 1);
+    }
+  }
+}
+
+// Read the entries of an M3U file:
+static void scan_m3u(source_node & node) {
+  ifstream m3u_file(node.strpath.c_str());
+  if (!m3u_file) return;
+  node.blnopened = true;
+  vector<string> lines;
+  string strline;
+  while (getline(m3u_file, strline)) {
+    // Skip empty lines and lines beginning with #:
+    if (strline != "" && strline[0] != '#') lines.push_back(strline);
+  }
+  node.children.resize(lines.size());
+  for (vector<string>::size_type i = 0; i < lines.size(); ++i) {
+    init_node(node.children[i], lines[i], node.intrecursion_level - 1);
+  }
+}
+
+// Scan a single node. Its children are set up, but not scanned.
+static void scan_node(source_node & node) {
+  const string & strpath = node.strpath;
+  if (lcase(strpath) == "linein" || strpath == "/dev/cdrom" || strpath == "MusicProfile" || file_is_cd_track(strpath)) {
+    node.type = source_node::SN_SPECIAL;
+    return;
+  }
+
+  // The stamp comes from the same stat, before anything is read, so that a change made while the
+  // source is being read is noticed later:
+  struct stat st;
+  bool blnexists = stat(relpath_to_abs(strpath, PATH_IS_FILE).c_str(), &st) == 0;
+  playlist_source_cache::set_stamp(blnexists && S_ISDIR(st.st_mode) ? ensure_last_char(strpath, '/') : strpath, blnexists ? &st : NULL, node.stamp);
+  if (!blnexists) {
+    node.type = source_node::SN_MISSING;
+  }
+  else if (S_ISDIR(st.st_mode)) {
+    node.type = source_node::SN_DIRECTORY;
+    scan_directory(node);
+  }
+  else if (S_ISREG(st.st_mode)) {
+    node.type = source_node::SN_FILE;
+    if (lcase(right(strpath, 4)) == ".m3u" && node.intrecursion_level > 0) scan_m3u(node);
+  }
+}
+
+// Scan a node on a worker thread. Errors can't be logged from there, so the source is treated as missing:
+static void scan_node_safe(source_node & node) {
+  try {
+    scan_node(node);
+  } catch(...) {
+    node.type = source_node::SN_MISSING;
+    node.names.clear();
+    node.children.clear();
+  }
+}
+
+// Threads take nodes from a shared queue, scan them, and queue their children. The children
+// of a node are allocated before they are queued, so the tree's shape (and order) doesn't
+// depend on which thread scans what.
+namespace {
+class scan_pool {
+public:
+  scan_pool() : m_lngpending(0) {}
+
+  void add(source_node * node) {
+    lock_guard<mutex> lock(m_mutex);
+    m_queue.push_back(node);
+    ++m_lngpending;
+    m_cv.notify_one();
+  }
+
+  void run() {
+    while (true) {
+      source_node * node;
+      {
+        unique_lock<mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return !m_queue.empty() || m_lngpending == 0; });
+        if (m_queue.empty()) return; // Everything was scanned
+        // Newest first, so that each thread tends to finish the branch it's working on:
+        node = m_queue.back();
+        m_queue.pop_back();
+      }
+
+      scan_node_safe(*node);
+      for (vector<source_node>::iterator it = node->children.begin(); it != node->children.end(); ++it) {
+        add(&*it);
+      }
+
+      lock_guard<mutex> lock(m_mutex);
+      if (--m_lngpending == 0) m_cv.notify_all();
+    }
+  }
+
+private:
+  mutex m_mutex;
+  condition_variable m_cv;
+  deque<source_node *> m_queue; ///< Nodes waiting to be scanned
+  long m_lngpending;            ///< Nodes queued or being scanned
+};
+}
+
+void scan_playlist_source(source_node & root, const string & strsource, const int intrecursion_level, const int intmax_threads) {
+  init_node(root, strsource, intrecursion_level);
+  scan_node_safe(root);
+  if (root.children.empty()) return; // Eg: a single mp3, or a directory without M3Us. No threads needed.
+
+  scan_pool pool;
+  for (vector<source_node>::iterator it = root.children.begin(); it != root.children.end(); ++it) {
+    pool.add(&*it);
+  }
+
+  // The calling thread works too:
+  int intthreads = thread::hardware_concurrency();
+  if (intthreads <= 0 || intthreads > intmax_threads) intthreads = intmax_threads;
+  vector<thread> helpers;
+  try {
+    for (int i = 1; i < intthreads; ++i) {
+      helpers.push_back(thread(&scan_pool::run, &pool));
+    }
+  } catch(...) {
+    // Couldn't start a thread. Carry on with the ones we have.
+  }
+  pool.run();
+  for (vector<thread>::iterator it = helpers.begin(); it != helpers.end(); ++it) {
+    it->join();
+  }
+}
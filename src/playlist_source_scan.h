@@ -0,0 +1,34 @@
+
+#ifndef PLAYLIST_SOURCE_SCAN_H
+#define PLAYLIST_SOURCE_SCAN_H
+
+#include <string>
+#include <vector>
+#include "playlist_source_cache.h"
+
+/// What the filesystem says about a playlist source, and everything it leads to (directories
+/// contain M3U files, M3U files list directories & mp3s, etc).
+///
+/// Scanning only touches the filesystem, so independent parts of the tree are scanned by a
+/// small pool of threads. Database checks (eg: format clock media) and logging are done
+/// afterwards on the calling thread, by segment::recursive_add_to_string_list(), which walks
+/// the tree in order, so the resulting playlist is the same as a sequential scan's.
+struct source_node {
+  enum node_type {
+    SN_SPECIAL,   ///< LineIn, the CD-ROM, a CD track or a music profile. Not scanned.
+    SN_DIRECTORY,
+    SN_FILE,
+    SN_MISSING
+  } type;
+  std::string strpath;     ///< The source
+  playlist_source_cache::source_stamp stamp; ///< The source's details, taken before it was read. Directories are stamped with a trailing slash.
+  int intrecursion_level;  ///< How many more levels of directories & M3U files may be followed
+  std::vector<std::string> names; ///< Directories: names of the regular files directly inside, sorted like dir_list
+  bool blnopened;          ///< M3U files: was the file read?
+  std::vector<source_node> children; ///< Directories: the M3U files inside (in order). M3U files: their entries (in order).
+};
+
+/// Scan a playlist source (see source_node) using up to intmax_threads threads.
+void scan_playlist_source(source_node & root, const std::string & strsource, const int intrecursion_level, const int intmax_threads = 4);
+
+#endif
@@ -1,5 +1,6 @@
 
 #include "programming_element.h"
+#include "common/binary_file.h"
 #include "common/file.h"
 #include "common/logging.h"
 #include "common/my_string.h"
@@ -99,5 +100,41 @@ void programming_element::load_media_info(pg_conn_exec & db) {
   }
 }
 
-// A global variable containing the previous music segment's programming element list
-programming_element_list prev_music_seg_pel;
+// Write this element to a binary player snapshot
+void programming_element::save_snapshot(ostream & out) const {
+  write_bin_bool(out, blnloaded);
+  write_bin_long(out, cat);
+  write_bin_string(out, strmedia);
+  write_bin_string(out, strvol);
+  write_bin_long(out, dtmstarted);
+  write_bin_bool(out, blnmusic_bed);
+  write_bin_string(out, music_bed.strmedia);
+  write_bin_string(out, music_bed.strvol);
+  write_bin_long(out, music_bed.intstart_ms);
+  write_bin_long(out, music_bed.intlength_ms);
+  write_bin_bool(out, music_bed.already_handled.blnstart);
+  write_bin_bool(out, music_bed.already_handled.blnstop);
+  write_bin_long(out, promo.lngtz_slot);
+  write_bin_bool(out, promo.blnforced_time);
+  // Media info is not saved. It gets re-loaded from the database when the
+  // item is fetched from the segment.
+}
+
+// Read this element from a binary player snapshot
+void programming_element::load_snapshot(istream & in) {
+  reset();
+  blnloaded = read_bin_bool(in);
+  cat       = (seg_category) read_bin_int(in);
+  strmedia  = read_bin_string(in);
+  strvol    = read_bin_string(in);
+  dtmstarted = read_bin_long(in);
+  blnmusic_bed = read_bin_bool(in);
+  music_bed.strmedia     = read_bin_string(in);
+  music_bed.strvol       = read_bin_string(in);
+  music_bed.intstart_ms  = read_bin_int(in);
+  music_bed.intlength_ms = read_bin_int(in);
+  music_bed.already_handled.blnstart = read_bin_bool(in);
+  music_bed.already_handled.blnstop  = read_bin_bool(in);
+  promo.lngtz_slot     = read_bin_long(in);
+  promo.blnforced_time = read_bin_bool(in);
+}
@@ -3,6 +3,7 @@
 #define PROGRAMMING_ELEMENT_H
 
 #include <deque>
+#include <iostream>
 #include <map>
 #include <string>
 #include "categories.h"
@@ -84,12 +85,13 @@ public:
                             // soft.
   } media_info;
   void load_media_info(pg_conn_exec & db);
+
+  // Write this element to, or read it from, a binary player snapshot:
+  void save_snapshot(ostream & out) const;
+  void load_snapshot(istream & in);
 };
 
 /// A list of programming elements (eg: an announcement batch)
 typedef deque <programming_element> programming_element_list;
 
-/// A global variable containing the previous music segment's programming element list
-extern programming_element_list prev_music_seg_pel;
-
 #endif
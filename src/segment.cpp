@@ -1,25 +1,33 @@
 
 #include "segment.h"
+#include "artist_scheduler.h"
 #include "music_history.h"
 #include "player_constants.h"
 #include "player_util.h"
 #include "programming_element.h"
-#include "common/dir_list.h"
+#include "common/binary_file.h"
 #include "common/exception.h"
 #include "common/file.h"
 #include "common/my_string.h"
 #include "common/psql.h"
 #include "common/rr_misc.h"
-#include "common/string_splitter.h"
+#include "common/shuffle.h"
+#include "common/string_pool.h"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <linux/cdrom.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <tr1/unordered_map>
 #include <tr1/unordered_set>
 
 using namespace std;
 
+playlist_source_cache segment::source_cache;
+music_bed_pool segment::music_beds;
+disabled_track_set segment::disabled_tracks;
+
 // Constructor
 segment::segment() {
   reset();
@@ -90,13 +98,20 @@ void segment::reset() {
   dtmstart = datetime_error; // Gets set when the first item from the segment is about to start playing.
 
   // Information used to retrieve the "next" item:
-  programming_elements.clear();
-  next_item = programming_elements.begin();
+  playlist.clear();
+  lngnext_item = 0;
+  clear_artist_counts();
   intnum_fetched = 0;
   intnum_played = 0;
 
   // Programming element list was updated in this function
   dtmpel_updated = now();
+
+  // Files used to generate the playlist:
+  playlist_sources.clear();
+  playlist_source_log.clear();
+  intuncacheable_sources = 0;
+  blnplaylist_dirty = false;
 }
 
 void segment::load_from_db(pg_connection & db, const long lngfc_seg_arg, const datetime dtmtime, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory) {
@@ -112,14 +127,16 @@ void segment::load_from_db(pg_connection & db, const long lngfc_seg_arg, const d
     // If the specified segment is -1, then setup a regular music profile (don't load format clocks):
     if (lngfc_seg == -1) {
       log_message("Setting up music profile...");
-      load_music_profile(db, config, mp3tags, musichistory);
-      playback_state = PBS_MUSIC_PROFILE;
 
-      // Populate scheduled from & to fields.
+      // Populate scheduled from & to fields (before the playlist is generated, its shuffle seed
+      // depends on the start time).
       // - From now, until the end of this hour. We want to check for a new music profile at the start
       //   of the next hour
       scheduled.dtmstart = dtmtime; // Immediately
       scheduled.dtmend   = dtmtime - (dtmtime % (60*60)) + (60*60) - 1; // End of this hour
+
+      load_music_profile(db, config, mp3tags, musichistory);
+      playback_state = PBS_MUSIC_PROFILE;
     }
     else {
       // Not -1, so load segment details from the database:
@@ -222,7 +239,7 @@ void segment::load_from_db(pg_connection & db, const long lngfc_seg_arg, const d
       {
         bool blnsuccess = false; // Set to true if we successfully load the list:
         try {
-          programming_element_list pel;
+          segment_playlist pel;
           load_pe_list(pel, cat, sub_cat, db, config, mp3tags, musichistory);
           set_pel(pel);
           blnsuccess = true; // The above succeeded.
@@ -309,7 +326,7 @@ void segment::load_music_profile(pg_conn_exec & db, const player_config & config
   blnmusic_bed   = false; // Music profiles don't have underlying music.
 
   // Load the current music profile into the list of programming elements:
-  programming_element_list pel;
+  segment_playlist pel;
   generate_playlist(pel, "MusicProfile", SCAT_MUSIC, db, config, mp3tags, musichistory, true); // Also shuffles the list
   set_pel(pel);
 
@@ -332,12 +349,13 @@ void segment::get_next_item(programming_element & pe, pg_conn_exec & db, [[maybe
   }
   else {
     // Are we at the end of the current list?
-    if (next_item == programming_elements.end()) {
+    if (lngnext_item >= playlist.size()) {
       // Yes. Does the segment allow repeating?
       if (blnrepeat) {
         // Yes. Go back to the beginning of the list.
         log_message("Ran out of media, going back to the beginning of the playlist");
-        next_item = programming_elements.begin();
+        lngnext_item = 0;
+        reset_artist_counts(0);
       }
       else {
         // Repeating not allowed. Revert to the alternate category.
@@ -349,28 +367,32 @@ void segment::get_next_item(programming_element & pe, pg_conn_exec & db, [[maybe
   }
 
   // Check: Do we have a "next" item to return?
-  if (next_item == programming_elements.end()) LOGIC_ERROR; // This should never happen...
+  if (lngnext_item >= playlist.size()) LOGIC_ERROR; // This should never happen...
+
+  // Prepare to return the next item:
+  playlist.get_item(lngnext_item, pe);
+  if (pe.blnmusic_bed) {
+    pe.music_bed.strmedia = music_beds.next(db, music_bed.strsub_cat);
+  }
 
   // Enable playlist repetition if the item is LineIn or Silence:
   // (This is so we don't hit problems while checking for the next item while
   // silence or LineIn are playing)
   if (!blnrepeat &&
-     (next_item->strmedia == "LineIn" || next_item->cat == SCAT_SILENCE)) {
+     (pe.strmedia == "LineIn" || pe.cat == SCAT_SILENCE)) {
     log_warning("Segment was scheduled as not allowing playlist repetition, but the next item is LineIn or Silence! Overriding setting and allowing playlist repetition.");
     blnrepeat = true;
   }
 
-  // Prepare to return the next item:
-  pe = *next_item;
-
   // If it is a song then load additional additional media info from the
   // database (tblinstore_media). of available:
   if (pe.cat == SCAT_MUSIC) {
     pe.load_media_info(db);
   }
 
-  // Advance the 'next item' pointer
-  ++next_item;
+  // Advance the 'next item' pointer (and the item's artist no longer remains)
+  if (blnartist_counts && --artist_remaining[item_artists[lngnext_item]] == 0) --lngremaining_artists;
+  ++lngnext_item;
 
   // Record that 1 more item has been fetched.
   ++intnum_fetched; // Next time we will advance to the next item.
@@ -391,11 +413,8 @@ bool segment::get_next_item_will_revert(string & strreason) {
     return true;
   }
   else {
-    // Check if the next item is at the end of the list:
-    programming_element_list::iterator test_next_item = next_item;
-
     // We will revert if at the end of the list and repetition is not enabled:
-    if (test_next_item == programming_elements.end() && !blnrepeat) {
+    if (lngnext_item >= playlist.size() && !blnrepeat) {
       strreason = "run out of items and repeating is not allowed";
       return true;
     }
@@ -407,42 +426,77 @@ bool segment::get_next_item_will_revert(string & strreason) {
 
 int segment::count_items_from_catagory(const seg_category cat) {
   // How many items in the segment playlist are from the specified catagory?
-  int count = 0; // Count of matching items
-  programming_element_list::const_iterator i = programming_elements.begin();
-  while (i != programming_elements.end()) {
-    if (i->cat == cat)
-      count++;
-    i++;
-  }
-  return count;
+  // (All of the playlist's items have the same category)
+  return playlist.cat() == cat ? playlist.size() : 0;
 }
 
 int segment::count_remaining_playlist_artists(mp3_tags & mp3tags) {
     // How many unique artists remain in the playlist?
     // (Also take looping segments into account)
 
-    // Initialise playlist iterator
-    programming_element_list::iterator it;
+    // The counts are built the first time they are needed for a playlist, and then kept
+    // up to date by get_next_item() as the playlist position moves:
+    if (!blnartist_counts) {
+        build_artist_counts(mp3tags);
+    }
+
     // Is the playlist allowed to repeat?
     if (blnrepeat) {
-        // Playlist can repeat. Start checking from the start
-        it = programming_elements.begin();
+        // Playlist can repeat. Count all of the artists
+        return artist_totals.size();
     }
     else {
-        // Playlist cannot repeat. Start checking from the next item
-        it = next_item;
+        // Playlist cannot repeat. Count artists from the next item onwards
+        return lngremaining_artists;
     }
+}
 
-    // Build a set of unique artists:
-    tr1::unordered_set <string> artists;
-    while (it != programming_elements.end()) {
-        string artist = lcase(trim(mp3tags.get_mp3_artist(it->strmedia)));
-        artists.insert(artist);
-        ++it;
+void segment::build_artist_counts(mp3_tags & mp3tags) {
+    // Find the (trimmed, lower-case) artist of each playlist item, and count the items by
+    // each artist. Artist names are only normalised once per artist id.
+    vector<uint32_t> artists(playlist.size());
+    vector<long> totals;
+    tr1::unordered_map<unsigned int, uint32_t> normalised; // mp3tags artist id -> index in totals
+    string_pool names;
+    for (long i = 0; i < playlist.size(); ++i) {
+        unsigned int intartist_id = mp3tags.get_mp3_artist_id(playlist.media(i));
+        tr1::unordered_map<unsigned int, uint32_t>::const_iterator it = normalised.find(intartist_id);
+        if (it == normalised.end()) {
+            uint32_t artist = names.intern(lcase(trim(mp3tags.get_artist_name(intartist_id))));
+            it = normalised.insert(make_pair(intartist_id, artist)).first;
+        }
+        artists[i] = it->second;
+        if (it->second >= totals.size()) totals.resize(it->second + 1, 0);
+        ++totals[it->second];
     }
 
-    // Return the number of unique artists found:
-    return artists.size();
+    item_artists.swap(artists);
+    artist_totals.swap(totals);
+    blnartist_counts = true;
+    reset_artist_counts(lngnext_item);
+}
+
+void segment::reset_artist_counts(const long lngfrom) {
+    // Count the artists from playlist item lngfrom onwards
+    if (!blnartist_counts) return;
+    if (lngfrom == 0) {
+        artist_remaining = artist_totals;
+        lngremaining_artists = artist_totals.size();
+        return;
+    }
+    artist_remaining.assign(artist_totals.size(), 0);
+    lngremaining_artists = 0;
+    for (long i = lngfrom; i < (long)item_artists.size(); ++i) {
+        if (artist_remaining[item_artists[i]]++ == 0) ++lngremaining_artists;
+    }
+}
+
+void segment::clear_artist_counts() {
+    blnartist_counts = false;
+    item_artists.clear();
+    artist_totals.clear();
+    artist_remaining.clear();
+    lngremaining_artists = 0;
 }
 
 void segment::item_played() {
@@ -451,179 +505,160 @@ void segment::item_played() {
   ++intnum_played;
 }
 
-int myrand(const int & i) {
-  // Function passed to random_shuffle...
-  return rand()%i;
+void segment::set_pel(const segment_playlist & pel) {
+  // Replace the playlist with a new list. Also does some
+  // internal book-keeping to keep the internal segment state valid
+  // (The playlist's tracks are shared, not copied)
+  playlist = pel;
+  lngnext_item = 0;
+  clear_artist_counts();
+  dtmpel_updated = now();
 }
 
-void alternate_file_list_artists(vector<string> & file_list, mp3_tags & mp3tags, const music_history & musichistory) {
-  // A utility function for segment::generate_playlist.
-  // - Alternate the MP3s in file_list by artist.
-  // - Also try to ensure that songs in the alternated playlist won't be skipped
-  //   because they were played recently (this can cause songs by the same
-  //   artist to play sooner than expected)
-
-  int intproblems = 0; // Count the number of problems encountered while alternating.
-
-  // Make a copy of the music history object for this function to abuse:
-  music_history history(musichistory);
-
-  typedef vector<string> artist_mp3s; // Listing songs by a single artist;
-  map <string, artist_mp3s> mp3s; // MP3s, sorted by artist
-
-  // Also keep a list of the artists, in the order we encountered them.
-  // This is because "map" objects always sort their data by key, but we want
-  // to access the data by the order we originally encountered the artists in
-  list <string> artists; // Using a list so we can delete & insert elements without invalidating iterators
-
-  // How long until a song is allowed to repeat?
-  int intmin_songs_before_song_repeat = (file_list.size() * intprevent_song_repeat_factor) / 100;
-
-  // Go through all the media, sort by artist:
-  vector<string>::const_iterator mp3_iter = file_list.begin();
-  while (mp3_iter != file_list.end()) {
-    // If the song is an MP3 then get the artist. Otherwise assume no artist.
-    string artist = "";
-    if (right(lcase(*mp3_iter), 4) == ".mp3") {
-      // An MP3. Get the artist:
-      artist = lcase(trim(mp3tags.get_mp3_artist(*mp3_iter)));
-    }
-
-    // Add the mp3 to the list of MP3s for this artist:
-    mp3s[artist].push_back(*mp3_iter);
-    // And add new artists to the list of artists (ie, in the order we found them):
-    if (find(artists.begin(), artists.end(), artist) == artists.end()) {
-      artists.push_back(artist);
-    }
-    mp3_iter++;
-  }
-
-  // Adjust the artist order according to recent history (eg, if an artist's song played just before calling
-  // this function, then ensure that songs by the same artist don't play until later)
-  {
-    // Get a list of artists from the music history (most recent artists first)
-    vector <string> recent_artists;
-    {
-//       typedef typeof(musichistory.get_history()) history_list_type;
-      typedef const std::list<std::string> history_list_type;
-      history_list_type history_list(musichistory.get_history()); // Most recent files are at the start of the list
-
-      // Proceed through recently-played music:
-      auto mp3_iter = history_list.begin(); // Start at the most recently-played file
-      int missing_count = 0; // Number of missing recently-played files
-      while (mp3_iter != history_list.end()) {
-        if (!file_exists(*mp3_iter)) {
-          missing_count++;
-          // Output the below to the cout, but not to the log file
-          // (it can be distracting for people checking the log file after they
-          // just moved music around)
-          intproblems++;
-          log_debug("Recently-played file not found, can't check the artist: " + *mp3_iter);
-        }
-        else {
-          string strartist = lcase(trim(mp3tags.get_mp3_artist(*mp3_iter)));
-          // Add the artist to the list of recent artists if it isn't already there:
-          if (find(recent_artists.begin(), recent_artists.end(), strartist) == recent_artists.end()) {
-            recent_artists.push_back(strartist);
-          }
-        }
-        mp3_iter++; // Check the next MP3 (ie, less-recently-played)
-      }
-      if (missing_count > 0) {
-        string strplural1 = (missing_count == 1 ? "" : "s");
-        string strplural2 = (missing_count == 1 ? "it's" : "their");
-        log_warning(itostr(missing_count) + " recently-played song" +
-          strplural1 + " could not be found so I couldn't check " + strplural2 +
-          " artist!");
-      }
-    }
+// Helper functions for segment::save_snapshot() and segment::load_snapshot():
+static void save_sub_cat_snapshot(ostream & out, const struct segment::sub_cat & sub_cat) {
+  write_bin_string(out, sub_cat.strsub_cat);
+  write_bin_string(out, sub_cat.strname);
+  write_bin_string(out, sub_cat.strdir);
+}
 
-    // Now adjust our list of artists so that recently-played artists play later rather than sooner:
-    {
-      vector <string>::const_iterator recent_artist_iter = recent_artists.begin();
-      list <string>::iterator artists_back_iter = artists.end(); // Recent artists go to the back of the list of artists,
-                                                                 // but before artists that have already been moved to the back
-
-      // Proceed through our list of recent artists:
-      while (recent_artist_iter != recent_artists.end()) {
-        // Does our list of artists (for the new playlist) contain a artist for a recently-played MP3?
-        string recent_artist = *recent_artist_iter;
-        list <string>::iterator artist_iter = find(artists.begin(), artists.end(), recent_artist);
-        if (artist_iter != artists.end()) {
-          // Yes, found it. Move it to the back of the list of artists;
-          artists.insert(artists_back_iter, recent_artist);
-          artists.erase(artist_iter);
-          artists_back_iter--; // Less recent artists get pushed to the end, but before the one we just pushed.
-        }
-        recent_artist_iter++; // Now check the next recent artist
-      }
-    }
-  }
+static void load_sub_cat_snapshot(istream & in, struct segment::sub_cat & sub_cat) {
+  sub_cat.strsub_cat = read_bin_string(in);
+  sub_cat.strname    = read_bin_string(in);
+  sub_cat.strdir     = read_bin_string(in);
+}
 
-  // Now produce an artist-alternating output:
-  file_list.clear();
-  list<string>::iterator artist_iter = artists.begin();
-  while (!artists.empty()) {
-    // Find a song by the artist which hasn't played recently:
-    vector<string>::iterator mp3_iter = mp3s[*artist_iter].begin(); // *** THIS BECOMES AN INVALID READ
-    while (mp3_iter != mp3s[*artist_iter].end()) {
-      if (history.song_played_recently(*mp3_iter, intmin_songs_before_song_repeat)) {
-        // Song played recently, try the next song:
-        mp3_iter++;
-      }
-      else {
-        // Song did not play recently, so use it:
-        break; // Stop searching mp3s for the artist
-      }
-    }
+static void save_cat_snapshot(ostream & out, const struct segment::cat & cat) {
+  write_bin_long(out, cat.cat);
+  write_bin_long(out, cat.lngcat);
+  write_bin_string(out, cat.strname);
+}
 
-    // Did we find a song by this artist?
-    if (mp3_iter == mp3s[*artist_iter].end()) {
-      intproblems++;
-      log_debug("Problem alternating playlist artists: Can't find a song by \"" +
-        *artist_iter + "\" that won't have played recently by slot " +
-        itostr(file_list.size() + 1) + " in the new playlist");
-      // But we push a song by the artist into the playlist anyway, so that the
-      // logic of this function doesn't get undermined (eg, what happens in
-      // weird cases when our logic thinks that all the remaining songs have been played
-      // recently?
-      mp3_iter = mp3s[*artist_iter].begin();
-    }
+static void load_cat_snapshot(istream & in, struct segment::cat & cat) {
+  cat.cat     = (seg_category) read_bin_int(in);
+  cat.lngcat  = read_bin_long(in);
+  cat.strname = read_bin_string(in);
+}
 
-    // Add the song to the playlist:
-    file_list.push_back(*mp3_iter);
-    history.song_played_no_db(*mp3_iter, mp3tags.get_mp3_description(*mp3_iter));
-    mp3s[*artist_iter].erase(mp3_iter);
+void segment::save_snapshot(ostream & out) const {
+  // Write the segment to a binary player snapshot
+  if (!blnloaded) LOGIC_ERROR;
 
-    // Delete the artist entry if empty
-    if (mp3s[*artist_iter].empty()) {
-      artist_iter = artists.erase(artist_iter); // *** THIS IS WHAT MAKES THE READ INVALID
-    }
-    else {
-      artist_iter++;
-    }
+  // Format clock & category info:
+  write_bin_long(out, fc.lngfc);
+  write_bin_string(out, fc.strname);
+  write_bin_long(out, fc.segments);
+  save_cat_snapshot(out, cat);
+  save_cat_snapshot(out, alt_cat);
+  save_sub_cat_snapshot(out, sub_cat);
+  save_sub_cat_snapshot(out, alt_sub_cat);
+
+  // Segment-specific info:
+  write_bin_long(out, lngfc_seg);
+  write_bin_long(out, intseg_no);
+  write_bin_long(out, sequence);
+  write_bin_string(out, strspecific_media);
+  write_bin_bool(out, blnpromos);
+  write_bin_bool(out, blnmusic_bed);
+  save_sub_cat_snapshot(out, music_bed);
+  write_bin_bool(out, blncrossfading);
+  write_bin_bool(out, blnmax_age);
+  write_bin_long(out, intmax_age);
+  write_bin_bool(out, blnpremature);
+  write_bin_bool(out, blnrepeat);
+  write_bin_long(out, intmax_items);
+  write_bin_long(out, playback_state);
+  write_bin_long(out, scheduled.dtmstart);
+  write_bin_long(out, scheduled.dtmend);
+  write_bin_long(out, intlength);
+  write_bin_long(out, dtmstart);
+
+  // The playlist, and where we are in it:
+  playlist.save_snapshot(out);
+  write_bin_long(out, lngnext_item);
+  write_bin_long(out, intnum_fetched);
+  write_bin_long(out, intnum_played);
+
+  // Files the playlist was generated from:
+  write_bin_long(out, playlist_sources.size());
+  for (tr1::unordered_set<string>::const_iterator it = playlist_sources.begin(); it != playlist_sources.end(); ++it) {
+    write_bin_string(out, *it);
+  }
+  write_bin_bool(out, blnplaylist_dirty);
+}
 
-    // Jump to the next artist's songs:
+void segment::load_snapshot(istream & in) {
+  // Read the segment from a binary player snapshot
+  reset();
 
-    // Go back to the first artist if we've reached the last artist:
-    if (artist_iter == artists.end()) {
-      artist_iter = artists.begin();
-    }
+  // Format clock & category info:
+  fc.lngfc    = read_bin_long(in);
+  fc.strname  = read_bin_string(in);
+  fc.segments = read_bin_int(in);
+  load_cat_snapshot(in, cat);
+  load_cat_snapshot(in, alt_cat);
+  load_sub_cat_snapshot(in, sub_cat);
+  load_sub_cat_snapshot(in, alt_sub_cat);
+
+  // Segment-specific info:
+  lngfc_seg         = read_bin_long(in);
+  intseg_no         = read_bin_int(in);
+  sequence          = (seg_sequence) read_bin_int(in);
+  strspecific_media = read_bin_string(in);
+  blnpromos         = read_bin_bool(in);
+  blnmusic_bed      = read_bin_bool(in);
+  load_sub_cat_snapshot(in, music_bed);
+  blncrossfading    = read_bin_bool(in);
+  blnmax_age        = read_bin_bool(in);
+  intmax_age        = read_bin_int(in);
+  blnpremature      = read_bin_bool(in);
+  blnrepeat         = read_bin_bool(in);
+  intmax_items      = read_bin_int(in);
+  playback_state    = (enum playback_state) read_bin_int(in);
+  scheduled.dtmstart = read_bin_long(in);
+  scheduled.dtmend   = read_bin_long(in);
+  intlength         = read_bin_int(in);
+  dtmstart          = read_bin_long(in);
+
+  // The playlist, and where we are in it:
+  segment_playlist pel;
+  pel.load_snapshot(in);
+  set_pel(pel);
+  long lngitem = read_bin_long(in);
+  if (lngitem < 0 || lngitem > playlist.size()) my_throw("Invalid playlist position in snapshot: " + ltostr(lngitem));
+  lngnext_item = lngitem;
+  intnum_fetched = read_bin_int(in);
+  intnum_played  = read_bin_int(in);
+
+  // Files the playlist was generated from:
+  long lngcount = read_bin_long(in);
+  if (lngcount < 0) my_throw("Invalid playlist source count in snapshot: " + ltostr(lngcount));
+  for (long i = 0; i < lngcount; ++i) {
+    playlist_sources.insert(read_bin_string(in));
   }
+  blnplaylist_dirty = read_bin_bool(in);
 
-  // Log a warning if we had problems alternating artists:
-  if (intproblems > 0) log_warning("Had " + itostr(intproblems) + " problems while alternating playlist artists. See debug log for more info.");
+  // Everything was successfully loaded:
+  blnloaded = true;
 }
 
-void segment::set_pel(const programming_element_list & pel) {
-  // Replace the programming elements list with a new list. Also does some
-  // internal book-keeping to keep the internal segment state valid
-  programming_elements = pel;
-  next_item = programming_elements.begin();
-  dtmpel_updated = now();
+void segment::check_source_changed(const string & strpath) {
+  // Was the changed file or directory used to generate the playlist? Directory sources are
+  // affected by changes to the files directly inside them (eg: mp3s added or removed).
+  if (playlist_sources.empty() || blnplaylist_dirty) return;
+  if (playlist_sources.count(strpath) != 0) {
+    blnplaylist_dirty = true;
+    return;
+  }
+  string strparent = strpath;
+  if (strparent != "" && strparent[strparent.length() - 1] == '/') strparent.erase(strparent.length() - 1);
+  string::size_type pos = strparent.rfind('/');
+  if (pos != string::npos && playlist_sources.count(strparent.substr(0, pos + 1)) != 0) {
+    blnplaylist_dirty = true;
+  }
 }
 
-void segment::generate_playlist(programming_element_list & pel, const string & strsource, const seg_category pel_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory, const bool blnshuffle) {
+void segment::generate_playlist(segment_playlist & pel, const string & strsource, const seg_category pel_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory, const bool blnshuffle) {
   // Process a directory or M3U file and generate a list of media to play during this segment.
   pel.clear(); // Clear anything already in the program element list.
 
@@ -633,7 +668,7 @@ void segment::generate_playlist(programming_element_list & pel, const string & s
   // apply special logic to see which files to actually use (relevant from, until, etc)
   vector <string> file_list;
 
-  recursive_add_to_string_list(file_list, strsource, 3, db, config);
+  resolve_source(file_list, strsource, 3, db, config);
 
   // Sort the entries:
   sort (file_list.begin(), file_list.end());
@@ -670,68 +705,28 @@ void segment::generate_playlist(programming_element_list & pel, const string & s
   // Remove "disabled" mp3s from the playlist, ie mp3s that the user has disabled through the wizard:
   {
     filter_monitor fm(file_list, "disabled");
-    string strsql = "SELECT strmessage FROM tblplayeroutput WHERE strmsgdesc = " + psql_str("disabled");
-    ap_pg_result rs = db.exec(strsql);
-    // Now load all the "disabled" mp3s into memory, use this list for a more efficient "playlist culling"
-    // process
-    tr1::unordered_set<string> disabled_mp3s;
-
-    while (*rs) {
-      try {
-        vector <string> substrings;
-        string_splitter split(rs->field("strmessage", ""), "||");
-        string strdisabled_mp3 = split;
-        if (strdisabled_mp3 != "")
-          disabled_mp3s.insert(strdisabled_mp3); // Inserting the same key twice has no effect, don't check...
-      } catch_exceptions;
-      (*rs)++;
-    }
-
-    // We've loaded all the "disabled" mp3 paths. Now remove them from the playlist.
-    vector<string>::iterator file = file_list.begin();
-    while(file != file_list.end())
-      if (disabled_mp3s.find(*file) != disabled_mp3s.end())
-        file = file_list.erase(file);
-      else
-        ++file;
+    disabled_tracks.prune(db, file_list);
   }
 
   // Filter out files which have different directories but the same filename.
+  // (Lower-case filenames & descriptions are interned by mp3tags, so only their ids need comparing)
   {
     filter_monitor fm(file_list, "duplicate (file)");
-    vector<string>::iterator i = file_list.begin();
-    tr1::unordered_set<string> unique_fnames;
-    while (i != file_list.end()) {
-      string strfile = lcase(get_short_filename(*i));
-      // Fname already seen?
-      if (unique_fnames.find(strfile) == unique_fnames.end()) {
-        // Not seen yet
-        unique_fnames.insert(strfile);
-        i++;
-      } else {
-        // Already seen:
-        i = file_list.erase(i);
-      }
-    }
+    tr1::unordered_set<unsigned int> unique_fnames;
+    file_list.erase(remove_if(file_list.begin(), file_list.end(), [&](const string & strfile) {
+                      // Fname already seen?
+                      return !unique_fnames.insert(mp3tags.get_file_name_key(strfile)).second;
+                    }), file_list.end());
   }
 
   // Filter out the files which have different filenames, but the same description:
   {
     filter_monitor fm(file_list, "duplicate (description)");
-    vector<string>::iterator i = file_list.begin();
-    tr1::unordered_set<string> unique_descrs;
-    while (i != file_list.end()) {
-      string strdescr = trim(lcase(mp3tags.get_mp3_description(*i)));
-      // Description already seen?
-      if (unique_descrs.find(strdescr) == unique_descrs.end()) {
-        // Not seen yet
-        unique_descrs.insert(strdescr);
-        i++;
-      } else {
-        // Already seen:
-        i = file_list.erase(i);
-      }
-    }
+    tr1::unordered_set<unsigned int> unique_descrs;
+    file_list.erase(remove_if(file_list.begin(), file_list.end(), [&](const string & strfile) {
+                      // Description already seen?
+                      return !unique_descrs.insert(mp3tags.get_description_key(strfile)).second;
+                    }), file_list.end());
   }
 
   // Check for LineIn. Can't be mixed with MP3s, etc
@@ -769,37 +764,20 @@ void segment::generate_playlist(programming_element_list & pel, const string & s
 
   // Shuffle the file list if requested:
   if (blnshuffle) {
-    srand(now());
-    random_shuffle(file_list.begin(), file_list.end(), myrand);
+    // (The seed depends on the segment, its scheduled start and the source, and is logged, so
+    // that the playlist can be reproduced)
+    uint64_t seed = shuffle_seed("playlist|" + ltostr(lngfc_seg) + "|" + format_datetime(scheduled.dtmstart, "%F %T") + "|" + strsource);
+    log_message("Shuffling " + itostr(file_list.size()) + " playlist items (seed " + ulltostr(seed) + ")");
+    seeded_shuffle(file_list.begin(), file_list.end(), seed);
     // If shuffling is enabled, then also alternate the songs based on artist:
     // - This should achieve the desired "artist separation"
-    alternate_file_list_artists(file_list, mp3tags, musichistory);
+    artist_scheduler scheduler;
+    scheduler.schedule(file_list, mp3tags, musichistory);
   }
 
-  // Now populate the programming element list, and add a music bed if appropriate:
-  {
-    vector <string>::iterator i=file_list.begin();
-    while (i != file_list.end()) {
-      // Create a new programming element:
-      programming_element pe;
-      // Basic details:
-      pe.cat = pel_cat;
-      pe.strmedia = *i;
-      pe.strvol = (pel_cat == SCAT_MUSIC ? "MUSIC" : "PROMO");
-      // Add a Music bed?
-      if (blnmusic_bed) {
-        // Yes. Set music bed details:
-        pe.music_bed.strmedia    = get_music_bed_media();
-        pe.music_bed.strvol      = "MUSIC";
-        pe.music_bed.intstart_ms = 0; // Not yet using this functionality.
-        pe.music_bed.intlength_ms = 1000*60*60; // Not yet using this functionality.
-        pe.blnmusic_bed = true;
-      }
-      pe.blnloaded = true;
-      pel.push_back(pe);
-      ++i;
-    }
-  }
+  // Now populate the playlist. Programming elements (and music beds, if appropriate) are
+  // set up as the items are fetched, by get_next_item():
+  pel.assign(file_list, pel_cat, blnmusic_bed);
 
   // Throw an exception if nothing was returned:
   if (pel.size() <= 0) {
@@ -813,7 +791,7 @@ void segment::generate_playlist(programming_element_list & pel, const string & s
 }
 
 // Function called by load_from_db: Prepare a list of programming elements to use, based on the segment parameters.
-void segment::load_pe_list(programming_element_list & pel, const struct cat & cat, const struct sub_cat & sub_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory) {
+void segment::load_pe_list(segment_playlist & pel, const struct cat & cat, const struct sub_cat & sub_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory) {
   // Clear out the current program element list:
   pel.clear();
   bool blnshuffle_pel = false; // Set to true if we are shuffle pel at the end of the function
@@ -869,9 +847,9 @@ void segment::load_pe_list(programming_element_list & pel, const struct cat & ca
       blnshuffle_pel = (sequence == SSEQ_RANDOM);
     }
 
-    // List the music bed items to be used during this segment:
+    // Check that there are music bed items to use during this segment:
     if (blnmusic_bed) {
-      list_music_bed_media(db);
+      music_beds.load(db, music_bed.strsub_cat);
     }
 
     // Build up our list of items to play:
@@ -893,7 +871,7 @@ void segment::revert_down(pg_conn_exec & db, const player_config & config, mp3_t
 
   while (!blndone) {
     // Reset pe list, and current element pointer.
-    programming_element_list pel;
+    segment_playlist pel;
     set_pel(pel);
 
     switch (playback_state) {
@@ -915,7 +893,7 @@ void segment::revert_down(pg_conn_exec & db, const player_config & config, mp3_t
           }
           else {
             // Now load the new playlist & setup the iterator:
-            programming_element_list pel;
+            segment_playlist pel;
             load_pe_list(pel, alt_cat, alt_sub_cat, db, config, mp3tags, musichistory);
             set_pel(pel);
             blndone = true;
@@ -1007,11 +985,14 @@ void segment::load_sub_cat_struct(struct sub_cat & sub_cat, const string strsub_
 
 // A recursive function used to load m3u files that contain directories, and directories which contain m3us:
 // Also applies special logic to format clock sub-category directories
-void segment::recursive_add_to_string_list(vector <string> & file_list, const string & strsource, const int intrecursion_level, pg_conn_exec & db, const player_config & config) {
+void segment::recursive_add_to_string_list(vector <string> & file_list, const source_node & source, pg_conn_exec & db, const player_config & config) {
   // Call a recursive function to load directories, m3us, etc. Directories can contain M3U files
   // And M3U files can list directories. Go down to a maximum of 3 levels of recursion. Also, if
   // we encounter a directory, we check if it is one of the format clock-subdirectories. If it is, then
   // apply special logic to see which files to actually use (relevant from, until, etc)
+  // - The directory listings & M3U contents were already read by scan_playlist_source()
+  const string & strsource = source.strpath;
+  const int intrecursion_level = source.intrecursion_level;
 
   // Bomb out if our recursion level is too low (ie, this function was called incorrectly)
   if (intrecursion_level < 0) LOGIC_ERROR;
@@ -1041,6 +1022,8 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
     file_list.push_back("LineIn");
   }
   else if (strsource == "/dev/cdrom") { // CD-ROM?
+    // The disc can be changed at any time, so don't cache this:
+    ++intuncacheable_sources;
     // Fetch the tracks on the cdrom
     // Logic ripped & adapted from XMMSs cdaudio library
     try {
@@ -1057,6 +1040,8 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
     } catch_exceptions;
   } else if (strsource == "MusicProfile") {
     // A "MusicProfile" source means check the database for a music profile scheduled to play now.
+    // This depends on the time, so it isn't cached (the profile's own source is, though).
+    ++intuncacheable_sources;
     if (intrecursion_level > 0) {
       // Check for & load a music profile into the playlist:
       add_music_profile_to_string_list(file_list, intrecursion_level - 1, db, config);
@@ -1067,9 +1052,10 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
     }
   } else if (file_is_cd_track(strsource)) { // A CD track file?
     file_list.push_back(strsource);
-  } else if (dir_exists(strsource)) { // A directory?
+  } else if (source.type == source_node::SN_DIRECTORY) { // A directory?
     // One of the format clock sub-category directories?
     string strdir = ensure_last_char(strsource, '/');
+    add_playlist_source(source.stamp);
     string strsql = "SELECT lngfc_sub_cat FROM tlkfc_sub_cat WHERE strdir = " + psql_str(strdir);
     ap_pg_result rs = db.exec(strsql);
     if (rs->size() > 0) {
@@ -1088,11 +1074,12 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
       else {
         // Yes. Process records:
         int intadded=0; // Number if items we've added to the file list
+        tr1::unordered_set<string> dir_files(source.names.begin(), source.names.end());
         while (*rs) {
           // Fetch the file from the database:
           string strfile = rs->field("strfile", "");
-          // Exists on the harddrive?
-          if (file_exists(strdir + strfile)) {
+          // Exists on the harddrive? (Names with a path in them aren't in the directory listing)
+          if (strfile.find('/') == string::npos ? dir_files.count(strfile) != 0 : file_exists(strdir + strfile)) {
             // Yes. Add it.
             file_list.push_back(strdir + strfile);
             ++intadded;
@@ -1115,22 +1102,23 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
       int intadded = 0; // Number of files we used under this directory
 
       // Load all MP3 files into the list
-      {
-        dir_list dir(strdir, ".mp3", DT_REG | DT_LNK);
-        while (dir) {
-          string strfile = dir;
-          file_list.push_back(strdir + strfile);
+      for (vector<string>::const_iterator it = source.names.begin(); it != source.names.end(); ++it) {
+        if (lcase(get_file_ext(*it)) == "mp3") {
+          file_list.push_back(strdir + *it);
           ++intadded;
         }
       }
 
       // Load all M3U files into the list (but only if our recursion level is high enough)
-      dir_list dir(strdir, ".m3u", DT_REG | DT_LNK);
-      while (dir) {
-        string strfile = dir;
+      vector<source_node>::const_iterator m3u = source.children.begin();
+      for (vector<string>::const_iterator it = source.names.begin(); it != source.names.end(); ++it) {
+        if (lcase(get_file_ext(*it)) != "m3u") continue;
+        string strfile = *it;
         if (intrecursion_level > 0) {
           // Process contents of the M3U file:
-          recursive_add_to_string_list(file_list, strdir + strfile, intrecursion_level - 1, db, config);
+          if (m3u == source.children.end()) LOGIC_ERROR;
+          recursive_add_to_string_list(file_list, *m3u, db, config);
+          ++m3u;
           ++intadded;
         }
         else {
@@ -1144,7 +1132,8 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
         log_warning("Didn't find any usable files under this directory: " + strdir);
       }
     }
-  } else if (file_exists(strsource)) { // A file?
+  } else if (source.type == source_node::SN_FILE) { // A file?
+    add_playlist_source(source.stamp);
     // What is the file extension?
     string strext=lcase(right(strsource, 4));
     if (strext==".mp3") {
@@ -1152,7 +1141,6 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
       // media which is not relevant at the moment, or which isn't listed
       // in the format clock media table):
       bool blnusemp3 = true; // Set to false if the MP3 cannot be used
-      const string FORMAT_CLOCK_DIR = "/data/radio_retail/stores_software/data/fc/";
 
       // Break source into dir and filename:
       string source_dir, source_file;
@@ -1226,22 +1214,16 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
         log_warning("Not processing M3U file " + strsource + ". I am already at my maxiumum search depth.");
       }
       else {
-        // No. Attempt to open and read lines from the file:
-        ifstream m3u_file(strsource.c_str());
-        if (!m3u_file) {
+        // No. Were we able to read lines from the file?
+        if (!source.blnopened) {
           log_warning("Unable to open M3U file: " + strsource);
         }
         else {
-          // Process all lines in the M3U file:
+          // Process all lines in the M3U file (empty lines and lines beginning with # were skipped):
           int intadded = 0; // Lines we've used from the file:
-          string strline="";
-          while (getline(m3u_file, strline)) {
-            // Skip empty lines and lines beginning with #:
-            if (strline != "" && strline[0] != '#') {
-              // Line should be fine. Process the line:
-              recursive_add_to_string_list(file_list, strline, intrecursion_level - 1, db, config);
-              ++intadded;
-            }
+          for (vector<source_node>::const_iterator line = source.children.begin(); line != source.children.end(); ++line) {
+            recursive_add_to_string_list(file_list, *line, db, config);
+            ++intadded;
           }
           // Did we get any usable lines?
           if (intadded <= 0) {
@@ -1256,7 +1238,51 @@ void segment::recursive_add_to_string_list(vector <string> & file_list, const st
     }
   }
   // Could not find the source:
-  else log_warning("Source not found: \"" + strsource + "\"");
+  else {
+    log_warning("Source not found: \"" + strsource + "\"");
+    // The playlist changes if it appears later:
+    add_playlist_source(source.stamp);
+  }
+}
+
+void segment::resolve_source(vector <string> & file_list, const string & strsource, const int intrecursion_level, pg_conn_exec & db, const player_config & config) {
+  // Add the files listed by a source (see recursive_add_to_string_list) to file_list. Results are
+  // cached until the directories & files they came from change. Format clock media relevance
+  // depends on the date and the segment settings, so those are part of the key.
+  string strkey = strsource + "|" + itostr(intrecursion_level) + "|" + format_datetime(date(), "%F") + "|" +
+                  (blnpremature ? "premature" : "") + "|" + (blnmax_age ? itostr(intmax_age) : "");
+
+  vector<string> resolved;
+  vector<playlist_source_cache::source_stamp> sources;
+  if (source_cache.find(strkey, resolved, sources)) {
+    log_debug("Using the cached file list for " + strsource + " (" + itostr(resolved.size()) + " files)");
+    for (vector<playlist_source_cache::source_stamp>::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+      add_playlist_source(*it);
+    }
+  }
+  else {
+    vector<playlist_source_cache::source_stamp>::size_type intfirst_source = playlist_source_log.size();
+    int intuncacheable_before = intuncacheable_sources;
+    // Read the directories & M3U files in parallel, then check them against the database:
+    source_node root;
+    scan_playlist_source(root, strsource, intrecursion_level);
+    recursive_add_to_string_list(resolved, root, db, config);
+    if (intuncacheable_sources == intuncacheable_before) {
+      source_cache.store(strkey, resolved, vector<playlist_source_cache::source_stamp>(playlist_source_log.begin() + intfirst_source, playlist_source_log.end()));
+    }
+  }
+  file_list.insert(file_list.end(), resolved.begin(), resolved.end());
+}
+
+void segment::add_playlist_source(const playlist_source_cache::source_stamp & source) {
+  playlist_sources.insert(source.strpath);
+  playlist_source_log.push_back(source); // Duplicates are kept, so that each resolve_source() call sees all of its sources
+
+}
+
+void segment::clear_source_cache() {
+  source_cache.clear();
+  disabled_tracks.clear();
 }
 
 /// Utility function for segment::add_music_profile_to_string_list()
@@ -1534,7 +1560,7 @@ void segment::add_music_profile_to_string_list(vector <string> & file_list, cons
   log_message("Loading music profile \"" + (strProfileName=="" ? "default" : strProfileName) + "\": " + strNewMusicSource);
   {
     unsigned int intsize_before = file_list.size();
-    recursive_add_to_string_list(file_list, strNewMusicSource, intrecursion_level, db, config);
+    resolve_source(file_list, strNewMusicSource, intrecursion_level, db, config);
     if (file_list.size() > intsize_before)
       blnload_success = true;
   }
@@ -1544,7 +1570,7 @@ void segment::add_music_profile_to_string_list(vector <string> & file_list, cons
     // There was an error creating the random playlist... attempt to fall back to the default music location...
     unsigned intsize_before = file_list.size();
     log_message("Error loading playlist, attempting to use default music location: " + config.strdefault_music_source);
-    recursive_add_to_string_list(file_list, config.strdefault_music_source, intrecursion_level, db, config);
+    resolve_source(file_list, config.strdefault_music_source, intrecursion_level, db, config);
     if (file_list.size() > intsize_before)
       blnload_success = true;
   }
@@ -1555,7 +1581,7 @@ void segment::add_music_profile_to_string_list(vector <string> & file_list, cons
     // There was an error creating the random playlist... attempt to fall back to the default music location...
     log_message("Error creating playlist, attempting to use default mp3 repository: " + config.dirs.strmp3);
     unsigned int intsize_before = file_list.size();
-    recursive_add_to_string_list(file_list, config.dirs.strmp3, intrecursion_level, db, config);
+    resolve_source(file_list, config.dirs.strmp3, intrecursion_level, db, config);
     if (file_list.size() > intsize_before)
       blnload_success = true;
   }
@@ -1570,46 +1596,3 @@ void segment::add_music_profile_to_string_list(vector <string> & file_list, cons
   write_liveinfo_setting(db, "Music profile", (strProfileName=="") ? "Default profile" : strProfileName);
 }
 
-void segment::list_music_bed_media(pg_conn_exec & db) {
-  // populate music_bed_media (lists the music media to play in this segment)
-  music_bed_media.clear();
-  string strsql = "SELECT strfile, strdir FROM tblfc_media INNER JOIN tlkfc_sub_cat ON tblfc_media.lngsub_cat = tlkfc_sub_cat.lngfc_sub_cat WHERE lngsub_cat = " + music_bed.strsub_cat;
-  ap_pg_result rs = db.exec(strsql);
-  if (rs->size() == 0) my_throw("Could not find music bed media in the database (lngsub_cat=" + music_bed.strsub_cat + ")!");
-
-  while(*rs) {
-    string strfile = ensure_last_char(rs->field("strdir"), '/') + rs->field("strfile");
-    if (!file_exists(strfile)) {
-      log_warning("Music bed media listed in database but not found on disk: " + strfile);
-    }
-    else {
-      music_bed_media.push_back(strfile);
-    }
-    (*rs)++;
-  }
-
-  // Check if we have any music bed files:
-  if (music_bed_media.size() == 0) my_throw("Could not find any Music Bed media!");
-
-  // Shuffle the list:
-  srand(now());
-  random_shuffle(music_bed_media.begin(), music_bed_media.end(), myrand);
-
-  // Now setup the iterator:
-  music_bed_media_it = music_bed_media.begin();
-}
-
-string segment::get_music_bed_media() {
-  // Fetch the next listed music bed item:
-  if (music_bed_media.size() == 0) LOGIC_ERROR;
-
-  string strret = *music_bed_media_it;
-  ++music_bed_media_it;
-
-  if (music_bed_media_it == music_bed_media.end()) {
-    music_bed_media_it=music_bed_media.begin();
-  }
-
-  return strret;
-}
-
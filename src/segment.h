@@ -3,12 +3,18 @@
 #define SEGMENT_H
 
 #include "categories.h"
+#include "disabled_tracks.h"
 #include "player_config.h"
 #include "programming_element.h"
 #include "music_history.h"
+#include "music_bed_pool.h"
+#include "playlist_source_cache.h"
+#include "playlist_source_scan.h"
+#include "segment_playlist.h"
 #include "common/mp3_tags.h"
 #include "common/my_time.h"
 
+#include <tr1/unordered_set>
 #include <vector>
 
 // Segment
@@ -49,6 +55,22 @@ public:
 
   bool blnloaded; // Has data been loaded into this object yet?
 
+  /// Check if a changed file or directory (see dir_watcher.h) was used to generate the playlist,
+  /// and if so set blnplaylist_dirty.
+  void check_source_changed(const string & strpath);
+  bool blnplaylist_dirty; ///< Set when the files the playlist was generated from have changed
+
+  /// Could the segment have been loaded ahead of time? Not if its playlist depends on the current time
+  /// or devices (eg: it reverted to a music profile, or lists a CD).
+  bool time_independent() const { return intuncacheable_sources == 0 && playback_state != PBS_MUSIC_PROFILE; }
+
+  /// Forget how playlist sources were resolved, and which songs are disabled (eg: because the database changed).
+  /// See playlist_source_cache.h and disabled_tracks.h
+  static void clear_source_cache();
+
+  /// Music bed media & their rotation, shared by all segments. See music_bed_pool.h
+  static music_bed_pool music_beds;
+
   // Information about the format clock:
   struct fc {
     long lngfc;     // Database reference
@@ -108,16 +130,32 @@ public:
   datetime dtmstart; // Time when this segment actually starts playing back (we try to keep our segment length constant, regardless of actual start time).
 
   /// List of items to play during this segment.
-  programming_element_list programming_elements;
-  datetime dtmpel_updated; // When was the programming elements list last modified?
+  segment_playlist playlist;
+  datetime dtmpel_updated; // When was the playlist last modified?
 
-  // Replace the programming elements list with a new list. Also does some
+  // Replace the playlist with a new list. Also does some
   // internal book-keeping to keep the internal segment state valid
-  void set_pel(const programming_element_list & pel);
+  void set_pel(const segment_playlist & pel);
+
+  // Write the segment (including the playlist and the current playlist
+  // position) to, or read it from, a binary player snapshot:
+  void save_snapshot(ostream & out) const;
+  void load_snapshot(istream & in);
 
 private:
   // Information used to retrieve the "next" item:
-  programming_element_list::iterator next_item; ///< A pointer to the next item to be returned (if valid etc) by get_next_item
+  long lngnext_item; ///< Position in the playlist of the next item to be returned (if valid etc) by get_next_item
+
+  // Artist counts for count_remaining_playlist_artists(). Built when first needed, and then kept
+  // up to date as lngnext_item moves:
+  bool blnartist_counts;           ///< Have the counts been built for the current playlist?
+  vector<uint32_t> item_artists;   ///< Artist of each playlist item (an index into artist_totals)
+  vector<long> artist_totals;      ///< Number of playlist items by each artist
+  vector<long> artist_remaining;   ///< Number of items by each artist from lngnext_item onwards
+  long lngremaining_artists;       ///< Number of artists with items from lngnext_item onwards
+  void build_artist_counts(mp3_tags & mp3tags);
+  void reset_artist_counts(const long lngfrom); ///< Recount the remaining artists from item lngfrom (if the counts were built)
+  void clear_artist_counts(); ///< The playlist changed
 
   int intnum_fetched; ///< Counts the number of items fetched from the segment.
                       ///< (number of items
@@ -132,10 +170,10 @@ private:
                         ///< in a segment.
 
   // Functions which are used to operate on the above:
-  void generate_playlist(programming_element_list & pel, const string & strsource, const seg_category pel_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory, const bool blnshuffle); // strsource is a playlist, directory, etc.
+  void generate_playlist(segment_playlist & pel, const string & strsource, const seg_category pel_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory, const bool blnshuffle); // strsource is a playlist, directory, etc.
 
   // Function called by load_from_db: Prepare a list of programming elements to use, based on the segment parameters.
-  void load_pe_list(programming_element_list & pel, const struct cat & cat, const struct sub_cat & sub_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory);
+  void load_pe_list(segment_playlist & pel, const struct cat & cat, const struct sub_cat & sub_cat, pg_conn_exec & db, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory);
 
   // If there is a problem with playing category items, we revert to alternate category. If there is also a problem
   // with the alternate category, we attempt to revert to the currently-scheduled music profile. If there are still problems
@@ -148,17 +186,24 @@ private:
   void load_sub_cat_struct(struct sub_cat & sub_cat, const string strsub_cat, pg_connection & db, const struct cat & cat, const long lngfc_seg, const string & strdescr, const string & strfield);
 
   // A recursive function used to load m3u files that contain directories, and directories which contain m3us:
-  // Also applies special logic to format clock sub-category directories
-  void recursive_add_to_string_list(std::vector <std::string> & file_list, const string & strsource, const int intrecursion_level, pg_conn_exec & db, const player_config & config);
+  // Also applies special logic to format clock sub-category directories. Walks a source which was already
+  // scanned by scan_playlist_source().
+  void recursive_add_to_string_list(std::vector <std::string> & file_list, const source_node & source, pg_conn_exec & db, const player_config & config);
+
+  /// Scans a source and calls recursive_add_to_string_list(), but re-uses the result from an earlier call if its sources haven't changed
+  void resolve_source(std::vector <std::string> & file_list, const string & strsource, const int intrecursion_level, pg_conn_exec & db, const player_config & config);
+  static playlist_source_cache source_cache; ///< Results for resolve_source(), shared by all segments
+  static disabled_track_set disabled_tracks; ///< Songs disabled through the wizard, shared by all segments
+  vector<playlist_source_cache::source_stamp> playlist_source_log; ///< playlist_sources (with their stamps), in the order they were added
+  int intuncacheable_sources; ///< Counts sources which can't be cached (eg: they depend on the time)
+  void add_playlist_source(const playlist_source_cache::source_stamp & source); ///< Remember a directory or file the playlist is being generated from
 
   /// Check for an active music profile, add contents to the string vect. Defaults to default music if there is a problem
   void add_music_profile_to_string_list(vector <string> & file_list, const int intrecursion_level, pg_conn_exec & db, const player_config & config);
 
-  // Cached list of music bed items to use during this segment:
-  vector <string> music_bed_media;
-  vector <string>::const_iterator music_bed_media_it;
-  void list_music_bed_media(pg_conn_exec & db); // Setup the music_bed_media list (and shuffle)
-  string get_music_bed_media();
+  /// Directories (with trailing slashes) and files which the playlist was generated from
+  tr1::unordered_set<string> playlist_sources;
+
 };
 
 // auto_ptr type definition. Conveniance type for code that needs to handle
@@ -0,0 +1,79 @@
+
+#include "segment_playlist.h"
+#include "common/binary_file.h"
+#include "common/exception.h"
+#include "common/my_string.h"
+
+segment_playlist::segment_playlist() : m_cat(SCAT_UNKNOWN), m_blnmusic_bed(false) {
+}
+
+void segment_playlist::assign(const vector<string> & file_list, const seg_category pl_cat, const bool blnmusic_bed) {
+  shared_ptr<track_list> tracks(new track_list);
+  tracks->tracks.reserve(file_list.size());
+  for (vector<string>::const_iterator it = file_list.begin(); it != file_list.end(); ++it) {
+    // Split the media into directory & file name ("LineIn" etc have no directory):
+    string::size_type pos = it->rfind('/');
+    string::size_type name_start = (pos == string::npos ? 0 : pos + 1);
+    track t;
+    t.dir_id = tracks->dirs.intern(it->substr(0, name_start));
+    t.name_offset = tracks->names.length();
+    t.name_length = it->length() - name_start;
+    tracks->names.append(*it, name_start, string::npos);
+    tracks->tracks.push_back(t);
+  }
+  m_tracks = tracks;
+  m_cat = pl_cat;
+  m_blnmusic_bed = blnmusic_bed;
+}
+
+void segment_playlist::clear() {
+  m_tracks.reset();
+  m_cat = SCAT_UNKNOWN;
+  m_blnmusic_bed = false;
+}
+
+string segment_playlist::media(const long lngitem) const {
+  if (lngitem < 0 || lngitem >= size()) LOGIC_ERROR;
+  const track & t = m_tracks->tracks[lngitem];
+  return m_tracks->dirs.get(t.dir_id) + m_tracks->names.substr(t.name_offset, t.name_length);
+}
+
+void segment_playlist::get_item(const long lngitem, programming_element & pe) const {
+  pe.reset();
+  pe.cat = m_cat;
+  pe.strmedia = media(lngitem);
+  pe.strvol = (m_cat == SCAT_MUSIC ? "MUSIC" : "PROMO");
+  if (m_blnmusic_bed) {
+    pe.music_bed.strvol      = "MUSIC";
+    pe.music_bed.intstart_ms = 0; // Not yet using this functionality.
+    pe.music_bed.intlength_ms = 1000*60*60; // Not yet using this functionality.
+    pe.blnmusic_bed = true;
+  }
+  pe.blnloaded = true;
+}
+
+// Write the playlist to a binary player snapshot
+void segment_playlist::save_snapshot(ostream & out) const {
+  write_bin_long(out, m_cat);
+  write_bin_bool(out, m_blnmusic_bed);
+  write_bin_long(out, size());
+  for (long i = 0; i < size(); ++i) {
+    write_bin_string(out, media(i));
+  }
+}
+
+// Read the playlist from a binary player snapshot
+void segment_playlist::load_snapshot(istream & in) {
+  seg_category pl_cat = (seg_category) read_bin_int(in);
+  bool blnmusic_bed = read_bin_bool(in);
+  long lngcount = read_bin_long(in);
+  if (lngcount < 0) my_throw("Invalid playlist length in snapshot: " + ltostr(lngcount));
+  vector<string> file_list;
+  for (long i = 0; i < lngcount; ++i) {
+    file_list.push_back(read_bin_string(in));
+  }
+  assign(file_list, pl_cat, blnmusic_bed);
+}
+
+// A global variable containing the previous music segment's playlist
+segment_playlist prev_music_seg_pel;
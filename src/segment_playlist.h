@@ -0,0 +1,67 @@
+
+#ifndef SEGMENT_PLAYLIST_H
+#define SEGMENT_PLAYLIST_H
+
+#include <iostream>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "categories.h"
+#include "programming_element.h"
+#include "common/string_pool.h"
+
+/// The list of items a segment plays.
+///
+/// Every item in a segment's playlist has the same category, volume and music bed settings, and
+/// only the media differs. So instead of a full programming_element per item, the playlist keeps
+/// compact track records (a directory id plus a file name) and the settings they share, and a
+/// programming_element is only built when an item is fetched (see get_item()).
+///
+/// The tracks can't be changed after they are assigned, and are shared between copies, so copying
+/// a playlist (eg: to remember the previous music segment's playlist) is cheap.
+class segment_playlist {
+public:
+  segment_playlist(); ///< Constructor. The playlist is empty.
+
+  /// Replace the playlist. Items will have the category pl_cat, and a music bed if blnmusic_bed is set.
+  void assign(const vector<string> & file_list, const seg_category pl_cat, const bool blnmusic_bed);
+  void clear(); ///< Make the playlist empty
+
+  long size() const { return m_tracks ? (long)m_tracks->tracks.size() : 0; } ///< Number of items
+  bool empty() const { return size() == 0; }
+  seg_category cat() const { return m_cat; }          ///< Category of the items
+  bool music_bed() const { return m_blnmusic_bed; }   ///< Do the items have a music bed?
+
+  string media(const long lngitem) const; ///< Media of an item (eg: an mp3 path, or "LineIn")
+
+  /// Build the programming element for an item. The music bed media (if any) is left for the caller to choose.
+  void get_item(const long lngitem, programming_element & pe) const;
+
+  // Write the playlist to, or read it from, a binary player snapshot:
+  void save_snapshot(ostream & out) const;
+  void load_snapshot(istream & in);
+
+private:
+  /// An item: the directory it is in, and its file name (in names)
+  struct track {
+    uint32_t dir_id;
+    uint32_t name_offset, name_length;
+  };
+
+  /// The tracks, shared between copies of the playlist:
+  struct track_list {
+    string_pool dirs;      ///< Directories of the tracks (with trailing slashes), usually only a few
+    string names;          ///< File names of the tracks, one after another
+    vector<track> tracks;  ///< The items, in playback order
+  };
+
+  shared_ptr<const track_list> m_tracks; ///< Empty for an empty playlist
+  seg_category m_cat;
+  bool m_blnmusic_bed;
+};
+
+/// A global variable containing the previous music segment's playlist
+extern segment_playlist prev_music_seg_pel;
+
+#endif
@@ -0,0 +1,109 @@
+
+#include "segment_preloader.h"
+#include "common/exception.h"
+#include "common/my_string.h"
+#include "common/psql.h"
+
+segment_preloader::segment_preloader() : m_dtmdelayed(datetime_error), m_blnok(false) {
+}
+
+segment_preloader::~segment_preloader() {
+  wait();
+}
+
+void segment_preloader::start(const string & strdb_conn, const datetime dtmdelayed, find_segment_func find_segment, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory) {
+  discard();
+  m_dtmdelayed = dtmdelayed;
+  m_config = config;
+  m_music_history = musichistory;
+  m_blnok = false;
+  m_strerror = "";
+  m_thread = thread(&segment_preloader::run, this, strdb_conn, find_segment, &mp3tags);
+}
+
+void segment_preloader::discard() {
+  wait();
+  m_dtmdelayed = datetime_error;
+  m_changed_paths.clear();
+  m_segment.reset();
+  m_log.clear();
+}
+
+void segment_preloader::wait() {
+  if (m_thread.joinable()) m_thread.join();
+}
+
+void segment_preloader::check_source_changed(const string & strpath) {
+  if (m_dtmdelayed != datetime_error) m_changed_paths.push_back(strpath);
+}
+
+void segment_preloader::run(const string strdb_conn, find_segment_func find_segment, mp3_tags * mp3tags) {
+  // Load the segment scheduled at m_dtmdelayed. Runs on m_thread.
+  vector<log_info> lookup_log;
+  logging.begin_capture(m_log);
+  try {
+    pg_connection db;
+    db.open(strdb_conn);
+
+    // Which segment? The main thread logs its own lookup when the segment changes, so this one's messages are dropped:
+    logging.begin_capture(lookup_log);
+    long lngfc_seg = find_segment(db, m_config, m_dtmdelayed);
+    logging.begin_capture(m_log);
+
+    ap_segment seg(new segment);
+    seg->load_from_db(db, lngfc_seg, m_dtmdelayed, m_config, *mp3tags, m_music_history);
+    m_segment = std::move(seg);
+    m_blnok = true;
+  }
+  catch(const my_exception & e) {
+    m_strerror = e.get_error();
+  }
+  catch(const exception & e) {
+    m_strerror = e.what();
+  }
+  catch(...) {
+    m_strerror = "Unknown exception";
+  }
+  logging.end_capture();
+}
+
+bool segment_preloader::take(const long lngfc_seg, const datetime dtmdelayed, ap_segment & seg) {
+  if (m_dtmdelayed == datetime_error) return false; // Nothing was preloaded
+  wait();
+
+  // Did any of the segment's files change while it was waiting?
+  if (m_blnok) {
+    for (vector<string>::const_iterator it = m_changed_paths.begin(); it != m_changed_paths.end(); ++it) {
+      m_segment->check_source_changed(*it);
+    }
+  }
+
+  string strreason = "";
+  if (!m_blnok) {
+    strreason = "it could not be loaded: " + m_strerror;
+  }
+  else if (m_segment->lngfc_seg != lngfc_seg) {
+    strreason = "it is segment " + ltostr(m_segment->lngfc_seg) + ", but segment " + ltostr(lngfc_seg) + " is scheduled now";
+  }
+  else if (dtmdelayed < m_segment->scheduled.dtmstart || dtmdelayed > m_segment->scheduled.dtmend) {
+    strreason = "it was loaded for " + format_datetime(m_dtmdelayed, "%T") + ", and now it is " + format_datetime(dtmdelayed, "%T") + " in the Format Clock";
+  }
+  else if (!m_segment->time_independent()) {
+    strreason = "its playlist depends on the current time";
+  }
+  else if (m_segment->blnplaylist_dirty) {
+    strreason = "its files changed";
+  }
+
+  if (strreason != "") {
+    log_message("Not using the preloaded segment: " + strreason);
+    discard();
+    return false;
+  }
+
+  // Log what happened while the segment was loaded, and hand it over:
+  logging.replay(m_log);
+  seg = std::move(m_segment);
+  discard();
+  return true;
+}
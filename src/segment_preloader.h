@@ -0,0 +1,68 @@
+
+#ifndef SEGMENT_PRELOADER_H
+#define SEGMENT_PRELOADER_H
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "music_history.h"
+#include "player_config.h"
+#include "segment.h"
+#include "common/logging.h"
+#include "common/mp3_tags.h"
+#include "common/my_time.h"
+
+/// Loads the next format clock segment on a background thread, a few minutes before it is due,
+/// so that the segment change doesn't have to wait for database queries, directory scans and tag
+/// lookups. When the segment changes, take() hands over the preloaded segment if it still matches.
+///
+/// - The thread uses its own database connection, and copies of the config & music history.
+/// - Its log messages are captured, and only logged (by take()) if the segment gets used.
+/// - Segments whose playlist depends on the current time (eg: music profiles) can't be loaded
+///   ahead of time, see segment::time_independent().
+class segment_preloader {
+public:
+  /// Works out which segment is scheduled at a format clock time. Called on the background thread.
+  typedef long (*find_segment_func)(pg_conn_exec & db, const player_config & config, const datetime dtmdelayed);
+
+  segment_preloader();
+  ~segment_preloader(); ///< Waits for a running preload
+
+  /// Start loading the segment scheduled at dtmdelayed (a format clock time, ie including the
+  /// segment delay). An earlier preload is discarded.
+  void start(const string & strdb_conn, const datetime dtmdelayed, find_segment_func find_segment, const player_config & config, mp3_tags & mp3tags, const music_history & musichistory);
+  datetime preload_time() const { return m_dtmdelayed; } ///< The time the current preload is for (datetime_error if none)
+  void discard(); ///< Wait for a running preload, and forget it
+
+  /// A file or directory changed (see dir_watcher.h). The preloaded segment isn't used if it depends on it.
+  void check_source_changed(const string & strpath);
+
+  /// Hand over the preloaded segment, if it is segment lngfc_seg and was loaded for the part of the
+  /// format clock that dtmdelayed falls in. Waits if the preload is still running. Returns false (and
+  /// logs why) if there is no usable segment.
+  bool take(const long lngfc_seg, const datetime dtmdelayed, ap_segment & seg);
+
+private:
+  thread m_thread;
+  datetime m_dtmdelayed;            ///< Time the preload is for
+  vector<string> m_changed_paths;   ///< Files changed since the preload started (main thread only)
+
+  // Copies for the thread to use, so the main thread can carry on changing its own:
+  player_config m_config;
+  music_history m_music_history;
+
+  // Set by the thread, and read after it is joined:
+  ap_segment m_segment;       ///< The loaded segment
+  vector<log_info> m_log;     ///< Messages logged while loading it
+  bool m_blnok;               ///< Did the load succeed?
+  string m_strerror;          ///< Why not
+
+  void run(const string strdb_conn, find_segment_func find_segment, mp3_tags * mp3tags); ///< Main function of m_thread
+  void wait(); ///< Wait for m_thread to finish
+
+  // Not copyable (owns a thread):
+  segment_preloader(const segment_preloader &);
+  segment_preloader & operator=(const segment_preloader &);
+};
+
+#endif